@@ -35,4 +35,5 @@ BODYSTATUS(ERROR, error)
 BODYSTATUS(CHUNKED, chunked)
 BODYSTATUS(LENGTH, length)
 BODYSTATUS(EOF, eof)
+BODYSTATUS(STALE, stale)
 /*lint -restore */
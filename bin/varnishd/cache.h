@@ -115,6 +115,7 @@ struct SHA256Context;
 struct VSC_C_lck;
 struct waitinglist;
 struct vef_priv;
+struct vcd;
 
 #define DIGEST_LEN		32
 
@@ -170,7 +171,14 @@ enum httpwhence {
 	HTTP_Obj = 3
 };
 
-/* NB: remember to update http_Copy() if you add fields */
+/*
+ * NB: remember to update http_Copy() if you add fields
+ *
+ * The bits of hdf[] not used for flags hold a hash of the header name,
+ * and hdbloom is a bloom filter over the names present.  They make
+ * http_GetHdr() cheap, but must be maintained by everybody who puts
+ * headers into hd[], which is why only cache_http.c should do that.
+ */
 struct http {
 	unsigned		magic;
 #define HTTP_MAGIC		0x6428b5c9
@@ -181,6 +189,8 @@ struct http {
 	txt			*hd;
 	unsigned char		*hdf;
 #define HDF_FILTER		(1 << 0)	/* Filtered by Connection */
+#define HDF_HASH		0xfe		/* Name hash of hd[n] */
+	uint64_t		hdbloom;	/* Names present in hd[] */
 	uint16_t		shd;		/* Size of hd space */
 	uint16_t		nhd;		/* Next free hd */
 	uint16_t		status;
@@ -201,7 +211,9 @@ struct http_conn {
 	unsigned		maxhdr;
 	struct ws		*ws;
 	txt			rxbuf;
+	char			*rxscan;	/* Resume header scan */
 	txt			pipeline;
+	unsigned		reads;		/* read(2) calls */
 };
 
 /*--------------------------------------------------------------------*/
@@ -241,8 +253,10 @@ struct vfp {
 
 extern struct vfp vfp_gunzip;
 extern struct vfp vfp_gzip;
+extern struct vfp vfp_pgzip;
 extern struct vfp vfp_testgzip;
 extern struct vfp vfp_esi;
+extern struct vfp vfp_codec;
 
 /*--------------------------------------------------------------------*/
 
@@ -265,6 +279,10 @@ struct wrw {
 	ssize_t			liov;
 	ssize_t			cliov;
 	unsigned		ciov;	/* Chunked header marker */
+	char			*cbuf;	/* Coalescing buffer */
+	unsigned		scbuf;
+	unsigned		ncbuf;
+	unsigned		zcsent;	/* Zerocopy sends not yet completed */
 };
 
 /*--------------------------------------------------------------------*/
@@ -311,7 +329,7 @@ struct worker {
 	unsigned		wlr;
 
 	/* Lookup stuff */
-	struct SHA256Context	*sha256ctx;
+	struct hsh_ctx		*hshctx;
 
 	struct http_conn	htc[1];
 	struct ws		ws[1];
@@ -328,6 +346,7 @@ struct worker {
 	enum body_status	body_status;
 	struct vfp		*vfp;
 	struct vgz		*vgz_rx;
+	struct vcd		*vcd_rx;
 	struct vef_priv		*vef_priv;
 	unsigned		fetch_failed;
 	unsigned		do_stream;
@@ -336,11 +355,14 @@ struct worker {
 	unsigned		is_gzip;
 	unsigned		do_gunzip;
 	unsigned		is_gunzip;
+	unsigned		do_zstd;
+	unsigned		codec;		/* VCD_* we encode with */
 	unsigned		do_close;
 	char			*h_content_length;
 
 	/* Stream state */
 	struct stream_ctx	*sctx;
+	struct busyobj		*stream_bo;
 
 	/* ESI stuff */
 	struct vep_state	*vep;
@@ -361,6 +383,8 @@ struct worker {
 #define RES_ESI			(1<<4)
 #define RES_ESI_CHILD		(1<<5)
 #define RES_GUNZIP		(1<<6)
+#define RES_GUNZIPPED		(1<<7)
+#define RES_DECODE		(1<<8)
 
 	/* Temporary accounting */
 	struct acct		acct_tmp;
@@ -427,6 +451,13 @@ struct objcore {
 	VTAILQ_ENTRY(objcore)	lru_list;
 	VTAILQ_ENTRY(objcore)	ban_list;
 	struct ban		*ban;
+	/* See struct vryidx */
+	uint32_t		vary_key;
+	unsigned		vary_spec;
+#define OC_VRY_NONE		0
+#define OC_VRY_PLAIN		(~0U)
+	VTAILQ_ENTRY(objcore)	vary_list;
+	struct gunzip_copy	*gunzip_copy;
 };
 
 static inline struct object *
@@ -476,12 +507,46 @@ struct busyobj {
 	unsigned		magic;
 #define BUSYOBJ_MAGIC		0x23b95567
 	uint8_t			*vary;
+
+	/*
+	 * Sessions following a streaming fetch, see HSH_StreamStart().
+	 * The fetcher publishes how much of stream_obj is in storage,
+	 * the followers deliver up to that and wait on cond for more.
+	 * Lock order is objhead->mtx before mtx.
+	 */
+	struct lock		mtx;
+	pthread_cond_t		cond;
+	unsigned		stream_state;
+#define BOS_NONE		0	/* Not streaming */
+#define BOS_STREAM		1	/* Followers may attach */
+#define BOS_FROZEN		2	/* Body complete, no new followers */
+#define BOS_FAILED		3	/* Fetch failed, stays busy */
+#define BOS_DONE		4	/* Unbusied, detached from objcore */
+	unsigned		stream_nfollow;
+	unsigned		stream_nwait;
+	struct object		*stream_obj;
+	ssize_t			stream_len;
+	ssize_t			stream_clen;
 };
 
 /* Object structure --------------------------------------------------*/
 
 VTAILQ_HEAD(storagehead, storage);
 
+/* Uncompressed copy of a gzip'ed body, see RES_Gunzipped() */
+struct gunzip_copy {
+	unsigned		magic;
+#define GUNZIP_COPY_MAGIC	0x6e0b1f47
+	unsigned		state;
+#define GUNZIP_COPY_NONE	0
+#define GUNZIP_COPY_BUSY	1
+#define GUNZIP_COPY_DONE	2
+#define GUNZIP_COPY_FAIL	3
+	unsigned		deliveries;
+	ssize_t			len;
+	struct storagehead	store;
+};
+
 struct object {
 	unsigned		magic;
 #define OBJECT_MAGIC		0x32851d42
@@ -497,6 +562,7 @@ struct object {
 
 	/* XXX: make bitmap */
 	uint8_t			gziped;
+	uint8_t			codec;		/* VCD_*, if not gzip */
 	/* Bit positions in the gzip stream */
 	ssize_t			gzip_start;
 	ssize_t			gzip_last;
@@ -511,6 +577,11 @@ struct object {
 
 	struct http		*http;
 
+	/* Prebuilt deliver headers, see RES_BuildHdrBlock() */
+	txt			hdrblk;
+	const char		*hdrblk_last;
+	unsigned		hdrblk_nhd;
+
 	struct storagehead	store;
 
 	struct storage		*esidata;
@@ -527,6 +598,7 @@ struct sess {
 	int			fd;
 	int			id;
 	unsigned		xid;
+	unsigned		zcon;	/* SO_ZEROCOPY state of fd */
 
 	int			restarts;
 	int			esi_level;
@@ -580,6 +652,7 @@ struct sess {
 	unsigned		handling;
 	unsigned char		sendbody;
 	unsigned char		wantbody;
+	unsigned char		bgfetch;
 	uint16_t		err_code;
 	const char		*err_reason;
 
@@ -593,6 +666,11 @@ struct sess {
 
 	/* The busy objhead we sleep on */
 	struct objhead		*hash_objhead;
+	/* ... or the object HSH_Unbusy() served us, with a ref */
+	struct objcore		*hash_objcore;
+
+	/* The expired object our fetch can revalidate, with a ref */
+	struct object		*stale_obj;
 
 	/* Various internal stuff */
 	struct sessmem		*mem;
@@ -621,6 +699,8 @@ struct vbc {
 	socklen_t		addrlen;
 
 	uint8_t			recycled;
+	unsigned		n_req;		/* Requests sent on it */
+	double			t_idle;		/* When it went idle */
 
 	/* Timeouts */
 	double			first_byte_timeout;
@@ -640,6 +720,8 @@ extern pthread_t VCA_thread;
 
 /* cache_backend.c */
 void VBE_UseHealth(const struct director *vdi);
+void VBE_FirstByte(const struct vbc *vc, double d, int ok);
+double VBE_FirstBytePct(const struct vbc *vc, unsigned pct);
 
 struct vbc *VDI_GetFd(const struct director *, struct sess *sp);
 int VDI_Healthy(const struct director *, const struct sess *sp);
@@ -665,6 +747,7 @@ void BAN_Init(void);
 void BAN_NewObjCore(struct objcore *oc);
 void BAN_DestroyObj(struct objcore *oc);
 int BAN_CheckObject(struct object *o, const struct sess *sp);
+int BAN_Match(const struct object *o, const struct sess *sp);
 void BAN_Reload(const uint8_t *ban, unsigned len);
 struct ban *BAN_TailRef(void);
 void BAN_Compile(void);
@@ -674,6 +757,7 @@ double BAN_Time(const struct ban *ban);
 
 /* cache_center.c [CNT] */
 void CNT_Session(struct sess *sp);
+void CNT_Refresh(struct sess *sp, struct objcore *oc, struct objcore *stale);
 void CNT_Init(void);
 
 /* cache_cli.c [CLI] */
@@ -707,9 +791,21 @@ int FetchError(const struct sess *sp, const char *error);
 int FetchError2(const struct sess *sp, const char *error, const char *more);
 int FetchHdr(struct sess *sp);
 int FetchBody(struct sess *sp);
+void FetchStaleHdr(struct sess *sp);
 int FetchReqBody(struct sess *sp);
 void Fetch_Init(void);
 
+/* cache_codec.c */
+#define VCD_NONE	0
+#define VCD_ZSTD	1
+
+typedef void vcd_sink_f(const struct sess *, const uint8_t *, ssize_t);
+int VCD_Available(unsigned codec);
+const char *VCD_Name(unsigned codec);
+void VCD_ReqNormalize(struct sess *sp);
+int VCD_ReqAccepts(const struct sess *sp, unsigned codec);
+void VCD_Deliver(const struct sess *sp, vcd_sink_f *func);
+
 /* cache_gzip.c */
 struct vgz;
 
@@ -727,6 +823,8 @@ int VGZ_Destroy(struct vgz **);
 void VGZ_UpdateObj(const struct vgz*, struct object *);
 int VGZ_WrwGunzip(const struct sess *, struct vgz *, const void *ibuf,
     ssize_t ibufl, char *obuf, ssize_t obufl, ssize_t *obufp);
+int VGZ_Parallel(const struct sess *sp);
+void VGZ_Init(void);
 
 /* Return values */
 #define VGZ_ERROR	-1
@@ -743,11 +841,15 @@ unsigned http_EstimateWS(const struct http *fm, unsigned how, uint16_t *nhd);
 void HTTP_Init(void);
 void http_ClrHeader(struct http *to);
 unsigned http_Write(struct worker *w, const struct http *hp, int resp);
+unsigned http_WriteBlock(struct worker *w, const struct http *hp,
+    const txt *blk, unsigned nblk);
 void http_CopyResp(struct http *to, const struct http *fm);
 void http_SetResp(struct http *to, const char *proto, uint16_t status,
     const char *response);
 void http_FilterFields(struct worker *w, int fd, struct http *to,
     const struct http *fm, unsigned how);
+unsigned http_FilterBlock(struct ws *ws, const struct http *fm, unsigned how,
+    txt *blk, const char **last);
 void http_FilterHeader(const struct sess *sp, unsigned how);
 void http_PutProtocol(struct worker *w, int fd, const struct http *to,
     const char *protocol);
@@ -776,6 +878,8 @@ const char *http_DoConnection(const struct http *hp);
 void http_CopyHome(struct worker *w, int fd, const struct http *hp);
 void http_Unset(struct http *hp, const char *hdr);
 void http_CollectHdr(struct http *hp, const char *hdr);
+void http_MergeHdr(struct worker *w, int fd, struct http *to,
+    const struct http *fm);
 
 /* cache_httpconn.c */
 void HTC_Init(struct http_conn *htc, struct ws *ws, int fd, unsigned maxbytes,
@@ -808,6 +912,7 @@ void Lck__Assert(const struct lock *lck, int held);
 void LCK_Init(void);
 void Lck_Delete(struct lock *lck);
 void Lck_CondWait(pthread_cond_t *cond, struct lock *lck);
+int Lck_CondWaitUntil(pthread_cond_t *cond, struct lock *lck, double when);
 
 #define Lck_New(a, b) Lck__New(a, b, #b)
 #define Lck_Lock(a) Lck__Lock(a, __func__, __FILE__, __LINE__)
@@ -824,10 +929,12 @@ void PAN_Init(void);
 
 /* cache_pipe.c */
 void PipeSession(struct sess *sp);
+void PIPE_Init(void);
 
 /* cache_pool.c */
 void WRK_Init(void);
 int WRK_QueueSession(struct sess *sp);
+int WRK_QueueFetch(struct sess *sp);
 void WRK_SumStat(struct worker *w);
 
 #define WRW_IsReleased(w)	((w)->wrw.wfd == NULL)
@@ -842,6 +949,9 @@ unsigned WRW_WriteH(struct worker *w, const txt *hh, const char *suf);
 #ifdef SENDFILE_WORKS
 void WRW_Sendfile(struct worker *w, int fd, off_t off, unsigned len);
 #endif  /* SENDFILE_WORKS */
+#ifdef ZEROCOPY_WORKS
+void WRW_SendZeroCopy(struct worker *w, const void *ptr, unsigned len);
+#endif  /* ZEROCOPY_WORKS */
 
 typedef void *bgthread_t(struct sess *, void *priv);
 void WRK_BgThread(pthread_t *thr, const char *name, bgthread_t *func,
@@ -851,6 +961,7 @@ void WRK_BgThread(pthread_t *thr, const char *name, bgthread_t *func,
 void SES_Init(void);
 struct sess *SES_New(void);
 struct sess *SES_Alloc(void);
+struct sess *SES_NewFetch(void);
 void SES_Delete(struct sess *sp);
 void SES_Charge(struct sess *sp);
 
@@ -872,10 +983,10 @@ void WSL_Flush(struct worker *w, int overflow);
 	} while (0)
 
 #define WSP(sess, tag, ...)					\
-	WSL((sess)->wrk, tag, (sess)->fd, __VA_ARGS__)
+	WSL((sess)->wrk, tag, (sess)->id, __VA_ARGS__)
 
 #define WSPR(sess, tag, txt)					\
-	WSLR((sess)->wrk, tag, (sess)->fd, txt)
+	WSLR((sess)->wrk, tag, (sess)->id, txt)
 
 #define INCOMPL() do {							\
 	VSL(SLT_Debug, 0, "INCOMPLETE AT: %s(%d)", __func__, __LINE__); \
@@ -888,20 +999,29 @@ void WSL_Flush(struct worker *w, int overflow);
 
 /* cache_response.c */
 void RES_BuildHttp(const struct sess *sp);
+void RES_BuildHdrBlock(const struct sess *sp);
 void RES_WriteObj(struct sess *sp);
+int RES_Gunzipped(struct sess *sp);
+void RES_GunzipFree(struct objcore *oc);
 void RES_StreamStart(struct sess *sp);
 void RES_StreamEnd(struct sess *sp);
 void RES_StreamPoll(const struct sess *sp);
+void RES_StreamFollow(struct sess *sp);
 
 /* cache_vary.c */
 struct vsb *VRY_Create(const struct sess *sp, const struct http *hp);
 int VRY_Match(struct sess *sp, const uint8_t *vary);
 void VRY_Validate(const uint8_t *vary);
+uint32_t VRY_Key(const uint8_t *vary);
+uint32_t VRY_ReqKey(const struct sess *sp, const uint8_t *names);
+uint8_t *VRY_Names(const uint8_t *vary);
+int VRY_SameNames(const uint8_t *names, const uint8_t *vary);
 
 /* cache_vcl.c */
 void VCL_Init(void);
 void VCL_Refresh(struct VCL_conf **vcc);
 void VCL_Rel(struct VCL_conf **vcc);
+void VCL_Ref(struct VCL_conf *vc);
 void VCL_Poll(void);
 
 #define VCL_MET_MAC(l,u,b) void VCL_##l##_method(struct sess *);
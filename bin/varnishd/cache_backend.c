@@ -32,7 +32,9 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -104,47 +106,189 @@ VBE_ReleaseConn(struct vbc *vc)
 	} while (0)
 
 /*--------------------------------------------------------------------
- * Attempt to connect to a given addrinfo entry.
+ * Connecting to a backend.
  *
- * Must be called with locked backend, but will release the backend
- * lock during the slow/sleeping stuff, so that other worker threads
- * can have a go, while we ponder.
+ * If the backend has both an IPv4 and an IPv6 address, we race them
+ * ("happy eyeballs"):  The preferred family gets connect_fallback
+ * seconds head start, then the other one is tried in parallel, and
+ * the first connection to be established wins.  A family which fails
+ * outright hands over at once.  All of this has to happen within the
+ * connect timeout.
  *
+ * We keep a moving average of the connect time of each family, and
+ * once we have both, the faster one is preferred over prefer_ipv6.
+ * A failed or lost attempt counts as taking at least as long as it
+ * was given, so a blackholed family soon stops going first.
  */
 
+struct vbe_try {
+	int				pf;
+	struct sockaddr_storage		*sa;
+	socklen_t			salen;
+	double				*lat;
+	int				s;
+	double				t;
+};
+
 static int
-vbe_TryConnect(const struct sess *sp, int pf, const struct sockaddr_storage *sa,
-    socklen_t salen, const struct vdi_simple *vs)
+vbe_TryStart(struct vbe_try *vt, double now)
+{
+
+	vt->t = now;
+	vt->s = socket(vt->pf, SOCK_STREAM, 0);
+	if (vt->s < 0)
+		return (-1);
+	(void)VTCP_nonblocking(vt->s);
+	if (connect(vt->s, (const void *)vt->sa, vt->salen) == 0)
+		return (1);
+	if (errno == EINPROGRESS)
+		return (0);
+	AZ(close(vt->s));
+	vt->s = -1;
+	return (-1);
+}
+
+static void
+vbe_TryLat(double *lat, double d, int lower_bound)
 {
-	int s, i, tmo;
-	double tmod;
+
+	if (*lat == 0.)
+		*lat = d;
+	else if (!lower_bound || d > *lat)
+		*lat += (d - *lat) * .25;
+}
+
+int
+VBE_Connect(struct worker *w, struct vbc *vc, struct backend *bp, double tmo)
+{
+	struct vbe_try vt[2], *v6, *v4;
+	struct pollfd pfd[2];
+	int idx[2];
+	int i, k, n, np, err, started, winner, v6first;
+	socklen_t l;
+	double t0, now, dl, wait;
 	char abuf1[VTCP_ADDRBUFSIZE], abuf2[VTCP_ADDRBUFSIZE];
 	char pbuf1[VTCP_PORTBUFSIZE], pbuf2[VTCP_PORTBUFSIZE];
 
-	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
-	CHECK_OBJ_NOTNULL(vs, VDI_SIMPLE_MAGIC);
+	CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(vc, VBC_MAGIC);
+	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+	assert(bp->ipv6 != NULL || bp->ipv4 != NULL);
 
-	s = socket(pf, SOCK_STREAM, 0);
-	if (s < 0)
-		return (s);
+	Lck_Lock(&bp->mtx);
+	if (bp->ipv4 == NULL)
+		v6first = 1;
+	else if (bp->ipv6 == NULL)
+		v6first = 0;
+	else if (bp->ipv4_lat > 0. && bp->ipv6_lat > 0.)
+		v6first = bp->ipv6_lat < bp->ipv4_lat;
+	else
+		v6first = params->prefer_ipv6;
+	Lck_Unlock(&bp->mtx);
 
-	FIND_TMO(connect_timeout, tmod, sp, vs->vrt);
+	n = 0;
+	v6 = v4 = NULL;
+	if (bp->ipv6 != NULL && v6first)
+		v6 = &vt[n++];
+	if (bp->ipv4 != NULL)
+		v4 = &vt[n++];
+	if (bp->ipv6 != NULL && !v6first)
+		v6 = &vt[n++];
+	if (v6 != NULL) {
+		v6->pf = PF_INET6;
+		v6->sa = bp->ipv6;
+		v6->salen = bp->ipv6len;
+		v6->lat = &bp->ipv6_lat;
+	}
+	if (v4 != NULL) {
+		v4->pf = PF_INET;
+		v4->sa = bp->ipv4;
+		v4->salen = bp->ipv4len;
+		v4->lat = &bp->ipv4_lat;
+	}
 
-	tmo = (int)(tmod * 1000.0);
+	t0 = TIM_real();
+	dl = tmo > 0. ? t0 + tmo : 0.;
+	winner = -1;
+	started = 0;
+	while (winner < 0) {
+		now = TIM_real();
+		if (started > 0 && dl > 0. && now >= dl)
+			break;
+		if (started < n && (started == 0 || vt[0].s < 0 ||
+		    now >= vt[0].t + params->connect_fallback)) {
+			i = vbe_TryStart(&vt[started], now);
+			if (i > 0)
+				winner = started;
+			started++;
+			continue;
+		}
+		np = 0;
+		for (k = 0; k < started; k++) {
+			if (vt[k].s < 0)
+				continue;
+			pfd[np].fd = vt[k].s;
+			pfd[np].events = POLLWRNORM;
+			pfd[np].revents = 0;
+			idx[np++] = k;
+		}
+		if (np == 0 && started == n)
+			break;
+		wait = dl > 0. ? dl - now : -1.;
+		if (started < n && (wait < 0. ||
+		    vt[0].t + params->connect_fallback - now < wait))
+			wait = vt[0].t + params->connect_fallback - now;
+		i = poll(pfd, np, wait < 0. ? -1 : (int)(wait * 1e3) + 1);
+		for (k = 0; i > 0 && k < np; k++) {
+			if (pfd[k].revents == 0)
+				continue;
+			l = sizeof err;
+			AZ(getsockopt(pfd[k].fd, SOL_SOCKET, SO_ERROR, &err, &l));
+			if (err == 0) {
+				winner = idx[k];
+				break;
+			}
+			AZ(close(vt[idx[k]].s));
+			vt[idx[k]].s = -1;
+		}
+	}
 
-	i = VTCP_connect(s, sa, salen, tmo);
+	now = TIM_real();
+	Lck_Lock(&bp->mtx);
+	for (k = 0; k < started; k++) {
+		if (k == winner) {
+			vbe_TryLat(vt[k].lat, now - vt[k].t, 0);
+			continue;
+		}
+		if (vt[k].s >= 0) {
+			AZ(close(vt[k].s));
+			vt[k].s = -1;
+			vbe_TryLat(vt[k].lat, now - vt[k].t, 1);
+		} else if (tmo > 0.)
+			vbe_TryLat(vt[k].lat, tmo, 0);
+	}
+	if (winner >= 0)
+		VBE_HIST(bp->vsc, connect, now - t0);
+	Lck_Unlock(&bp->mtx);
 
-	if (i != 0) {
-		AZ(close(s));
+	if (winner < 0) {
+		vc->fd = -1;
+		vc->addr = NULL;
+		vc->addrlen = 0;
 		return (-1);
 	}
 
-	VTCP_myname(s, abuf1, sizeof abuf1, pbuf1, sizeof pbuf1);
-	VTCP_name(sa, salen, abuf2, sizeof abuf2, pbuf2, sizeof pbuf2);
-	WSL(sp->wrk, SLT_BackendOpen, s, "%s %s %s %s %s",
-	    vs->backend->vcl_name, abuf1, pbuf1, abuf2, pbuf2);
-
-	return (s);
+	vc->fd = vt[winner].s;
+	vc->addr = vt[winner].sa;
+	vc->addrlen = vt[winner].salen;
+	(void)VTCP_blocking(vc->fd);
+
+	VTCP_myname(vc->fd, abuf1, sizeof abuf1, pbuf1, sizeof pbuf1);
+	VTCP_name(vc->addr, vc->addrlen, abuf2, sizeof abuf2,
+	    pbuf2, sizeof pbuf2);
+	WSL(w, SLT_BackendOpen, vc->fd, "%s %s %s %s %s",
+	    bp->vcl_name, abuf1, pbuf1, abuf2, pbuf2);
+	return (vc->fd);
 }
 
 /*--------------------------------------------------------------------*/
@@ -152,7 +296,7 @@ vbe_TryConnect(const struct sess *sp, int pf, const struct sockaddr_storage *sa,
 static void
 bes_conn_try(const struct sess *sp, struct vbc *vc, const struct vdi_simple *vs)
 {
-	int s;
+	double tmo;
 	struct backend *bp = vs->backend;
 
 	CHECK_OBJ_NOTNULL(vs, VDI_SIMPLE_MAGIC);
@@ -162,35 +306,14 @@ bes_conn_try(const struct sess *sp, struct vbc *vc, const struct vdi_simple *vs)
 	bp->n_conn++;		/* It mostly works */
 	Lck_Unlock(&bp->mtx);
 
-	s = -1;
-	assert(bp->ipv6 != NULL || bp->ipv4 != NULL);
-
 	/* release lock during stuff that can take a long time */
 
-	if (params->prefer_ipv6 && bp->ipv6 != NULL) {
-		s = vbe_TryConnect(sp, PF_INET6, bp->ipv6, bp->ipv6len, vs);
-		vc->addr = bp->ipv6;
-		vc->addrlen = bp->ipv6len;
-	}
-	if (s == -1 && bp->ipv4 != NULL) {
-		s = vbe_TryConnect(sp, PF_INET, bp->ipv4, bp->ipv4len, vs);
-		vc->addr = bp->ipv4;
-		vc->addrlen = bp->ipv4len;
-	}
-	if (s == -1 && !params->prefer_ipv6 && bp->ipv6 != NULL) {
-		s = vbe_TryConnect(sp, PF_INET6, bp->ipv6, bp->ipv6len, vs);
-		vc->addr = bp->ipv6;
-		vc->addrlen = bp->ipv6len;
-	}
-
-	vc->fd = s;
-	if (s < 0) {
+	FIND_TMO(connect_timeout, tmo, sp, vs->vrt);
+	if (VBE_Connect(sp->wrk, vc, bp, tmo) < 0) {
 		Lck_Lock(&bp->mtx);
 		bp->n_conn--;
 		bp->refcount--;		/* Only keep ref on success */
 		Lck_Unlock(&bp->mtx);
-		vc->addr = NULL;
-		vc->addrlen = 0;
 	}
 }
 
@@ -198,6 +321,11 @@ bes_conn_try(const struct sess *sp, struct vbc *vc, const struct vdi_simple *vs)
  * Check that there is still something at the far end of a given socket.
  * We poll the fd with instant timeout, if there are any events we can't
  * use it (backends are not allowed to pipeline).
+ *
+ * The connection pool thread closes the idle connections the backend
+ * has closed in bulk, so this rarely fails, but it still has to be
+ * done here:  A retry of the fetch goes through the director again,
+ * a request body can not be sent twice and pipe has no retry at all.
  */
 
 static int
@@ -217,8 +345,8 @@ vbe_CheckFd(int fd)
  * XXX: so we can see if it has any effect.
  */
 
-static struct vbc *
-vbe_NewConn(void)
+struct vbc *
+VBE_NewConn(void)
 {
 	struct vbc *vc;
 
@@ -343,6 +471,8 @@ vbe_GetVbe(const struct sess *sp, struct vdi_simple *vs)
 			assert(vc->fd >= 0);
 			AN(vc->addr);
 			VTAILQ_REMOVE(&bp->connlist, vc, list);
+			bp->n_idle--;
+			VBE_HIST(bp->vsc, reuse, TIM_real() - vc->t_idle);
 		}
 		Lck_Unlock(&bp->mtx);
 		if (vc == NULL)
@@ -350,6 +480,7 @@ vbe_GetVbe(const struct sess *sp, struct vdi_simple *vs)
 		if (vbe_CheckFd(vc->fd)) {
 			/* XXX locking of stats */
 			VSC_C_main->backend_reuse += 1;
+			vc->n_req++;
 			WSP(sp, SLT_Backend, "%d %s %s",
 			    vc->fd, sp->director->vcl_name, bp->vcl_name);
 			vc->vdis = vs;
@@ -380,7 +511,7 @@ vbe_GetVbe(const struct sess *sp, struct vdi_simple *vs)
 		return (NULL);
 	}
 
-	vc = vbe_NewConn();
+	vc = VBE_NewConn();
 	assert(vc->fd == -1);
 	AZ(vc->backend);
 	bes_conn_try(sp, vc, vs);
@@ -390,6 +521,7 @@ vbe_GetVbe(const struct sess *sp, struct vdi_simple *vs)
 		return (NULL);
 	}
 	vc->backend = bp;
+	vc->n_req = 1;
 	VSC_C_main->backend_conn++;
 	WSP(sp, SLT_Backend, "%d %s %s",
 	    vc->fd, sp->director->vcl_name, bp->vcl_name);
@@ -417,6 +549,113 @@ vdi_get_backend_if_simple(const struct director *d)
 	return (vs->backend);
 }
 
+/*--------------------------------------------------------------------
+ * Load hints for the balancing directors:  The connections in use to,
+ * and the average first byte time of, the backend of a simple director.
+ * Other directors have neither.  Read without locking.
+ */
+
+unsigned
+VBE_InFlight(const struct director *d)
+{
+	const struct backend *b;
+
+	b = vdi_get_backend_if_simple(d);
+	if (b == NULL)
+		return (0);
+	return (b->n_conn > b->n_idle ? b->n_conn - b->n_idle : 0);
+}
+
+double
+VBE_Latency(const struct director *d)
+{
+	const struct backend *b;
+
+	b = vdi_get_backend_if_simple(d);
+	if (b == NULL)
+		return (0.);
+	return (b->fb_lat);
+}
+
+/*--------------------------------------------------------------------
+ * Fold the time to the first byte of a response into the average of
+ * the backend.  A failed attempt only counts if it took longer than
+ * the average, so that a reset connection does not look fast.
+ *
+ * Successful responses also go into a histogram for VBE_FirstBytePct().
+ * The buckets are half powers of two from 100us, bucket i holds the
+ * times up to 100us * 2^(i/2), and the counts are halved now and then
+ * so that it follows changes in the backend.
+ */
+
+#define VBE_LAT_RATE	8
+#define VBE_FB_BASE	1e-4
+#define VBE_FB_MIN	20
+#define VBE_FB_MAX	1000
+
+void
+VBE_FirstByte(const struct vbc *vc, double d, int ok)
+{
+	struct backend *bp;
+	int i;
+
+	CHECK_OBJ_NOTNULL(vc, VBC_MAGIC);
+	bp = vc->backend;
+	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+	i = 0;
+	if (d > VBE_FB_BASE)
+		i = (int)ceil(2. * log2(d / VBE_FB_BASE));
+	if (i >= VBE_FB_HIST)
+		i = VBE_FB_HIST - 1;
+	Lck_Lock(&bp->mtx);
+	if (bp->fb_lat == 0.)
+		bp->fb_lat = d;
+	else if (ok || d > bp->fb_lat)
+		bp->fb_lat += (d - bp->fb_lat) / VBE_LAT_RATE;
+	bp->vsc->fb_latency = (uint64_t)(bp->fb_lat * 1e6);
+	if (ok) {
+		bp->fb_hist[i]++;
+		if (++bp->fb_n >= VBE_FB_MAX) {
+			bp->fb_n = 0;
+			for (i = 0; i < VBE_FB_HIST; i++) {
+				bp->fb_hist[i] /= 2;
+				bp->fb_n += bp->fb_hist[i];
+			}
+		}
+	}
+	Lck_Unlock(&bp->mtx);
+}
+
+/*
+ * The time by which pct percent of the responses had started, rounded
+ * up to the bucket, or zero if we do not know the backend well enough.
+ */
+
+double
+VBE_FirstBytePct(const struct vbc *vc, unsigned pct)
+{
+	struct backend *bp;
+	unsigned u, n;
+	int i;
+
+	CHECK_OBJ_NOTNULL(vc, VBC_MAGIC);
+	bp = vc->backend;
+	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+	Lck_Lock(&bp->mtx);
+	if (bp->fb_n < VBE_FB_MIN) {
+		Lck_Unlock(&bp->mtx);
+		return (0.);
+	}
+	u = (bp->fb_n * pct + 99) / 100;
+	for (i = 0, n = 0; i < VBE_FB_HIST - 1; i++) {
+		n += bp->fb_hist[i];
+		if (n >= u)
+			break;
+	}
+	Lck_Unlock(&bp->mtx);
+	return (VBE_FB_BASE * pow(2., i / 2.));
+}
+
 /*--------------------------------------------------------------------
  *
  */
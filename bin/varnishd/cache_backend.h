@@ -130,9 +130,17 @@ struct backend {
 	socklen_t		ipv4len;
 	struct sockaddr_storage	*ipv6;
 	socklen_t		ipv6len;
+	double			ipv4_lat;	/* Average connect time */
+	double			ipv6_lat;
 
 	unsigned		n_conn;
-	VTAILQ_HEAD(, vbc)	connlist;
+	unsigned		n_idle;
+	double			fb_lat;		/* Average first byte time */
+#define VBE_FB_HIST		32
+	unsigned		fb_hist[VBE_FB_HIST];
+	unsigned		fb_n;
+	VTAILQ_HEAD(, vbc)	connlist;	/* Idle, most recent first */
+	VTAILQ_ENTRY(backend)	pool;
 
 	struct vbp_target	*probe;
 	unsigned		healthy;
@@ -144,7 +152,12 @@ struct backend {
 
 /* cache_backend.c */
 void VBE_ReleaseConn(struct vbc *vc);
+struct vbc *VBE_NewConn(void);
+int VBE_Connect(struct worker *w, struct vbc *vc, struct backend *bp,
+    double tmo);
 struct backend *vdi_get_backend_if_simple(const struct director *d);
+unsigned VBE_InFlight(const struct director *d);
+double VBE_Latency(const struct director *d);
 
 /* cache_backend_cfg.c */
 extern struct lock VBE_mtx;
@@ -152,10 +165,31 @@ void VBE_DropRefConn(struct backend *);
 void VBE_DropRefVcl(struct backend *);
 void VBE_DropRefLocked(struct backend *b);
 
+/* cache_backend_pool.c */
+void VBE_PoolInsert(struct backend *b);
+void VBE_PoolRemove(struct backend *b);
+void VBE_PoolInit(void);
+
+#define VBE_HIST(vsc, fld, d)				\
+	do {						\
+		if ((d) < 1e-3)				\
+			(vsc)->fld##_1ms++;		\
+		else if ((d) < 1e-2)			\
+			(vsc)->fld##_10ms++;		\
+		else if ((d) < 1e-1)			\
+			(vsc)->fld##_100ms++;		\
+		else if ((d) < 1.0)			\
+			(vsc)->fld##_1s++;		\
+		else if ((d) < 10.0)			\
+			(vsc)->fld##_10s++;		\
+		else					\
+			(vsc)->fld##_more++;		\
+	} while (0)
+
 /* cache_backend_poll.c */
 void VBP_Insert(struct backend *b, struct vrt_backend_probe const *p, const char *hosthdr);
 void VBP_Remove(struct backend *b, struct vrt_backend_probe const *p);
-void VBP_Use(const struct backend *b, const struct vrt_backend_probe const *p);
+void VBP_Use(struct backend *b, const struct vrt_backend_probe *p);
 void VBP_Summary(struct cli *cli, const struct vbp_target *vt);
 
 /* Init functions for directors */
@@ -165,5 +199,7 @@ dir_init_f VRT_init_dir_dns;
 dir_init_f VRT_init_dir_hash;
 dir_init_f VRT_init_dir_random;
 dir_init_f VRT_init_dir_round_robin;
+dir_init_f VRT_init_dir_least_conn;
 dir_init_f VRT_init_dir_fallback;
 dir_init_f VRT_init_dir_client;
+dir_init_f VRT_init_dir_consistent;
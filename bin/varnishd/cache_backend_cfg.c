@@ -62,8 +62,19 @@ static VTAILQ_HEAD(, backend) backends = VTAILQ_HEAD_INITIALIZER(backends);
 static void
 VBE_Nuke(struct backend *b)
 {
+	struct vbc *vbe, *vbe2;
 
 	ASSERT_CLI();
+	VBE_PoolRemove(b);
+	VTAILQ_FOREACH_SAFE(vbe, &b->connlist, list, vbe2) {
+		VTAILQ_REMOVE(&b->connlist, vbe, list);
+		if (vbe->fd >= 0) {
+			AZ(close(vbe->fd));
+			vbe->fd = -1;
+		}
+		vbe->backend = NULL;
+		VBE_ReleaseConn(vbe);
+	}
 	VTAILQ_REMOVE(&backends, b, list);
 	free(b->ipv4);
 	free(b->ipv4_addr);
@@ -99,13 +110,14 @@ VBE_Poll(void)
  * Drop a reference to a backend.
  * The last reference must come from the watcher in the CLI thread,
  * as only that thread is allowed to clean up the backend list.
+ * The connection pool thread never drops the last reference, it
+ * leaves the backend for VBE_Poll() to collect.
  */
 
 void
 VBE_DropRefLocked(struct backend *b)
 {
 	int i;
-	struct vbc *vbe, *vbe2;
 
 	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
 	assert(b->refcount > 0);
@@ -116,15 +128,6 @@ VBE_DropRefLocked(struct backend *b)
 		return;
 
 	ASSERT_CLI();
-	VTAILQ_FOREACH_SAFE(vbe, &b->connlist, list, vbe2) {
-		VTAILQ_REMOVE(&b->connlist, vbe, list);
-		if (vbe->fd >= 0) {
-			AZ(close(vbe->fd));
-			vbe->fd = -1;
-		}
-		vbe->backend = NULL;
-		VBE_ReleaseConn(vbe);
-	}
 	VBE_Nuke(b);
 }
 
@@ -197,8 +200,10 @@ VBE_AddBackend(struct cli *cli, const struct vrt_backend *vb)
 		    b->ipv6len != vb->ipv6_sockaddr[0] ||
 		    memcmp(b->ipv6, vb->ipv6_sockaddr + 1, b->ipv6len)))
 			continue;
+		Lck_Lock(&b->mtx);
 		b->refcount++;
 		b->vsc->vcls++;
+		Lck_Unlock(&b->mtx);
 		return (b);
 	}
 
@@ -243,6 +248,7 @@ VBE_AddBackend(struct cli *cli, const struct vrt_backend *vb)
 	b->admin_health = ah_probe;
 
 	VTAILQ_INSERT_TAIL(&backends, b, list);
+	VBE_PoolInsert(b);
 	VSC_C_main->n_backend++;
 	return (b);
 }
@@ -265,10 +271,14 @@ VRT_init_dir(struct cli *cli, struct director **dir, const char *name,
 		VRT_init_dir_dns(cli, dir, idx, priv);
 	else if (!strcmp(name, "round-robin"))
 		VRT_init_dir_round_robin(cli, dir, idx, priv);
+	else if (!strcmp(name, "least-conn"))
+		VRT_init_dir_least_conn(cli, dir, idx, priv);
 	else if (!strcmp(name, "fallback"))
 		VRT_init_dir_fallback(cli, dir, idx, priv);
 	else if (!strcmp(name, "client"))
 		VRT_init_dir_client(cli, dir, idx, priv);
+	else if (!strcmp(name, "consistent"))
+		VRT_init_dir_consistent(cli, dir, idx, priv);
 	else
 		INCOMPL();
 }
@@ -512,4 +522,5 @@ VBE_Init(void)
 
 	Lck_New(&VBE_mtx, lck_vbe);
 	CLI_AddFuncs(backend_cmds);
+	VBE_PoolInit();
 }
@@ -28,15 +28,23 @@
  *
  * Poll backends for collection of health statistics
  *
- * We co-opt threads from the worker pool for probing the backends,
- * but we want to avoid a potentially messy cleanup operation when we
- * retire the backend, so the thread owns the health information, which
+ * A single thread runs all the probes as non-blocking state machines,
+ * so a thousand probed backends do not cost a thousand sleeping threads.
+ *
+ * We want to avoid a potentially messy cleanup operation when we
+ * retire the backend, so the probe owns the health information, which
  * the backend references, rather than the other way around.
  *
+ * Probe targets are shared by every backend, in every VCL, which probes
+ * the same addresses with the same request and timing, so reloading a
+ * VCL neither adds probe traffic nor restarts the health history.  Each
+ * backend follows the target of the probe in its active VCL.
+ *
  */
 
 #include "config.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
@@ -46,6 +54,7 @@
 
 #include <sys/socket.h>
 
+#include "binary_heap.h"
 #include "cli_priv.h"
 #include "cache.h"
 #include "vrt.h"
@@ -59,6 +68,9 @@ struct vbp_vcl {
 #define VBP_VCL_MAGIC			0x70829764
 
 	VTAILQ_ENTRY(vbp_vcl)		list;
+	struct backend			*backend;
+	struct vbp_target		*target;
+	unsigned			use;
 	const struct vrt_backend_probe	*probep;
 	struct vrt_backend_probe	probe;
 	const char			*hosthdr;
@@ -68,15 +80,37 @@ struct vbp_target {
 	unsigned			magic;
 #define VBP_TARGET_MAGIC		0x6b7cb656
 
-	struct backend			*backend;
 	VTAILQ_HEAD( ,vbp_vcl)		vcls;
 
+	/* What we probe, the key for sharing targets */
+	struct sockaddr_storage		*ipv4;
+	socklen_t			ipv4len;
+	struct sockaddr_storage		*ipv6;
+	socklen_t			ipv6len;
 	struct vrt_backend_probe	probe;
 	int				stop;
 	struct vsb			*vsb;
 	char				*req;
 	int				req_len;
 
+	/* The probe in progress */
+	enum {
+		VBP_IDLE = 0,
+		VBP_CONNECT,
+		VBP_RECV,
+		VBP_DONE,
+	}				state;
+	int				s;
+	int				pf;
+	int				fam;
+	double				t_start;
+	unsigned			rlen;
+
+	/* Schedule */
+	double				due;
+	unsigned			heap_idx;
+	VTAILQ_ENTRY(vbp_target)	busy;
+
 	char				resp_buf[128];
 	unsigned			good;
 
@@ -90,129 +124,141 @@ struct vbp_target {
 	double				rate;
 
 	VTAILQ_ENTRY(vbp_target)	list;
-	pthread_t			thread;
 };
 
 static VTAILQ_HEAD(, vbp_target)	vbp_list =
     VTAILQ_HEAD_INITIALIZER(vbp_list);
 
+/* Protected by vbp_mtx */
+static VTAILQ_HEAD(, vbp_target)	vbp_busy =
+    VTAILQ_HEAD_INITIALIZER(vbp_busy);
+static struct binheap			*vbp_heap;
+
 static struct lock			vbp_mtx;
+static pthread_t			vbp_thr;
+static int				vbp_pipe[2];
 
 /*--------------------------------------------------------------------
  * Poke one backend, once, but possibly at both IPv4 and IPv6 addresses.
  *
  * We do deliberately not use the stuff in cache_backend.c, because we
  * want to measure the backends response without local distractions.
+ *
+ * All the steps are non-blocking, the scheduler thread calls
+ * vbp_poke() whenever the socket of a busy target is ready, and
+ * vbp_done() when it is finished or out of time.
  */
 
 static int
-vbp_connect(int pf, const struct sockaddr_storage *sa, socklen_t salen, int tmo)
+vbp_family(const struct vbp_target *vt, int n, int *pf,
+    const struct sockaddr_storage **sa, socklen_t *salen)
 {
-	int s, i;
-
-	s = socket(pf, SOCK_STREAM, 0);
-	if (s < 0)
-		return (s);
-
-	i = VTCP_connect(s, sa, salen, tmo);
-	if (i == 0)
-		return (s);
-	VTCP_close(&s);
+	int v6;
+
+	v6 = params->prefer_ipv6 ? 1 : 0;
+	for (; n < 2; n++) {
+		if ((n == 0) == v6 && vt->ipv6 != NULL) {
+			*pf = PF_INET6;
+			*sa = vt->ipv6;
+			*salen = vt->ipv6len;
+			return (n);
+		}
+		if ((n == 0) != v6 && vt->ipv4 != NULL) {
+			*pf = PF_INET;
+			*sa = vt->ipv4;
+			*salen = vt->ipv4len;
+			return (n);
+		}
+	}
 	return (-1);
 }
 
 static void
-vbp_poke(struct vbp_target *vt)
-{
-	int s, tmo, i;
-	double t_start, t_now, t_end;
-	unsigned rlen, resp;
-	struct backend *bp;
-	char buf[8192], *p;
-	struct pollfd pfda[1], *pfd = pfda;
-
-	bp = vt->backend;
-	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
-
-	t_start = t_now = TIM_real();
-	t_end = t_start + vt->probe.timeout;
-	tmo = (int)round((t_end - t_now) * 1e3);
-
-	s = -1;
-	if (params->prefer_ipv6 && bp->ipv6 != NULL) {
-		s = vbp_connect(PF_INET6, bp->ipv6, bp->ipv6len, tmo);
-		t_now = TIM_real();
-		tmo = (int)round((t_end - t_now) * 1e3);
-		if (s >= 0)
-			vt->good_ipv6 |= 1;
-	}
-	if (tmo > 0 && s < 0 && bp->ipv4 != NULL) {
-		s = vbp_connect(PF_INET, bp->ipv4, bp->ipv4len, tmo);
-		t_now = TIM_real();
-		tmo = (int)round((t_end - t_now) * 1e3);
-		if (s >= 0)
-			vt->good_ipv4 |= 1;
-	}
-	if (tmo > 0 && s < 0 && bp->ipv6 != NULL) {
-		s = vbp_connect(PF_INET6, bp->ipv6, bp->ipv6len, tmo);
-		t_now = TIM_real();
-		tmo = (int)round((t_end - t_now) * 1e3);
-		if (s >= 0)
-			vt->good_ipv6 |= 1;
-	}
-	if (s < 0) {
-		/* Got no connection: failed */
-		return;
-	}
-	if (tmo <= 0) {
-		/* Spent too long time getting it */
-		VTCP_close(&s);
-		return;
+vbp_connect(struct vbp_target *vt)
+{
+	const struct sockaddr_storage *sa;
+	socklen_t salen;
+	int pf;
+
+	assert(vt->s < 0);
+	while (1) {
+		vt->fam = vbp_family(vt, vt->fam, &pf, &sa, &salen);
+		if (vt->fam < 0) {
+			vt->state = VBP_DONE;
+			return;
+		}
+		vt->fam++;
+		vt->pf = pf;
+		vt->s = socket(pf, SOCK_STREAM, 0);
+		if (vt->s < 0)
+			continue;
+		(void)VTCP_nonblocking(vt->s);
+		vt->state = VBP_CONNECT;
+		if (connect(vt->s, (const void *)sa, salen) == 0 ||
+		    errno == EINPROGRESS)
+			return;
+		VTCP_close(&vt->s);
 	}
+}
 
-	/* Send the request */
-	i = write(s, vt->req, vt->req_len);
+static void
+vbp_send(struct vbp_target *vt)
+{
+	int i;
+
+	if (vt->pf == PF_INET6)
+		vt->good_ipv6 |= 1;
+	else
+		vt->good_ipv4 |= 1;
+
+	/* Send the request, it is small enough for the socket buffer */
+	i = write(vt->s, vt->req, vt->req_len);
 	if (i != vt->req_len) {
 		if (i < 0)
 			vt->err_xmit |= 1;
-		VTCP_close(&s);
+		VTCP_close(&vt->s);
+		vt->state = VBP_DONE;
 		return;
 	}
 	vt->good_xmit |= 1;
+	vt->rlen = 0;
+	vt->state = VBP_RECV;
+}
+
+static void
+vbp_recv(struct vbp_target *vt, double now)
+{
+	static char buf[8192];		/* Only used by the scheduler */
+	unsigned resp;
+	char *p;
+	int i;
 
-	pfd->fd = s;
-	rlen = 0;
 	do {
-		pfd->events = POLLIN;
-		pfd->revents = 0;
-		tmo = (int)round((t_end - t_now) * 1e3);
-		if (tmo > 0)
-			i = poll(pfd, 1, tmo);
-		if (i == 0 || tmo <= 0) {
-			VTCP_close(&s);
-			return;
-		}
-		if (rlen < sizeof vt->resp_buf)
-			i = read(s, vt->resp_buf + rlen,
-			    sizeof vt->resp_buf - rlen);
+		if (vt->rlen < sizeof vt->resp_buf)
+			i = read(vt->s, vt->resp_buf + vt->rlen,
+			    sizeof vt->resp_buf - vt->rlen);
 		else
-			i = read(s, buf, sizeof buf);
-		rlen += i;
+			i = read(vt->s, buf, sizeof buf);
+		if (i > 0)
+			vt->rlen += i;
 	} while (i > 0);
 
-	VTCP_close(&s);
+	if (i < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+
+	VTCP_close(&vt->s);
+	vt->state = VBP_DONE;
 
 	if (i < 0) {
 		vt->err_recv |= 1;
 		return;
 	}
 
-	if (rlen == 0)
+	if (vt->rlen == 0)
 		return;
 
 	/* So we have a good receive ... */
-	t_now = TIM_real();
-	vt->last = t_now - t_start;
+	vt->last = now - vt->t_start;
 	vt->good_recv |= 1;
 
 	/* Now find out if we like the response */
@@ -230,6 +276,32 @@ vbp_poke(struct vbp_target *vt)
 		vt->happy |= 1;
 }
 
+static void
+vbp_poke(struct vbp_target *vt, short revents, double now)
+{
+	socklen_t l;
+	int i, err;
+
+	switch (vt->state) {
+	case VBP_CONNECT:
+		l = sizeof err;
+		i = getsockopt(vt->s, SOL_SOCKET, SO_ERROR, &err, &l);
+		if (i == 0 && err == 0 && !(revents & (POLLERR|POLLHUP))) {
+			vbp_send(vt);
+			break;
+		}
+		/* Try the other address, if we have one */
+		VTCP_close(&vt->s);
+		vbp_connect(vt);
+		break;
+	case VBP_RECV:
+		vbp_recv(vt, now);
+		break;
+	default:
+		WRONG("Wrong vbp state");
+	}
+}
+
 /*--------------------------------------------------------------------
  * Record pokings...
  */
@@ -247,12 +319,52 @@ vbp_start_poke(struct vbp_target *vt)
 	vt->resp_buf[0] = '\0';
 }
 
+static void
+vbp_bits(const struct vbp_target *vt, char *bits)
+{
+	unsigned i;
+
+	i = 0;
+#define BITMAP(n, c, t, b)	bits[i++] = (vt->n & 1) ? c : '-';
+#include "cache_backend_poll.h"
+#undef BITMAP
+	bits[i] = '\0';
+}
+
+/* Let a backend know what its target found */
+
+static void
+vbp_tell(const struct vbp_target *vt, struct backend *b, const char *bits)
+{
+	const char *logmsg;
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	if (vt->good >= vt->probe.threshold) {
+		if (b->healthy)
+			logmsg = "Still healthy";
+		else
+			logmsg = "Back healthy";
+		b->healthy = 1;
+	} else {
+		if (b->healthy)
+			logmsg = "Went sick";
+		else
+			logmsg = "Still sick";
+		b->healthy = 0;
+	}
+	VSL(SLT_Backend_health, 0, "%s %s %s %u %u %u %.6f %.6f %s",
+	    b->vcl_name, logmsg, bits,
+	    vt->good, vt->probe.threshold, vt->probe.window,
+	    vt->last, vt->avg, vt->resp_buf);
+	b->vsc->happy = vt->happy;
+}
+
 static void
 vbp_has_poked(struct vbp_target *vt)
 {
+	struct vbp_vcl *vcl;
 	unsigned i, j;
 	uint64_t u;
-	const char *logmsg;
 	char bits[10];
 
 	CHECK_OBJ_NOTNULL(vt, VBP_TARGET_MAGIC);
@@ -264,12 +376,6 @@ vbp_has_poked(struct vbp_target *vt)
 		vt->avg += (vt->last - vt->avg) / vt->rate;
 	}
 
-	i = 0;
-#define BITMAP(n, c, t, b)	bits[i++] = (vt->n & 1) ? c : '-';
-#include "cache_backend_poll.h"
-#undef BITMAP
-	bits[i] = '\0';
-
 	u = vt->happy;
 	for (i = j = 0; i < vt->probe.window; i++) {
 		if (u & 1)
@@ -278,24 +384,10 @@ vbp_has_poked(struct vbp_target *vt)
 	}
 	vt->good = j;
 
-	if (vt->good >= vt->probe.threshold) {
-		if (vt->backend->healthy)
-			logmsg = "Still healthy";
-		else
-			logmsg = "Back healthy";
-		vt->backend->healthy = 1;
-	} else {
-		if (vt->backend->healthy)
-			logmsg = "Went sick";
-		else
-			logmsg = "Still sick";
-		vt->backend->healthy = 0;
-	}
-	VSL(SLT_Backend_health, 0, "%s %s %s %u %u %u %.6f %.6f %s",
-	    vt->backend->vcl_name, logmsg, bits,
-	    vt->good, vt->probe.threshold, vt->probe.window,
-	    vt->last, vt->avg, vt->resp_buf);
-	vt->backend->vsc->happy = vt->happy;
+	vbp_bits(vt, bits);
+	VTAILQ_FOREACH(vcl, &vt->vcls, list)
+		if (vcl->use)
+			vbp_tell(vt, vcl->backend, bits);
 }
 
 /*--------------------------------------------------------------------
@@ -323,39 +415,175 @@ vbp_build_req(struct vsb *vsb, const struct vbp_vcl *vcl)
 }
 
 /*--------------------------------------------------------------------
- * One thread per backend to be poked.
+ * The schedule is a binheap of all targets, ordered by when they next
+ * need attention:  The start of the next probe for idle targets, the
+ * timeout for busy ones.  The next start is jittered by +/- 10% of the
+ * interval so that backends which were added together, typically
+ * because they are in the same VCL, do not get probed in lockstep.
  */
 
-static void *
-vbp_wrk_poll_backend(void *priv)
+static double
+vbp_jitter(double interval)
+{
+
+	return (interval * (0.9 + 0.2 * scalbn(random(), -31)));
+}
+
+static int
+vbp_cmp(void *priv, void *a, void *b)
+{
+	const struct vbp_target *aa, *bb;
+
+	AZ(priv);
+	CAST_OBJ_NOTNULL(aa, a, VBP_TARGET_MAGIC);
+	CAST_OBJ_NOTNULL(bb, b, VBP_TARGET_MAGIC);
+	return (aa->due < bb->due);
+}
+
+static void
+vbp_update(void *priv, void *p, unsigned u)
 {
 	struct vbp_target *vt;
-	struct vbp_vcl *vcl = NULL;
 
-	THR_SetName("backend poll");
+	AZ(priv);
+	CAST_OBJ_NOTNULL(vt, p, VBP_TARGET_MAGIC);
+	vt->heap_idx = u;
+}
+
+static void
+vbp_wakeup(void)
+{
 
-	CAST_OBJ_NOTNULL(vt, priv, VBP_TARGET_MAGIC);
+	(void)write(vbp_pipe[1], "", 1);
+}
 
-	while (!vt->stop) {
-		Lck_Lock(&vbp_mtx);
-		if (VTAILQ_FIRST(&vt->vcls) != vcl) {
-			vcl = VTAILQ_FIRST(&vt->vcls);
-			vbp_build_req(vt->vsb, vcl);
-			vt->probe = vcl->probe;
+static void
+vbp_start(struct vbp_target *vt, double now)
+{
+
+	Lck_AssertHeld(&vbp_mtx);
+	vbp_start_poke(vt);
+	vt->t_start = now;
+	vt->due = now + vt->probe.timeout;
+	vt->fam = 0;
+	vbp_connect(vt);
+	VTAILQ_INSERT_TAIL(&vbp_busy, vt, busy);
+	binheap_reorder(vbp_heap, vt->heap_idx);
+}
+
+static void
+vbp_done(struct vbp_target *vt, double now)
+{
+
+	Lck_AssertHeld(&vbp_mtx);
+	if (vt->s >= 0)
+		VTCP_close(&vt->s);
+	VTAILQ_REMOVE(&vbp_busy, vt, busy);
+	vt->state = VBP_IDLE;
+	vbp_has_poked(vt);
+	vt->due = now + vbp_jitter(vt->probe.interval);
+	binheap_reorder(vbp_heap, vt->heap_idx);
+}
+
+static void
+vbp_free(struct vbp_target *vt)
+{
+
+	CHECK_OBJ_NOTNULL(vt, VBP_TARGET_MAGIC);
+	assert(vt->s < 0);
+	free(vt->ipv4);
+	free(vt->ipv6);
+	VSB_delete(vt->vsb);
+	FREE_OBJ(vt);
+}
+
+static void * __match_proto__(bgthread_t)
+vbp_thread(struct sess *sp, void *priv)
+{
+	struct vbp_target *vt, *vt2, **pvt = NULL;
+	struct pollfd *pfd = NULL;
+	unsigned npfd = 0, n = 0, u;
+	double now;
+	char buf[64];
+	int i, tmo;
+
+	(void)sp;
+	(void)priv;
+	Lck_Lock(&vbp_mtx);
+	while (1) {
+		now = TIM_real();
+
+		/* Progress the probes which had activity */
+		for (u = 1; u < n; u++) {
+			vt = pvt[u];
+			if (pfd[u].revents == 0 || vt->stop)
+				continue;
+			vbp_poke(vt, pfd[u].revents, now);
+			if (vt->state == VBP_DONE && !vt->stop)
+				vbp_done(vt, now);
+		}
+
+		/* Reap the probes which VBP_Remove() left for us */
+		VTAILQ_FOREACH_SAFE(vt, &vbp_busy, busy, vt2) {
+			if (!vt->stop)
+				continue;
+			if (vt->s >= 0)
+				VTCP_close(&vt->s);
+			VTAILQ_REMOVE(&vbp_busy, vt, busy);
+			vbp_free(vt);
 		}
-		Lck_Unlock(&vbp_mtx);
 
-		vt->req = VSB_data(vt->vsb);
-		vt->req_len = VSB_len(vt->vsb);
+		/* Start the probes which are due, time out the slow ones */
+		while (1) {
+			vt = binheap_root(vbp_heap);
+			if (vt == NULL || vt->due > now)
+				break;
+			if (vt->state == VBP_IDLE)
+				vbp_start(vt, now);
+			if (vt->state == VBP_DONE || vt->due <= now)
+				vbp_done(vt, now);
+		}
 
-		vbp_start_poke(vt);
-		vbp_poke(vt);
-		vbp_has_poked(vt);
+		n = 0;
+		VTAILQ_FOREACH(vt, &vbp_busy, busy)
+			n++;
+		n++;
+		if (n > npfd) {
+			npfd = n * 2;
+			pfd = realloc(pfd, npfd * sizeof *pfd);
+			XXXAN(pfd);
+			pvt = realloc(pvt, npfd * sizeof *pvt);
+			XXXAN(pvt);
+		}
+		pfd[0].fd = vbp_pipe[0];
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		u = 1;
+		VTAILQ_FOREACH(vt, &vbp_busy, busy) {
+			assert(vt->s >= 0);
+			pfd[u].fd = vt->s;
+			pfd[u].events =
+			    vt->state == VBP_CONNECT ? POLLOUT : POLLIN;
+			pfd[u].revents = 0;
+			pvt[u++] = vt;
+		}
+		assert(u == n);
+
+		vt = binheap_root(vbp_heap);
+		if (vt == NULL)
+			tmo = -1;
+		else
+			tmo = (int)ceil((vt->due - now) * 1e3);
 
-		if (!vt->stop)
-			TIM_sleep(vt->probe.interval);
+		Lck_Unlock(&vbp_mtx);
+		i = poll(pfd, n, tmo);
+		assert(i >= 0 || errno == EINTR);
+		if (pfd[0].revents & POLLIN)
+			while (read(vbp_pipe[0], buf, sizeof buf) > 0)
+				continue;
+		Lck_Lock(&vbp_mtx);
 	}
-	return (NULL);
+	NEEDLESS_RETURN(NULL);
 }
 
 /*--------------------------------------------------------------------
@@ -391,10 +619,13 @@ vbp_bitmap(struct cli *cli, char c, uint64_t map, const char *lbl)
 static void
 vbp_health_one(struct cli *cli, const struct vbp_target *vt)
 {
+	const struct vbp_vcl *vcl;
 
-	VCLI_Out(cli, "Backend %s is %s\n",
-	    vt->backend->vcl_name,
-	    vt->backend->healthy ? "Healthy" : "Sick");
+	VTAILQ_FOREACH(vcl, &vt->vcls, list)
+		if (vcl->use)
+			VCLI_Out(cli, "Backend %s is %s\n",
+			    vcl->backend->vcl_name,
+			    vcl->backend->healthy ? "Healthy" : "Sick");
 	VCLI_Out(cli, "Current states  good: %2u threshold: %2u window: %2u\n",
 	    vt->good, vt->probe.threshold, vt->probe.window);
 	VCLI_Out(cli, "Average responsetime of good probes: %.6f\n", vt->avg);
@@ -471,54 +702,130 @@ vbp_new_vcl(const struct vrt_backend_probe *p, const char *hosthdr)
 }
 
 /*--------------------------------------------------------------------
- * Insert/Remove/Use called from cache_backend.c
+ * Find the probe of a backend in a VCL, or any of its probes if p is NULL
  */
 
-void
-VBP_Insert(struct backend *b, const struct vrt_backend_probe *p, const char *hosthdr)
+static struct vbp_vcl *
+vbp_find(const struct backend *b, const struct vrt_backend_probe *p)
 {
 	struct vbp_target *vt;
 	struct vbp_vcl *vcl;
-	int startthread = 0;
+
+	VTAILQ_FOREACH(vt, &vbp_list, list)
+		VTAILQ_FOREACH(vcl, &vt->vcls, list)
+			if (vcl->backend == b && (p == NULL || vcl->probep == p))
+				return (vcl);
+	return (NULL);
+}
+
+static int
+vbp_same_sa(const struct sockaddr_storage *a, socklen_t al,
+    const struct sockaddr_storage *b, socklen_t bl)
+{
+
+	if (a == NULL || b == NULL)
+		return (a == b);
+	return (al == bl && !memcmp(a, b, al));
+}
+
+static void
+vbp_copy_sa(struct sockaddr_storage **dst, socklen_t *dstlen,
+    const struct sockaddr_storage *src, socklen_t srclen)
+{
+
+	if (src == NULL)
+		return;
+	*dst = calloc(sizeof **dst, 1);
+	XXXAN(*dst);
+	memcpy(*dst, src, srclen);
+	*dstlen = srclen;
+}
+
+/*--------------------------------------------------------------------
+ * Find the target which already probes what this VCL wants probed,
+ * or start a new one.
+ */
+
+static struct vbp_target *
+vbp_get_target(const struct backend *b, const struct vbp_vcl *vcl)
+{
+	struct vbp_target *vt;
+	struct vsb *vsb;
 	unsigned u;
 
-	ASSERT_CLI();
-	AN(p);
+	vsb = VSB_new_auto();
+	XXXAN(vsb);
+	vbp_build_req(vsb, vcl);
 
-	if (b->probe == NULL) {
-		ALLOC_OBJ(vt, VBP_TARGET_MAGIC);
-		XXXAN(vt);
-		VTAILQ_INIT(&vt->vcls);
-		vt->backend = b;
-		vt->vsb = VSB_new_auto();
-		XXXAN(vt->vsb);
-		b->probe = vt;
-		startthread = 1;
-		VTAILQ_INSERT_TAIL(&vbp_list, vt, list);
-	} else {
-		vt = b->probe;
+	VTAILQ_FOREACH(vt, &vbp_list, list) {
+		if (!vbp_same_sa(vt->ipv4, vt->ipv4len, b->ipv4, b->ipv4len) ||
+		    !vbp_same_sa(vt->ipv6, vt->ipv6len, b->ipv6, b->ipv6len))
+			continue;
+		if (strcmp(vt->req, VSB_data(vsb)))
+			continue;
+		if (vt->probe.timeout != vcl->probe.timeout ||
+		    vt->probe.interval != vcl->probe.interval ||
+		    vt->probe.window != vcl->probe.window ||
+		    vt->probe.threshold != vcl->probe.threshold ||
+		    vt->probe.exp_status != vcl->probe.exp_status)
+			continue;
+		VSB_delete(vsb);
+		return (vt);
 	}
 
-	VTAILQ_FOREACH(vcl, &vt->vcls, list)
-		assert (vcl->probep != p);
+	ALLOC_OBJ(vt, VBP_TARGET_MAGIC);
+	XXXAN(vt);
+	VTAILQ_INIT(&vt->vcls);
+	vt->vsb = vsb;
+	vt->req = VSB_data(vt->vsb);
+	vt->req_len = VSB_len(vt->vsb);
+	vt->s = -1;
+	vbp_copy_sa(&vt->ipv4, &vt->ipv4len, b->ipv4, b->ipv4len);
+	vbp_copy_sa(&vt->ipv6, &vt->ipv6len, b->ipv6, b->ipv6len);
+
+	/* The target outlives the VCL, so do not keep pointers into it */
+	vt->probe = vcl->probe;
+	vt->probe.url = NULL;
+	vt->probe.request = NULL;
+
+	for (u = 0; u < vt->probe.initial; u++) {
+		vbp_start_poke(vt);
+		vt->happy |= 1;
+		vbp_has_poked(vt);
+	}
+	VTAILQ_INSERT_TAIL(&vbp_list, vt, list);
 
-	vcl = vbp_new_vcl(p, hosthdr);
+	/* The first probe goes out right away */
 	Lck_Lock(&vbp_mtx);
-	VTAILQ_INSERT_TAIL(&vt->vcls, vcl, list);
+	vt->due = TIM_real();
+	binheap_insert(vbp_heap, vt);
 	Lck_Unlock(&vbp_mtx);
+	vbp_wakeup();
+	return (vt);
+}
 
-	if (startthread) {
-		for (u = 0; u < vcl->probe.initial; u++) {
-			vbp_start_poke(vt);
-			vt->happy |= 1;
-			vbp_has_poked(vt);
-		}
-		AZ(pthread_create(&vt->thread, NULL, vbp_wrk_poll_backend, vt));
-	}
+/*--------------------------------------------------------------------
+ * Make the backend follow this probe, and tell it where it stands.
+ */
+
+static void
+vbp_use(struct vbp_vcl *vcl)
+{
+	char bits[10];
+
+	Lck_AssertHeld(&vbp_mtx);
+	vcl->use = 1;
+	vcl->backend->probe = vcl->target;
+	vbp_bits(vcl->target, bits);
+	vbp_tell(vcl->target, vcl->backend, bits);
 }
 
+/*--------------------------------------------------------------------
+ * Insert/Remove/Use called from cache_backend.c
+ */
+
 void
-VBP_Use(const struct backend *b, const struct vrt_backend_probe *p)
+VBP_Insert(struct backend *b, const struct vrt_backend_probe *p, const char *hosthdr)
 {
 	struct vbp_target *vt;
 	struct vbp_vcl *vcl;
@@ -526,19 +833,42 @@ VBP_Use(const struct backend *b, const struct vrt_backend_probe *p)
 	ASSERT_CLI();
 	AN(p);
 	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
-	AN(b->probe);
-	vt = b->probe;
+	AZ(vbp_find(b, p));
 
-	VTAILQ_FOREACH(vcl, &vt->vcls, list) {
-		if (vcl->probep != p)
-			continue;
+	vcl = vbp_new_vcl(p, hosthdr);
+	vcl->backend = b;
+	vt = vbp_get_target(b, vcl);
 
-		Lck_Lock(&vbp_mtx);
-		VTAILQ_REMOVE(&vt->vcls, vcl, list);
-		VTAILQ_INSERT_HEAD(&vt->vcls, vcl, list);
-		Lck_Unlock(&vbp_mtx);
+	Lck_Lock(&vbp_mtx);
+	vcl->target = vt;
+	VTAILQ_INSERT_TAIL(&vt->vcls, vcl, list);
+	if (b->probe == NULL)
+		vbp_use(vcl);
+	Lck_Unlock(&vbp_mtx);
+}
+
+void
+VBP_Use(struct backend *b, const struct vrt_backend_probe *p)
+{
+	struct vbp_vcl *vcl, *old;
+
+	ASSERT_CLI();
+	AN(p);
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	AN(b->probe);
+
+	vcl = vbp_find(b, p);
+	if (vcl == NULL || vcl->use)
 		return;
-	}
+
+	Lck_Lock(&vbp_mtx);
+	VTAILQ_FOREACH(old, &b->probe->vcls, list)
+		if (old->backend == b && old->use)
+			break;
+	AN(old);
+	old->use = 0;
+	vbp_use(vcl);
+	Lck_Unlock(&vbp_mtx);
 }
 
 void
@@ -546,43 +876,47 @@ VBP_Remove(struct backend *b, struct vrt_backend_probe const *p)
 {
 	struct vbp_target *vt;
 	struct vbp_vcl *vcl;
-	void *ret;
 
 	ASSERT_CLI();
 	AN(p);
 	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
 	AN(b->probe);
-	vt = b->probe;
-
-	VTAILQ_FOREACH(vcl, &vt->vcls, list)
-		if (vcl->probep == p)
-			break;
 
+	vcl = vbp_find(b, p);
 	AN(vcl);
+	vt = vcl->target;
 
 	Lck_Lock(&vbp_mtx);
 	VTAILQ_REMOVE(&vt->vcls, vcl, list);
-	Lck_Unlock(&vbp_mtx);
-
-	FREE_OBJ(vcl);
-
-	if (!VTAILQ_EMPTY(&vt->vcls))
+	if (vcl->use) {
+		/* Follow one of the other VCLs, if any */
+		b->probe = NULL;
+		b->healthy = 1;
+		FREE_OBJ(vcl);
+		vcl = vbp_find(b, NULL);
+		if (vcl != NULL)
+			vbp_use(vcl);
+	} else
+		FREE_OBJ(vcl);
+
+	if (!VTAILQ_EMPTY(&vt->vcls)) {
+		Lck_Unlock(&vbp_mtx);
 		return;
+	}
 
-	/* No more polling for this backend */
-
-	b->healthy = 1;
-
-	vt->stop = 1;
-	AZ(pthread_cancel(vt->thread));
-	AZ(pthread_join(vt->thread, &ret));
-
-	b->healthy = 1;
+	/* No more polling for this target */
 
+	binheap_delete(vbp_heap, vt->heap_idx);
 	VTAILQ_REMOVE(&vbp_list, vt, list);
-	b->probe = NULL;
-	VSB_delete(vt->vsb);
-	FREE_OBJ(vt);
+	if (vt->state != VBP_IDLE) {
+		/* The scheduler has the socket, let it clean up */
+		vt->stop = 1;
+		vt = NULL;
+	}
+	Lck_Unlock(&vbp_mtx);
+
+	if (vt != NULL)
+		vbp_free(vt);
 }
 
 /*--------------------------------------------------------------------
@@ -594,5 +928,11 @@ VBP_Init(void)
 {
 
 	Lck_New(&vbp_mtx, lck_vbp);
+	vbp_heap = binheap_new(NULL, vbp_cmp, vbp_update);
+	AN(vbp_heap);
+	AZ(pipe(vbp_pipe));
+	(void)VTCP_nonblocking(vbp_pipe[0]);
+	(void)VTCP_nonblocking(vbp_pipe[1]);
 	CLI_AddFuncs(debug_cmds);
+	WRK_BgThread(&vbp_thr, "backend-poll", vbp_thread, NULL);
 }
@@ -0,0 +1,240 @@
+/*-
+ * Copyright (c) 2011 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * The backend connection pool.
+ *
+ * Idle connections sit on the connlist of their backend, the most
+ * recently used first.  One thread goes over all backends every
+ * backend_pool_sleep seconds and:
+ *
+ *    Closes the idle connections which the backend has closed or sent
+ *    something on, so that fetches rarely have to skip over them.
+ *
+ *    Closes, from the old end, those which have been idle for longer
+ *    than backend_idle_timeout.
+ *
+ *    Opens new connections to healthy backends until there are
+ *    backend_idle_min idle ones.
+ *
+ * The thread holds a reference to the backend while it works on it,
+ * but leaves the last reference for VBE_Poll() in the CLI thread.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <poll.h>
+
+#include "cache.h"
+#include "cache_backend.h"
+
+static VTAILQ_HEAD(, backend) vbe_pool = VTAILQ_HEAD_INITIALIZER(vbe_pool);
+static pthread_t vbe_pool_thr;
+
+/*--------------------------------------------------------------------*/
+
+void
+VBE_PoolInsert(struct backend *b)
+{
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	Lck_Lock(&VBE_mtx);
+	VTAILQ_INSERT_TAIL(&vbe_pool, b, pool);
+	Lck_Unlock(&VBE_mtx);
+}
+
+void
+VBE_PoolRemove(struct backend *b)
+{
+
+	CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+	AZ(b->refcount);
+	Lck_Lock(&VBE_mtx);
+	VTAILQ_REMOVE(&vbe_pool, b, pool);
+	Lck_Unlock(&VBE_mtx);
+}
+
+/*--------------------------------------------------------------------
+ * Close the idle connections which are gone or too old.  We poll them
+ * all with the lock held, but that does not block.
+ */
+
+static void
+vbe_pool_sweep(struct worker *w, struct backend *b, struct pollfd **pp,
+    unsigned *np)
+{
+	VTAILQ_HEAD(, vbc) gone = VTAILQ_HEAD_INITIALIZER(gone);
+	struct vbc *vc, *vc2;
+	struct pollfd *pfd;
+	double t_old;
+	unsigned n;
+
+	t_old = 0.;
+	if (params->backend_idle_timeout > 0.)
+		t_old = TIM_real() - params->backend_idle_timeout;
+
+	Lck_Lock(&b->mtx);
+	if (b->n_idle == 0) {
+		Lck_Unlock(&b->mtx);
+		return;
+	}
+	if (b->n_idle > *np) {
+		*np = b->n_idle * 2;
+		*pp = realloc(*pp, *np * sizeof **pp);
+		XXXAN(*pp);
+	}
+	pfd = *pp;
+	n = 0;
+	VTAILQ_FOREACH(vc, &b->connlist, list) {
+		pfd[n].fd = vc->fd;
+		pfd[n].events = POLLIN;
+		pfd[n].revents = 0;
+		n++;
+	}
+	assert(n == b->n_idle);
+	(void)poll(pfd, n, 0);
+	n = 0;
+	VTAILQ_FOREACH_SAFE(vc, &b->connlist, list, vc2) {
+		if (pfd[n++].revents == 0 && vc->t_idle >= t_old)
+			continue;
+		VTAILQ_REMOVE(&b->connlist, vc, list);
+		VTAILQ_INSERT_TAIL(&gone, vc, list);
+		b->n_idle--;
+	}
+	Lck_Unlock(&b->mtx);
+
+	VTAILQ_FOREACH_SAFE(vc, &gone, list, vc2) {
+		VTAILQ_REMOVE(&gone, vc, list);
+		if (vc->t_idle < t_old)
+			VSC_C_main->backend_idle_close++;
+		else
+			VSC_C_main->backend_toolate++;
+		WSL(w, SLT_BackendClose, vc->fd, "%s", b->vcl_name);
+		WSL_Flush(w, 0);
+		VTCP_close(&vc->fd);
+		Lck_Lock(&b->mtx);
+		assert(b->n_conn > 0);
+		b->n_conn--;
+		Lck_Unlock(&b->mtx);
+		vc->backend = NULL;
+		VBE_ReleaseConn(vc);
+	}
+}
+
+/*--------------------------------------------------------------------
+ * Open connections until there are backend_idle_min idle ones.  If
+ * fetches take them as fast as we open them, we give up until the
+ * next round.
+ */
+
+static void
+vbe_pool_fill(struct worker *w, struct backend *b)
+{
+	struct vbc *vc;
+	unsigned u;
+
+	for (u = 0; u < params->backend_idle_min; u++) {
+		Lck_Lock(&b->mtx);
+		if (b->n_idle >= params->backend_idle_min ||
+		    b->admin_health == ah_sick ||
+		    (b->admin_health == ah_probe && !b->healthy)) {
+			Lck_Unlock(&b->mtx);
+			return;
+		}
+		b->n_conn++;
+		Lck_Unlock(&b->mtx);
+
+		vc = VBE_NewConn();
+		if (VBE_Connect(w, vc, b, params->connect_timeout) < 0) {
+			Lck_Lock(&b->mtx);
+			b->n_conn--;
+			Lck_Unlock(&b->mtx);
+			VBE_ReleaseConn(vc);
+			VSC_C_main->backend_fail++;
+			return;
+		}
+		vc->backend = b;
+		vc->t_idle = TIM_real();
+		Lck_Lock(&b->mtx);
+		VTAILQ_INSERT_HEAD(&b->connlist, vc, list);
+		b->n_idle++;
+		Lck_Unlock(&b->mtx);
+		VSC_C_main->backend_prewarm++;
+	}
+}
+
+/*--------------------------------------------------------------------*/
+
+static void * __match_proto__(bgthread_t)
+vbe_pool_thread(struct sess *sp, void *priv)
+{
+	struct backend *b, **bl = NULL;
+	struct pollfd *pfd = NULL;
+	unsigned nbl = 0, npfd = 0, n, u;
+
+	(void)priv;
+	while (1) {
+		WSL_Flush(sp->wrk, 0);
+		TIM_sleep(params->backend_pool_sleep);
+
+		n = 0;
+		Lck_Lock(&VBE_mtx);
+		VTAILQ_FOREACH(b, &vbe_pool, pool) {
+			CHECK_OBJ_NOTNULL(b, BACKEND_MAGIC);
+			if (n == nbl) {
+				nbl = nbl * 2 + 8;
+				bl = realloc(bl, nbl * sizeof *bl);
+				XXXAN(bl);
+			}
+			Lck_Lock(&b->mtx);
+			if (b->refcount > 0) {
+				b->refcount++;
+				bl[n++] = b;
+			}
+			Lck_Unlock(&b->mtx);
+		}
+		Lck_Unlock(&VBE_mtx);
+
+		for (u = 0; u < n; u++) {
+			b = bl[u];
+			vbe_pool_sweep(sp->wrk, b, &pfd, &npfd);
+			vbe_pool_fill(sp->wrk, b);
+			Lck_Lock(&b->mtx);
+			assert(b->refcount > 0);
+			b->refcount--;
+			Lck_Unlock(&b->mtx);
+		}
+	}
+	NEEDLESS_RETURN(NULL);
+}
+
+/*--------------------------------------------------------------------*/
+
+void
+VBE_PoolInit(void)
+{
+
+	WRK_BgThread(&vbe_pool_thr, "backend-pool", vbe_pool_thread, NULL);
+}
@@ -754,6 +754,37 @@ BAN_CheckObject(struct object *o, const struct sess *sp)
 	return (ban_check_object(o, sp, 1) > 0);
 }
 
+/*--------------------------------------------------------------------
+ * Test an object against the bans newer than it, without moving it on
+ * the ban list, clearing it or logging, as BAN_CheckObject() does.  Used
+ * on busy objects, whose ban list membership is not ours to change, and
+ * for sessions on a waiting list, which have no worker to log with.
+ */
+
+int
+BAN_Match(const struct object *o, const struct sess *sp)
+{
+	struct ban *b;
+	struct objcore *oc;
+	unsigned tests = 0;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+	oc = o->objcore;
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	CHECK_OBJ_NOTNULL(oc->ban, BAN_MAGIC);
+
+	/* Safe without locks, see ban_check_object() */
+	for (b = ban_start; b != oc->ban; b = VTAILQ_NEXT(b, list)) {
+		CHECK_OBJ_NOTNULL(b, BAN_MAGIC);
+		if (b->flags & BAN_F_GONE)
+			continue;
+		if (ban_evaluate(b->spec, o->http, sp->http, &tests))
+			return (1);
+	}
+	return (0);
+}
+
 static struct ban *
 BANLIST_BanRemove(struct ban *b)
 {
@@ -74,7 +74,6 @@ DOT acceptor -> start [style=bold,color=green]
 #include "cache.h"
 #include "hash_slinger.h"
 #include "stevedore.h"
-#include "vsha256.h"
 
 static unsigned xids;
 
@@ -104,7 +103,7 @@ cnt_wait(struct sess *sp)
 			i = HTC_Rx(sp->htc);
 	}
 	if (i == 0) {
-		WSL(sp->wrk, SLT_Debug, sp->fd, "herding");
+		WSL(sp->wrk, SLT_Debug, sp->id, "herding");
 		sp->wrk->stats.sess_herd++;
 		SES_Charge(sp);
 		sp->wrk = NULL;
@@ -157,6 +156,7 @@ DOT }
 static int
 cnt_prepresp(struct sess *sp)
 {
+	struct busyobj *bo;
 
 	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
 	CHECK_OBJ_NOTNULL(sp->obj, OBJECT_MAGIC);
@@ -167,7 +167,13 @@ cnt_prepresp(struct sess *sp)
 
 	sp->wrk->res_mode = 0;
 
-	if ((sp->wrk->h_content_length != NULL || !sp->wrk->do_stream))
+	bo = sp->wrk->stream_bo;
+	if (bo != NULL) {
+		/* Following a fetch, we only know the length it promised */
+		CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+		if (bo->stream_clen >= 0)
+			sp->wrk->res_mode |= RES_LEN;
+	} else if (sp->wrk->h_content_length != NULL || !sp->wrk->do_stream)
 		sp->wrk->res_mode |= RES_LEN;
 
 	if (!sp->disable_esi && sp->obj->esidata != NULL) {
@@ -183,16 +189,26 @@ cnt_prepresp(struct sess *sp)
 
 	if (params->http_gzip_support && sp->obj->gziped &&
 	    !RFC2616_Req_Gzip(sp)) {
-		/*
-		 * We don't know what it uncompresses to
-		 * XXX: we could cache that
-		 */
+		if (!(sp->wrk->res_mode & (RES_ESI|RES_ESI_CHILD)) &&
+		    RES_Gunzipped(sp)) {
+			/* Deliver the uncompressed copy, length and all */
+			sp->wrk->res_mode |= RES_GUNZIPPED;
+		} else {
+			/* We don't know what it uncompresses to */
+			sp->wrk->res_mode &= ~RES_LEN;
+			sp->wrk->res_mode |= RES_GUNZIP;
+		}
+	}
+
+	if (params->http_gzip_support && sp->obj->codec != VCD_NONE &&
+	    !VCD_ReqAccepts(sp, sp->obj->codec)) {
+		/* Decode, and we don't know what it decodes to either */
 		sp->wrk->res_mode &= ~RES_LEN;
-		sp->wrk->res_mode |= RES_GUNZIP;
+		sp->wrk->res_mode |= RES_DECODE;
 	}
 
 	if (!(sp->wrk->res_mode & (RES_LEN|RES_CHUNKED|RES_EOF))) {
-		if (sp->obj->len == 0 && !sp->wrk->do_stream)
+		if (sp->obj->len == 0 && !sp->wrk->do_stream && bo == NULL)
 			/*
 			 * If the object is empty, neither ESI nor GUNZIP
 			 * can make it any different size
@@ -216,7 +232,17 @@ cnt_prepresp(struct sess *sp)
 		sp->obj->last_use = sp->t_resp;	/* XXX: locking ? */
 	}
 	http_Setup(sp->wrk->resp, sp->wrk->ws);
-	RES_BuildHttp(sp);
+	if (bo != NULL) {
+		/* The fetcher adds Content-Length when it is done */
+		Lck_Lock(&bo->mtx);
+		RES_BuildHttp(sp);
+		Lck_Unlock(&bo->mtx);
+		if ((sp->wrk->res_mode & RES_LEN) &&
+		    !http_GetHdr(sp->wrk->resp, H_Content_Length, NULL))
+			http_PrintfHeader(sp->wrk, sp->fd, sp->wrk->resp,
+			    "Content-Length: %jd", (intmax_t)bo->stream_clen);
+	} else
+		RES_BuildHttp(sp);
 	VCL_deliver_method(sp);
 	switch (sp->handling) {
 	case VCL_RET_DELIVER:
@@ -228,6 +254,8 @@ cnt_prepresp(struct sess *sp)
 			VDI_CloseFd(sp);
 			HSH_Drop(sp);
 		} else {
+			if (bo != NULL)
+				HSH_StreamRelease(sp->wrk);
 			(void)HSH_Deref(sp->wrk, NULL, &sp->obj);
 		}
 		AZ(sp->obj);
@@ -273,7 +301,11 @@ cnt_deliver(struct sess *sp)
 	sp->director = NULL;
 	sp->restarts = 0;
 
-	RES_WriteObj(sp);
+	if (sp->wrk->stream_bo != NULL) {
+		RES_StreamFollow(sp);
+		HSH_StreamRelease(sp->wrk);
+	} else
+		RES_WriteObj(sp);
 
 	/* No point in saving the body if it is hit-for-pass */
 	if (sp->obj->objcore != NULL) {
@@ -311,12 +343,18 @@ cnt_done(struct sess *sp)
 
 	AZ(sp->obj);
 	AZ(sp->vbc);
+	AZ(sp->wrk->stream_bo);
 	sp->director = NULL;
 	sp->restarts = 0;
 
+	AZ(sp->stale_obj);
+	sp->bgfetch = 0;
+
 	sp->wrk->do_esi = 0;
 	sp->wrk->do_gunzip = 0;
 	sp->wrk->do_gzip = 0;
+	sp->wrk->do_zstd = 0;
+	sp->wrk->codec = VCD_NONE;
 	sp->wrk->do_stream = 0;
 	sp->wrk->is_gunzip = 0;
 	sp->wrk->is_gzip = 0;
@@ -435,8 +473,26 @@ cnt_error(struct sess *sp)
 	sp->wrk->is_gunzip = 0;
 	sp->wrk->do_gzip = 0;
 	sp->wrk->do_gunzip = 0;
+	sp->wrk->do_zstd = 0;
+	sp->wrk->codec = VCD_NONE;
 	sp->wrk->do_stream = 0;
 
+	if (sp->bgfetch) {
+		/* A failed background fetch, the stale object stays */
+		AZ(sp->obj);
+		AZ(sp->stale_obj);
+		if (sp->objcore != NULL) {
+			AZ(HSH_Deref(sp->wrk, sp->objcore, NULL));
+			sp->objcore = NULL;
+		}
+		sp->director = NULL;
+		sp->wrk->h_content_length = NULL;
+		http_Setup(sp->wrk->beresp, NULL);
+		http_Setup(sp->wrk->bereq, NULL);
+		sp->step = STP_DONE;
+		return (0);
+	}
+
 	w = sp->wrk;
 	if (sp->obj == NULL) {
 		HSH_Prealloc(sp);
@@ -579,6 +635,15 @@ cnt_fetch(struct sess *sp)
 		 */
 		sp->wrk->body_status = RFC2616_Body(sp);
 
+		/*
+		 * If our stale object is still good, we copy its body,
+		 * and to everybody else it looks like a 200 with its
+		 * headers, as updated by the 304.
+		 */
+		if (sp->stale_obj != NULL && !sp->bgfetch &&
+		    http_GetStatus(sp->wrk->beresp) == 304)
+			FetchStaleHdr(sp);
+
 		sp->err_code = http_GetStatus(sp->wrk->beresp);
 
 		/*
@@ -594,24 +659,42 @@ cnt_fetch(struct sess *sp)
 
 		AZ(sp->wrk->do_esi);
 
-		VCL_fetch_method(sp);
+		if (sp->bgfetch && sp->err_code == 304) {
+			/*
+			 * Our stale object is still good, give it a new
+			 * lease on life as it is.  There is no body.
+			 */
+			CHECK_OBJ_NOTNULL(sp->stale_obj, OBJECT_MAGIC);
+			sp->wrk->stats.fetch_bg_304++;
+			sp->stale_obj->exp.entered = sp->wrk->exp.entered;
+			EXP_Rearm(sp->stale_obj);
+			if (sp->wrk->do_close)
+				VDI_CloseFd(sp);
+			else
+				VDI_RecycleFd(sp);
+		} else {
+			VCL_fetch_method(sp);
+
+			switch (sp->handling) {
+			case VCL_RET_HIT_FOR_PASS:
+				if (sp->objcore != NULL)
+					sp->objcore->flags |= OC_F_PASS;
+				sp->step = STP_FETCHBODY;
+				return (0);
+			case VCL_RET_DELIVER:
+				AssertObjCorePassOrBusy(sp->objcore);
+				sp->step = STP_FETCHBODY;
+				return (0);
+			default:
+				break;
+			}
 
-		switch (sp->handling) {
-		case VCL_RET_HIT_FOR_PASS:
-			if (sp->objcore != NULL)
-				sp->objcore->flags |= OC_F_PASS;
-			sp->step = STP_FETCHBODY;
-			return (0);
-		case VCL_RET_DELIVER:
-			AssertObjCorePassOrBusy(sp->objcore);
-			sp->step = STP_FETCHBODY;
-			return (0);
-		default:
-			break;
+			/*
+			 * We are not going to fetch the body, Close the
+			 * connection
+			 */
+			VDI_CloseFd(sp);
 		}
-
-		/* We are not going to fetch the body, Close the connection */
-		VDI_CloseFd(sp);
 	}
 
 	/* Clean up partial fetch */
@@ -622,12 +705,20 @@ cnt_fetch(struct sess *sp)
 		AZ(HSH_Deref(sp->wrk, sp->objcore, NULL));
 		sp->objcore = NULL;
 	}
+	if (sp->stale_obj != NULL)
+		(void)HSH_Deref(sp->wrk, NULL, &sp->stale_obj);
 	http_Setup(sp->wrk->bereq, NULL);
 	http_Setup(sp->wrk->beresp, NULL);
 	sp->wrk->h_content_length = NULL;
 	sp->director = NULL;
 	sp->wrk->storage_hint = NULL;
 
+	if (sp->bgfetch) {
+		/* Background fetches do not restart or report errors */
+		sp->step = STP_DONE;
+		return (0);
+	}
+
 	switch (sp->handling) {
 	case VCL_RET_RESTART:
 		sp->restarts++;
@@ -690,6 +781,10 @@ cnt_fetchbody(struct sess *sp)
 		pass = 0;
 	}
 
+	/* We only need the stale object if we are to copy its body */
+	if (sp->stale_obj != NULL && sp->wrk->body_status != BS_STALE)
+		(void)HSH_Deref(sp->wrk, NULL, &sp->stale_obj);
+
 	/*
 	 * The VCL variables beresp.do_g[un]zip tells us how we want the
 	 * object processed before it is stored.
@@ -708,6 +803,16 @@ cnt_fetchbody(struct sess *sp)
 	/* We do nothing unless the param is set */
 	if (!params->http_gzip_support)
 		sp->wrk->do_gzip = sp->wrk->do_gunzip = 0;
+	if (!params->http_gzip_support)
+		sp->wrk->do_zstd = 0;
+
+	/* A body copied from a stale object is already processed */
+	if (sp->wrk->body_status == BS_STALE) {
+		sp->wrk->do_esi = 0;
+		sp->wrk->do_gzip = sp->wrk->do_gunzip = 0;
+		sp->wrk->do_zstd = 0;
+		sp->wrk->do_stream = 0;
+	}
 
 	sp->wrk->is_gzip =
 	    http_HdrIs(sp->wrk->beresp, H_Content_Encoding, "gzip");
@@ -718,6 +823,34 @@ cnt_fetchbody(struct sess *sp)
 	/* It can't be both */
 	assert(sp->wrk->is_gzip == 0 || sp->wrk->is_gunzip == 0);
 
+	/*
+	 * zstd takes the place of gzip, but not under ESI, and only on
+	 * bodies we know how to read.
+	 */
+	if (sp->wrk->do_esi || (!sp->wrk->is_gzip && !sp->wrk->is_gunzip))
+		sp->wrk->do_zstd = 0;
+	if (sp->wrk->do_zstd)
+		sp->wrk->codec = VCD_ZSTD;
+	if (sp->wrk->codec != VCD_NONE) {
+		sp->wrk->do_gzip = sp->wrk->do_gunzip = 0;
+		http_Unset(sp->wrk->beresp, H_Content_Encoding);
+		http_PrintfHeader(sp->wrk, sp->fd, sp->wrk->beresp,
+		    "Content-Encoding: %s", VCD_Name(sp->wrk->codec));
+		/* Tell caches downstream that it depends */
+		if (!http_GetHdrData(sp->wrk->beresp, H_Vary,
+		    "Accept-Encoding", NULL) &&
+		    !http_GetHdrData(sp->wrk->beresp, H_Vary, "*", NULL)) {
+			if (http_GetHdr(sp->wrk->beresp, H_Vary, &b)) {
+				http_Unset(sp->wrk->beresp, H_Vary);
+				http_PrintfHeader(sp->wrk, sp->fd,
+				    sp->wrk->beresp,
+				    "Vary: %s, Accept-Encoding", b);
+			} else
+				http_SetHeader(sp->wrk, sp->fd,
+				    sp->wrk->beresp, "Vary: Accept-Encoding");
+		}
+	}
+
 	/* We won't gunzip unless it is gzip'ed */
 	if (sp->wrk->do_gunzip && !sp->wrk->is_gzip)
 		sp->wrk->do_gunzip = 0;
@@ -741,15 +874,19 @@ cnt_fetchbody(struct sess *sp)
 	/* ESI takes precedence and handles gzip/gunzip itself */
 	if (sp->wrk->do_esi)
 		sp->wrk->vfp = &vfp_esi;
+	else if (sp->wrk->codec != VCD_NONE)
+		sp->wrk->vfp = &vfp_codec;
 	else if (sp->wrk->do_gunzip)
 		sp->wrk->vfp = &vfp_gunzip;
 	else if (sp->wrk->do_gzip)
-		sp->wrk->vfp = &vfp_gzip;
+		sp->wrk->vfp = VGZ_Parallel(sp) ? &vfp_pgzip : &vfp_gzip;
 	else if (sp->wrk->is_gzip)
 		sp->wrk->vfp = &vfp_testgzip;
 
 	if (sp->wrk->do_esi || sp->esi_level > 0)
 		sp->wrk->do_stream = 0;
+	if (sp->wrk->codec != VCD_NONE)
+		sp->wrk->do_stream = 0;
 	if (!sp->wantbody)
 		sp->wrk->do_stream = 0;
 
@@ -760,6 +897,14 @@ cnt_fetchbody(struct sess *sp)
 	l = http_EstimateWS(sp->wrk->beresp,
 	    pass ? HTTPH_R_PASS : HTTPH_A_INS, &nhttp);
 
+	/*
+	 * Space for the prebuilt deliver headers, which are the same
+	 * headers again, with CRNL instead of NUL, and Content-Length.
+	 */
+	if (sp->objcore != NULL)
+		l += l + nhttp +
+		    strlen("Content-Length: XxxXxxXxxXxxXxxXxx\r\n");
+
 	/* Create Vary instructions */
 	if (sp->objcore != NULL) {
 		CHECK_OBJ_NOTNULL(sp->objcore, OBJCORE_MAGIC);
@@ -795,6 +940,8 @@ cnt_fetchbody(struct sess *sp)
 		    &sp->wrk->exp, nhttp);
 	}
 	if (sp->obj == NULL) {
+		if (sp->stale_obj != NULL)
+			(void)HSH_Deref(sp->wrk, NULL, &sp->stale_obj);
 		sp->err_code = 503;
 		sp->step = STP_ERROR;
 		VDI_CloseFd(sp);
@@ -804,7 +951,10 @@ cnt_fetchbody(struct sess *sp)
 
 	sp->wrk->storage_hint = NULL;
 
-	if (sp->wrk->do_gzip || (sp->wrk->is_gzip && !sp->wrk->do_gunzip))
+	if (sp->wrk->codec != VCD_NONE)
+		sp->obj->codec = sp->wrk->codec;
+	else if (sp->wrk->do_gzip ||
+	    (sp->wrk->is_gzip && !sp->wrk->do_gunzip))
 		sp->obj->gziped = 1;
 
 	if (vary != NULL) {
@@ -856,6 +1006,8 @@ cnt_fetchbody(struct sess *sp)
 
 	/* Use unmodified headers*/
 	i = FetchBody(sp);
+	if (sp->stale_obj != NULL)
+		(void)HSH_Deref(sp->wrk, NULL, &sp->stale_obj);
 
 	sp->wrk->h_content_length = NULL;
 
@@ -875,12 +1027,19 @@ cnt_fetchbody(struct sess *sp)
 	}
 
 	if (sp->obj->objcore != NULL) {
+		RES_BuildHdrBlock(sp);
 		EXP_Insert(sp->obj);
 		AN(sp->obj->objcore);
 		AN(sp->obj->objcore->ban);
 		HSH_Unbusy(sp);
 	}
 	sp->wrk->acct_tmp.fetch++;
+	if (sp->bgfetch) {
+		/* Nobody to deliver to, the object is in the cache */
+		(void)HSH_Deref(sp->wrk, NULL, &sp->obj);
+		sp->step = STP_DONE;
+		return (0);
+	}
 	sp->step = STP_PREPRESP;
 	return (0);
 }
@@ -900,6 +1059,8 @@ static int
 cnt_streambody(struct sess *sp)
 {
 	int i;
+	ssize_t clen;
+	char *p;
 	struct stream_ctx sctx;
 	uint8_t obuf[sp->wrk->res_mode & RES_GUNZIP ?
 	    params->gzip_stack_buffer : 1];
@@ -919,6 +1080,16 @@ cnt_streambody(struct sess *sp)
 
 	AssertObjCorePassOrBusy(sp->obj->objcore);
 
+	/* Followers can only be told the length if we store what we get */
+	clen = -1;
+	if (sp->wrk->h_content_length != NULL &&
+	    (sp->wrk->vfp == NULL || sp->wrk->vfp == &vfp_testgzip)) {
+		clen = strtoll(sp->wrk->h_content_length, &p, 10);
+		if (*p != '\0' || clen < 0)
+			clen = -1;
+	}
+	HSH_StreamStart(sp, clen);
+
 	i = FetchBody(sp);
 
 	sp->wrk->h_content_length = NULL;
@@ -929,9 +1100,11 @@ cnt_streambody(struct sess *sp)
 	AZ(sp->vbc);
 	AN(sp->director);
 
-	if (i)
+	if (i) {
 		sp->doclose = "Stream error";
-	else if (sp->obj->objcore != NULL) {
+		HSH_StreamFail(sp->obj);
+	} else if (sp->obj->objcore != NULL) {
+		RES_BuildHdrBlock(sp);
 		EXP_Insert(sp->obj);
 		AN(sp->obj->objcore);
 		AN(sp->obj->objcore->ban);
@@ -1027,6 +1200,8 @@ cnt_hit(struct sess *sp)
 	}
 
 	/* Drop our object, we won't need it */
+	if (sp->wrk->stream_bo != NULL)
+		HSH_StreamRelease(sp->wrk);
 	(void)HSH_Deref(sp->wrk, NULL, &sp->obj);
 	sp->objcore = NULL;
 
@@ -1085,7 +1260,7 @@ cnt_lookup(struct sess *sp)
 	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
 	CHECK_OBJ_NOTNULL(sp->vcl, VCL_CONF_MAGIC);
 
-	if (sp->hash_objhead == NULL) {
+	if (sp->hash_objhead == NULL && sp->hash_objcore == NULL) {
 		/* Not a waiting list return */
 		AZ(sp->vary_b);
 		AZ(sp->vary_l);
@@ -1100,6 +1275,17 @@ cnt_lookup(struct sess *sp)
 
 	oc = HSH_Lookup(sp, &oh);
 
+	if (oc == NULL && oh == NULL) {
+		/* Too many waiting for the busy object already */
+		WS_Release(sp->ws, 0);
+		sp->vary_b = NULL;
+		sp->vary_l = NULL;
+		sp->vary_e = NULL;
+		sp->err_code = 503;
+		sp->step = STP_ERROR;
+		return (0);
+	}
+
 	if (oc == NULL) {
 		/*
 		 * We lost the session to a busy object, disembark the
@@ -1115,7 +1301,7 @@ cnt_lookup(struct sess *sp)
 	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
 
 	/* If we inserted a new object it's a miss */
-	if (oc->flags & OC_F_BUSY) {
+	if (sp->wrk->stream_bo == NULL && (oc->flags & OC_F_BUSY)) {
 		sp->wrk->stats.cache_miss++;
 
 		if (sp->vary_l != NULL) {
@@ -1135,7 +1321,10 @@ cnt_lookup(struct sess *sp)
 		return (0);
 	}
 
-	o = oc_getobj(sp->wrk, oc);
+	if (sp->wrk->stream_bo != NULL)
+		o = sp->wrk->stream_bo->stream_obj;
+	else
+		o = oc_getobj(sp->wrk, oc);
 	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
 	sp->obj = o;
 
@@ -1154,6 +1343,8 @@ cnt_lookup(struct sess *sp)
 	}
 
 	sp->wrk->stats.cache_hit++;
+	if (sp->wrk->stream_bo != NULL)
+		sp->wrk->stats.cache_hitstream++;
 	WSP(sp, SLT_Hit, "%u", sp->obj->xid);
 	sp->step = STP_HIT;
 	return (0);
@@ -1182,6 +1373,29 @@ DOT vcl_miss -> pass [label="pass",style=bold,color=red]
 DOT
  */
 
+/*
+ * Ask the backend if the stale object we have is still good.  Only
+ * validators it gave us count, not a made up Last-Modified.
+ */
+
+static void
+cnt_condfetch(const struct sess *sp)
+{
+	struct object *o;
+	char *p;
+
+	o = sp->stale_obj;
+	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+	if (o->response != 200)
+		return;
+	if (http_GetHdr(o->http, H_ETag, &p))
+		http_PrintfHeader(sp->wrk, sp->fd, sp->wrk->bereq,
+		    "If-None-Match: %s", p);
+	if (http_GetHdr(o->http, H_Last_Modified, &p))
+		http_PrintfHeader(sp->wrk, sp->fd, sp->wrk->bereq,
+		    "If-Modified-Since: %s", p);
+}
+
 static int
 cnt_miss(struct sess *sp)
 {
@@ -1205,10 +1419,22 @@ cnt_miss(struct sess *sp)
 		http_SetHeader(sp->wrk, sp->fd, sp->wrk->bereq,
 		    "Accept-Encoding: gzip");
 	}
+	if (sp->stale_obj != NULL)
+		cnt_condfetch(sp);
 	sp->wrk->connect_timeout = 0;
 	sp->wrk->first_byte_timeout = 0;
 	sp->wrk->between_bytes_timeout = 0;
 	VCL_miss_method(sp);
+	if (sp->stale_obj != NULL && sp->handling != VCL_RET_FETCH)
+		(void)HSH_Deref(sp->wrk, NULL, &sp->stale_obj);
+	if (sp->bgfetch && sp->handling != VCL_RET_FETCH) {
+		/* Background fetches can only fetch */
+		AZ(HSH_Deref(sp->wrk, sp->objcore, NULL));
+		sp->objcore = NULL;
+		http_Setup(sp->wrk->bereq, NULL);
+		sp->step = STP_DONE;
+		return (0);
+	}
 	switch(sp->handling) {
 	case VCL_RET_ERROR:
 		AZ(HSH_Deref(sp->wrk, sp->objcore, NULL));
@@ -1399,24 +1625,20 @@ cnt_recv(struct sess *sp)
 	sp->wrk->is_gunzip = 0;
 	sp->wrk->do_gzip = 0;
 	sp->wrk->do_gunzip = 0;
+	sp->wrk->do_zstd = 0;
+	sp->wrk->codec = VCD_NONE;
 	sp->wrk->do_stream = 0;
 
 	if (params->http_gzip_support &&
 	     (recv_handling != VCL_RET_PIPE) &&
 	     (recv_handling != VCL_RET_PASS)) {
-		if (RFC2616_Req_Gzip(sp)) {
-			http_Unset(sp->http, H_Accept_Encoding);
-			http_SetHeader(sp->wrk, sp->fd, sp->http,
-			    "Accept-Encoding: gzip");
-		} else {
-			http_Unset(sp->http, H_Accept_Encoding);
-		}
+		VCD_ReqNormalize(sp);
 	}
 
-	SHA256_Init(sp->wrk->sha256ctx);
+	HSH_DigestInit(sp);
 	VCL_hash_method(sp);
 	assert(sp->handling == VCL_RET_HASH);
-	SHA256_Final(sp->digest, sp->wrk->sha256ctx);
+	HSH_DigestFinal(sp);
 
 	if (!strcmp(sp->http->hd[HTTP_HDR_REQ].b, "HEAD"))
 		sp->wantbody = 0;
@@ -1573,13 +1795,16 @@ CNT_Session(struct sess *sp)
 	    sp->step == STP_FIRST ||
 	    sp->step == STP_START ||
 	    sp->step == STP_LOOKUP ||
-	    sp->step == STP_RECV);
+	    sp->step == STP_RECV ||
+	    (sp->step == STP_MISS && sp->bgfetch));
 
 	AZ(w->do_stream);
 	AZ(w->is_gzip);
 	AZ(w->do_gzip);
 	AZ(w->is_gunzip);
 	AZ(w->do_gunzip);
+	AZ(w->do_zstd);
+	AZ(w->codec);
 	AZ(w->do_esi);
 
 	/*
@@ -1635,6 +1860,8 @@ CNT_Session(struct sess *sp)
 	AZ(w->do_gzip);
 	AZ(w->is_gunzip);
 	AZ(w->do_gunzip);
+	AZ(w->do_zstd);
+	AZ(w->codec);
 	AZ(w->do_esi);
 #define ACCT(foo)	AZ(w->acct_tmp.foo);
 #include "acct_fields.h"
@@ -1642,6 +1869,83 @@ CNT_Session(struct sess *sp)
 	assert(WRW_IsReleased(w));
 }
 
+/*--------------------------------------------------------------------
+ * Refresh the object in grace sp is about to be served from (stale) in
+ * the background, with a session of its own which fetches into the busy
+ * objcore oc.  It gets a copy of the request, our VCL and director, and
+ * joins the state engine at MISS.  Both objcores come with a ref for it.
+ */
+
+void
+CNT_Refresh(struct sess *sp, struct objcore *oc, struct objcore *stale)
+{
+	struct sess *nsp;
+	struct object *o;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(sp->vcl, VCL_CONF_MAGIC);
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	AN(oc->flags & OC_F_BUSY);
+	o = oc_getobj(sp->wrk, stale);
+	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+
+	nsp = SES_NewFetch();
+	if (nsp == NULL) {
+		sp->wrk->stats.fetch_bg_drop++;
+		AZ(HSH_Deref(sp->wrk, oc, NULL));
+		(void)HSH_Deref(sp->wrk, NULL, &o);
+		return;
+	}
+	CHECK_OBJ_NOTNULL(nsp, SESS_MAGIC);
+	AZ(nsp->wrk);
+
+	/* No fd, so log under the id of the session it is done for */
+	nsp->id = sp->id;
+	nsp->xid = ++xids;
+	nsp->t_open = nsp->t_req = TIM_real();
+	nsp->acct_ses.first = nsp->t_open;
+
+	/* VCL may want to know who this was for */
+	memcpy(nsp->sockaddr, sp->sockaddr, sp->sockaddrlen);
+	nsp->sockaddrlen = sp->sockaddrlen;
+	memcpy(nsp->mysockaddr, sp->mysockaddr, sp->mysockaddrlen);
+	nsp->mysockaddrlen = sp->mysockaddrlen;
+	nsp->mylsock = sp->mylsock;
+	if (sp->addr != NULL)
+		nsp->addr = WS_Dup(nsp->ws, sp->addr);
+	if (sp->port != NULL)
+		nsp->port = WS_Dup(nsp->ws, sp->port);
+
+	http_Setup(nsp->http, nsp->ws);
+	HTTP_Copy(nsp->http, sp->http);
+	nsp->http->conds = 0;
+	http_CopyHome(sp->wrk, nsp->id, nsp->http);
+	WS_Assert(nsp->ws);
+	nsp->ws_req = WS_Snapshot(nsp->ws);
+
+	memcpy(nsp->digest, sp->digest, sizeof nsp->digest);
+	VCL_Ref(sp->vcl);
+	nsp->vcl = sp->vcl;
+	nsp->director = sp->director;
+	nsp->objcore = oc;
+	nsp->stale_obj = o;
+	nsp->bgfetch = 1;
+	nsp->step = STP_MISS;
+
+	WSP(sp, SLT_Debug, "Background fetch %u for %u", nsp->xid, sp->xid);
+	sp->wrk->stats.fetch_bg++;
+	if (WRK_QueueFetch(nsp) == 0)
+		return;
+
+	sp->wrk->stats.fetch_bg_drop++;
+	nsp->objcore = NULL;
+	AZ(HSH_Deref(sp->wrk, oc, NULL));
+	(void)HSH_Deref(sp->wrk, NULL, &nsp->stale_obj);
+	VCL_Rel(&nsp->vcl);
+	nsp->t_end = TIM_real();
+	SES_Delete(nsp);
+}
+
 /*
 DOT }
 */
@@ -185,6 +185,7 @@ cli_debug_sizeof(struct cli *cli, const char * const *av, void *priv)
 	OFOF(struct object, hits);
 	OFOF(struct object, response);
 	OFOF(struct object, gziped);
+	OFOF(struct object, codec);
 	OFOF(struct object, gzip_start);
 	OFOF(struct object, gzip_last);
 	OFOF(struct object, gzip_stop);
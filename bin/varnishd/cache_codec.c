@@ -0,0 +1,448 @@
+/*-
+ * Copyright (c) 2011 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Content codecs other than gzip.
+ *
+ * gzip has the machinery in cache_gzip.c to itself, because ESI and
+ * streaming know how to take gzip'ed objects apart.  The codecs here get
+ * the simpler deal:  With beresp.do_zstd in vcl_fetch, the body is
+ * encoded once as we fetch it (gunzip'ing it first if the backend sent
+ * it gzip'ed), and decoded on delivery to the clients which do not list
+ * the codec in their Accept-Encoding header.  Objects going through ESI
+ * or streaming are left to gzip.
+ *
+ * Like zlib in lib/libvgz, the zstd library comes with us, in lib/libzstd.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+#include "zstd.h"
+
+/* Return values of the codec steps */
+#define VCD_ERROR	-1
+#define VCD_OK		0
+#define VCD_END		1
+
+typedef void *vcd_new_f(void);
+typedef int vcd_step_f(void *, const uint8_t **ip, size_t *il,
+    uint8_t **op, size_t *ol, int finish);
+typedef void vcd_fini_f(void *);
+
+/*
+ * A step consumes as much of the input as fits in the output.  The
+ * encoder returns VCD_END once it has been told to finish and has
+ * delivered all its output, the decoder when it sees the end of the
+ * stream.
+ */
+
+struct vcd_codec {
+	unsigned		magic;
+#define VCD_CODEC_MAGIC		0x1c7be2a0
+	const char		*name;		/* Content-Encoding token */
+	vcd_new_f		*enc_new;
+	vcd_step_f		*enc;
+	vcd_fini_f		*enc_fini;
+	vcd_new_f		*dec_new;
+	vcd_step_f		*dec;
+	vcd_fini_f		*dec_fini;
+};
+
+/*--------------------------------------------------------------------*/
+
+static void *
+vcd_zstd_enc_new(void)
+{
+	ZSTD_CCtx *c;
+
+	c = ZSTD_createCCtx();
+	AN(c);
+	AZ(ZSTD_isError(ZSTD_CCtx_setParameter(c,
+	    ZSTD_c_compressionLevel, (int)params->zstd_level)));
+	AZ(ZSTD_isError(ZSTD_CCtx_setParameter(c,
+	    ZSTD_c_windowLog, (int)params->zstd_window)));
+	return (c);
+}
+
+static int
+vcd_zstd_enc(void *priv, const uint8_t **ip, size_t *il,
+    uint8_t **op, size_t *ol, int finish)
+{
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t r;
+
+	in.src = *ip;
+	in.size = *il;
+	in.pos = 0;
+	out.dst = *op;
+	out.size = *ol;
+	out.pos = 0;
+	r = ZSTD_compressStream2(priv, &out, &in,
+	    finish ? ZSTD_e_end : ZSTD_e_continue);
+	*ip += in.pos;
+	*il -= in.pos;
+	*op += out.pos;
+	*ol -= out.pos;
+	if (ZSTD_isError(r))
+		return (VCD_ERROR);
+	if (finish && r == 0)
+		return (VCD_END);
+	return (VCD_OK);
+}
+
+static void
+vcd_zstd_enc_fini(void *priv)
+{
+
+	(void)ZSTD_freeCCtx(priv);
+}
+
+static void *
+vcd_zstd_dec_new(void)
+{
+	ZSTD_DCtx *d;
+
+	d = ZSTD_createDCtx();
+	AN(d);
+	return (d);
+}
+
+static int
+vcd_zstd_dec(void *priv, const uint8_t **ip, size_t *il,
+    uint8_t **op, size_t *ol, int finish)
+{
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t r;
+
+	(void)finish;
+	in.src = *ip;
+	in.size = *il;
+	in.pos = 0;
+	out.dst = *op;
+	out.size = *ol;
+	out.pos = 0;
+	r = ZSTD_decompressStream(priv, &out, &in);
+	*ip += in.pos;
+	*il -= in.pos;
+	*op += out.pos;
+	*ol -= out.pos;
+	if (ZSTD_isError(r))
+		return (VCD_ERROR);
+	if (r == 0)
+		return (VCD_END);
+	return (VCD_OK);
+}
+
+static void
+vcd_zstd_dec_fini(void *priv)
+{
+
+	(void)ZSTD_freeDCtx(priv);
+}
+
+static const struct vcd_codec vcd_zstd = {
+	.magic =	VCD_CODEC_MAGIC,
+	.name =		"zstd",
+	.enc_new =	vcd_zstd_enc_new,
+	.enc =		vcd_zstd_enc,
+	.enc_fini =	vcd_zstd_enc_fini,
+	.dec_new =	vcd_zstd_dec_new,
+	.dec =		vcd_zstd_dec,
+	.dec_fini =	vcd_zstd_dec_fini,
+};
+
+/*--------------------------------------------------------------------
+ * Indexed by VCD_*
+ */
+
+static const struct vcd_codec * const vcd_codecs[VCD_ZSTD + 1] = {
+	[VCD_NONE] =	NULL,
+	[VCD_ZSTD] =	&vcd_zstd,
+};
+
+static const char * const vcd_names[VCD_ZSTD + 1] = {
+	[VCD_NONE] =	"identity",
+	[VCD_ZSTD] =	"zstd",
+};
+
+static const struct vcd_codec *
+vcd_codec(unsigned codec)
+{
+
+	if (codec > VCD_ZSTD)
+		return (NULL);
+	return (vcd_codecs[codec]);
+}
+
+int
+VCD_Available(unsigned codec)
+{
+
+	return (vcd_codec(codec) != NULL);
+}
+
+const char *
+VCD_Name(unsigned codec)
+{
+
+	assert(codec <= VCD_ZSTD);
+	return (vcd_names[codec]);
+}
+
+/*--------------------------------------------------------------------
+ * Rewrite the clients Accept-Encoding header to list only the codings
+ * we can deliver without decoding, in a fixed order, so that Vary on
+ * it does not split the cache on the whims of the browsers.
+ */
+
+int
+VCD_ReqAccepts(const struct sess *sp, unsigned codec)
+{
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	if (codec == VCD_NONE)
+		return (1);
+	return (http_GetHdrQ(sp->http, H_Accept_Encoding,
+	    VCD_Name(codec)) > 0.);
+}
+
+void
+VCD_ReqNormalize(struct sess *sp)
+{
+	char buf[sizeof "zstd, gzip"];
+	unsigned u;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	buf[0] = '\0';
+	for (u = VCD_NONE + 1; u <= VCD_ZSTD; u++) {
+		if (!VCD_Available(u) || !VCD_ReqAccepts(sp, u))
+			continue;
+		if (buf[0] != '\0')
+			strcat(buf, ", ");
+		strcat(buf, VCD_Name(u));
+	}
+	if (RFC2616_Req_Gzip(sp)) {
+		if (buf[0] != '\0')
+			strcat(buf, ", ");
+		strcat(buf, "gzip");
+	}
+	http_Unset(sp->http, H_Accept_Encoding);
+	if (buf[0] != '\0')
+		http_PrintfHeader(sp->wrk, sp->fd, sp->http,
+		    "Accept-Encoding: %s", buf);
+}
+
+/*--------------------------------------------------------------------
+ * VFP_CODEC
+ *
+ * Encode the body with sp->wrk->codec as we receive it, gunzip'ing it
+ * on the way in if the backend sent it gzip'ed.
+ */
+
+struct vcd {
+	unsigned		magic;
+#define VCD_MAGIC		0x4e1d35c7
+	const struct vcd_codec	*codec;
+	void			*enc;
+	struct vgz		*vg;
+	int			gz_end;
+};
+
+static int
+vcd_feed(struct sess *sp, const struct vcd *vcd, const uint8_t *ip,
+    size_t il, int finish)
+{
+	struct storage *st;
+	uint8_t *op;
+	size_t ol;
+	ssize_t l;
+	int i;
+
+	do {
+		st = FetchStorage(sp, 0);
+		if (st == NULL)
+			return (-1);
+		op = st->ptr + st->len;
+		ol = st->space - st->len;
+		i = vcd->codec->enc(vcd->enc, &ip, &il, &op, &ol, finish);
+		if (i == VCD_ERROR)
+			return (FetchError(sp, "Encoder error"));
+		l = (st->space - st->len) - ol;
+		st->len += l;
+		sp->obj->len += l;
+	} while (il > 0 || (finish && i != VCD_END));
+	return (0);
+}
+
+static void __match_proto__()
+vcd_begin(struct sess *sp, size_t estimate)
+{
+	struct vcd *vcd;
+
+	(void)estimate;
+	AZ(sp->wrk->vcd_rx);
+	ALLOC_OBJ(vcd, VCD_MAGIC);
+	AN(vcd);
+	vcd->codec = vcd_codec(sp->wrk->codec);
+	CHECK_OBJ_NOTNULL(vcd->codec, VCD_CODEC_MAGIC);
+	vcd->enc = vcd->codec->enc_new();
+	if (sp->wrk->is_gzip)
+		vcd->vg = VGZ_NewUngzip(sp, "U F C");
+	sp->wrk->vcd_rx = vcd;
+	sp->wrk->stats.n_codec_encode++;
+}
+
+static int __match_proto__()
+vcd_bytes(struct sess *sp, struct http_conn *htc, ssize_t bytes)
+{
+	struct vcd *vcd;
+	ssize_t l, w;
+	int i;
+	uint8_t ibuf[params->gzip_stack_buffer];
+	uint8_t obuf[sp->wrk->is_gzip ? params->gzip_stack_buffer : 1];
+	size_t dl;
+	const void *dp;
+
+	vcd = sp->wrk->vcd_rx;
+	CHECK_OBJ_NOTNULL(vcd, VCD_MAGIC);
+	while (bytes > 0) {
+		l = sizeof ibuf;
+		if (l > bytes)
+			l = bytes;
+		w = HTC_Read(sp->wrk, htc, ibuf, l);
+		if (w <= 0)
+			return (w);
+		bytes -= w;
+		if (vcd->vg == NULL) {
+			if (vcd_feed(sp, vcd, ibuf, w, 0))
+				return (-1);
+			continue;
+		}
+		if (vcd->gz_end)
+			return (FetchError(sp, "Junk after gzip data"));
+		VGZ_Ibuf(vcd->vg, ibuf, w);
+		do {
+			VGZ_Obuf(vcd->vg, obuf, sizeof obuf);
+			i = VGZ_Gunzip(vcd->vg, &dp, &dl);
+			if (i == VGZ_ERROR)
+				return (FetchError(sp, "Gunzip data error"));
+			if (dl > 0 && vcd_feed(sp, vcd, dp, dl, 0))
+				return (-1);
+		} while (i == VGZ_OK &&
+		    (!VGZ_IbufEmpty(vcd->vg) || VGZ_ObufFull(vcd->vg)));
+		if (i == VGZ_END) {
+			if (!VGZ_IbufEmpty(vcd->vg))
+				return (FetchError(sp, "Junk after gzip data"));
+			vcd->gz_end = 1;
+		}
+	}
+	return (1);
+}
+
+static int __match_proto__()
+vcd_end(struct sess *sp)
+{
+	struct vcd *vcd;
+	int i = 0;
+
+	vcd = sp->wrk->vcd_rx;
+	sp->wrk->vcd_rx = NULL;
+	CHECK_OBJ_NOTNULL(vcd, VCD_MAGIC);
+	if (!sp->wrk->fetch_failed) {
+		if (vcd->vg != NULL && !vcd->gz_end)
+			i = FetchError(sp, "Gunzip error at the very end");
+		else
+			i = vcd_feed(sp, vcd, NULL, 0, 1);
+	}
+	if (vcd->vg != NULL)
+		(void)VGZ_Destroy(&vcd->vg);
+	vcd->codec->enc_fini(vcd->enc);
+	FREE_OBJ(vcd);
+	return (i);
+}
+
+struct vfp vfp_codec = {
+        .begin  =       vcd_begin,
+        .bytes  =       vcd_bytes,
+        .end    =       vcd_end,
+};
+
+/*--------------------------------------------------------------------
+ * Decode the body of sp->obj and hand it to func in gzip_stack_buffer
+ * sized pieces.
+ */
+
+void
+VCD_Deliver(const struct sess *sp, vcd_sink_f *func)
+{
+	const struct vcd_codec *codec;
+	struct storage *st;
+	void *dec;
+	const uint8_t *ip;
+	uint8_t *op;
+	size_t il, ol;
+	uint8_t obuf[params->gzip_stack_buffer];
+	int i = VCD_OK;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(sp->obj, OBJECT_MAGIC);
+
+	codec = vcd_codec(sp->obj->codec);
+	if (codec == NULL) {
+		/* Stored by a varnishd which had it, nothing we can do */
+		WSP(sp, SLT_Debug, "No %s decoder",
+		    VCD_Name(sp->obj->codec));
+		VTAILQ_FOREACH(st, &sp->obj->store, list)
+			func(sp, st->ptr, st->len);
+		return;
+	}
+	CHECK_OBJ_NOTNULL(codec, VCD_CODEC_MAGIC);
+	sp->wrk->stats.n_codec_decode++;
+	dec = codec->dec_new();
+	VTAILQ_FOREACH(st, &sp->obj->store, list) {
+		CHECK_OBJ_NOTNULL(st, STORAGE_MAGIC);
+		ip = st->ptr;
+		il = st->len;
+		do {
+			op = obuf;
+			ol = sizeof obuf;
+			i = codec->dec(dec, &ip, &il, &op, &ol, 0);
+			if (op > obuf)
+				func(sp, obuf, op - obuf);
+		} while (i == VCD_OK && (il > 0 || ol == 0));
+		if (i != VCD_OK)
+			break;
+	}
+	if (i == VCD_ERROR)
+		WSP(sp, SLT_Debug, "%s decode error", codec->name);
+	codec->dec_fini(dec);
+}
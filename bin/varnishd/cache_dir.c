@@ -76,15 +76,24 @@ VDI_RecycleFd(struct sess *sp)
 
 	bp = sp->vbc->backend;
 
+	if (params->backend_max_requests > 0 &&
+	    sp->vbc->n_req >= params->backend_max_requests) {
+		VSC_C_main->backend_maxreq++;
+		VDI_CloseFd(sp);
+		return;
+	}
+
 	WSL(sp->wrk, SLT_BackendReuse, sp->vbc->fd, "%s", bp->vcl_name);
 	/*
 	 * Flush the shmlog, so that another session reusing this backend
 	 * will log chronologically later than our use of it.
 	 */
 	WSL_Flush(sp->wrk, 0);
+	sp->vbc->t_idle = TIM_real();
 	Lck_Lock(&bp->mtx);
 	VSC_C_main->backend_recycle++;
 	VTAILQ_INSERT_HEAD(&bp->connlist, sp->vbc, list);
+	bp->n_idle++;
 	sp->vbc = NULL;
 	VBE_DropRefLocked(bp);
 }
@@ -0,0 +1,270 @@
+/*-
+ * Copyright (c) 2011 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * The consistent hash director.
+ *
+ * Every member gets a number of points on a ring of 32 bit values,
+ * proportional to its weight, and derived from its name only, so the
+ * ring does not change with the order of the members or when other
+ * members come and go.  A request goes to the owner of the first
+ * point at or after the first 32 bits of its hash, found by binary
+ * search.
+ *
+ * Sick members, and members we failed to get a connection to, are
+ * skipped by walking on along the ring.  Only the requests which
+ * would have gone to them move, and they are spread over the other
+ * members, rather than reshuffling everything like the hash director.
+ *
+ * With .balance, a member is also skipped if it has more than balance
+ * times its share of the connections in use to all members ("bounded
+ * loads"), so that hot objects spill over to the next member.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "cache.h"
+#include "cache_backend.h"
+#include "vrt.h"
+#include "vsha256.h"
+#include "vend.h"
+
+/* Points on the ring per unit of weight */
+#define VDI_CONSISTENT_POINTS	40
+
+struct vdi_consistent_point {
+	uint32_t		point;
+	unsigned		host;
+};
+
+struct vdi_consistent {
+	unsigned		magic;
+#define VDI_CONSISTENT_MAGIC	0x1c83a5e9
+	struct director		dir;
+
+	unsigned		retries;
+	double			balance;
+	struct director		**hosts;
+	unsigned		nhosts;
+	struct vdi_consistent_point *ring;
+	unsigned		npoints;
+};
+
+/*--------------------------------------------------------------------*/
+
+static int
+vdi_consistent_cmp(const void *a, const void *b)
+{
+	const struct vdi_consistent_point *pa = a, *pb = b;
+
+	if (pa->point != pb->point)
+		return (pa->point < pb->point ? -1 : 1);
+	return (pa->host < pb->host ? -1 : pa->host > pb->host);
+}
+
+/*
+ * Index of the first point at or after key, wrapping around.
+ */
+static unsigned
+vdi_consistent_find(const struct vdi_consistent *vs, uint32_t key)
+{
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = vs->npoints;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (vs->ring[mid].point < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo == vs->npoints ? 0 : lo);
+}
+
+static struct vbc *
+vdi_consistent_pick(struct sess *sp, const struct vdi_consistent *vs)
+{
+	unsigned char state[vs->nhosts];	/* 1 healthy, 2 sick or tried */
+	unsigned load[vs->nhosts];
+	unsigned u, h, k, idx, first, nh;
+	double cap;
+	struct vbc *vbe;
+
+	nh = vs->nhosts;
+	memset(state, 0, sizeof state);
+	memset(load, 0, sizeof load);
+	cap = 0.;
+	if (vs->balance > 0.) {
+		for (u = 0; u < nh; u++) {
+			load[u] = VBE_InFlight(vs->hosts[u]);
+			cap += load[u];
+		}
+		cap = ceil(vs->balance * (cap + 1) / nh);
+	}
+
+	idx = vdi_consistent_find(vs, vle32dec(sp->digest));
+	for (k = 0; k < vs->retries; k++) {
+		first = nh;
+		h = nh;
+		for (u = 0; u < vs->npoints; u++) {
+			h = vs->ring[(idx + u) % vs->npoints].host;
+			if (state[h] == 0)
+				state[h] =
+				    VDI_Healthy(vs->hosts[h], sp) ? 1 : 2;
+			if (state[h] != 1)
+				continue;
+			if (first == nh)
+				first = h;
+			if (cap == 0. || load[h] < cap)
+				break;
+		}
+		if (u == vs->npoints)
+			h = first;
+		if (h == nh)
+			return (NULL);
+		state[h] = 2;
+		vbe = VDI_GetFd(vs->hosts[h], sp);
+		if (vbe != NULL)
+			return (vbe);
+	}
+	return (NULL);
+}
+
+static struct vbc *
+vdi_consistent_getfd(const struct director *d, struct sess *sp)
+{
+	struct vdi_consistent *vs;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(d, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(vs, d->priv, VDI_CONSISTENT_MAGIC);
+	AN(sp->digest);
+
+	return (vdi_consistent_pick(sp, vs));
+}
+
+/*
+ * Healthy if just a single backend is...
+ */
+static unsigned
+vdi_consistent_healthy(const struct director *d, const struct sess *sp)
+{
+	struct vdi_consistent *vs;
+	unsigned u;
+
+	CHECK_OBJ_NOTNULL(d, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(vs, d->priv, VDI_CONSISTENT_MAGIC);
+
+	for (u = 0; u < vs->nhosts; u++) {
+		if (VDI_Healthy(vs->hosts[u], sp))
+			return (1);
+	}
+	return (0);
+}
+
+static void
+vdi_consistent_fini(const struct director *d)
+{
+	struct vdi_consistent *vs;
+
+	CHECK_OBJ_NOTNULL(d, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(vs, d->priv, VDI_CONSISTENT_MAGIC);
+
+	free(vs->ring);
+	free(vs->hosts);
+	free(vs->dir.vcl_name);
+	vs->dir.magic = 0;
+	FREE_OBJ(vs);
+}
+
+void
+VRT_init_dir_consistent(struct cli *cli, struct director **bp, int idx,
+    const void *priv)
+{
+	const struct vrt_dir_consistent *t;
+	struct vdi_consistent *vs;
+	const struct vrt_dir_consistent_entry *te;
+	struct vdi_consistent_point *pt;
+	struct SHA256Context ctx;
+	unsigned char sign[SHA256_LEN];
+	char buf[16];
+	unsigned u, w, n;
+	int i;
+
+	ASSERT_CLI();
+	(void)cli;
+	t = priv;
+
+	ALLOC_OBJ(vs, VDI_CONSISTENT_MAGIC);
+	XXXAN(vs);
+	vs->hosts = calloc(sizeof *vs->hosts, t->nmember);
+	XXXAN(vs->hosts);
+
+	vs->dir.magic = DIRECTOR_MAGIC;
+	vs->dir.priv = vs;
+	vs->dir.name = "consistent";
+	REPLACE(vs->dir.vcl_name, t->name);
+	vs->dir.getfd = vdi_consistent_getfd;
+	vs->dir.fini = vdi_consistent_fini;
+	vs->dir.healthy = vdi_consistent_healthy;
+
+	vs->retries = t->retries;
+	if (vs->retries == 0)
+		vs->retries = t->nmember;
+	vs->balance = t->balance;
+
+	n = 0;
+	for (i = 0, te = t->members; i < t->nmember; i++, te++)
+		n += VDI_CONSISTENT_POINTS * (te->weight == 0 ? 1 : te->weight);
+	vs->ring = calloc(sizeof *vs->ring, n);
+	XXXAN(vs->ring);
+	vs->npoints = n;
+
+	pt = vs->ring;
+	for (i = 0, te = t->members; i < t->nmember; i++, te++) {
+		vs->hosts[i] = bp[te->host];
+		AN(vs->hosts[i]);
+		w = VDI_CONSISTENT_POINTS * (te->weight == 0 ? 1 : te->weight);
+		for (u = 0; u < w; u++, pt++) {
+			bprintf(buf, "-%u", u);
+			SHA256_Init(&ctx);
+			SHA256_Update(&ctx, vs->hosts[i]->vcl_name,
+			    strlen(vs->hosts[i]->vcl_name));
+			SHA256_Update(&ctx, buf, strlen(buf));
+			SHA256_Final(sign, &ctx);
+			pt->point = vbe32dec(sign);
+			pt->host = i;
+		}
+	}
+	assert(pt == vs->ring + n);
+	qsort(vs->ring, n, sizeof *vs->ring, vdi_consistent_cmp);
+	vs->nhosts = t->nmember;
+	bp[idx] = &vs->dir;
+}
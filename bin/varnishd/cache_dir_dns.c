@@ -39,6 +39,7 @@
 #include <unistd.h>
 
 #include <stdio.h>
+#include <stdint.h>
 #include <netinet/in.h>
 
 #include "cache.h"
@@ -50,6 +51,13 @@
 /* FIXME: Should eventually be a configurable variable. */
 #define VDI_DNS_MAX_CACHE		1024
 #define VDI_DNS_GROUP_MAX_BACKENDS	1024
+#define VDI_DNS_MAX_ADDR		64
+#define VDI_DNS_HASH			256
+
+/* Refresh in the background when this much of the TTL has passed */
+#define VDI_DNS_REFRESH			0.75
+
+struct vdi_dns;
 
 /* DNS Cache entry
  */
@@ -57,11 +65,19 @@ struct vdi_dns_hostgroup {
 	unsigned			magic;
 #define VDI_DNSDIR_MAGIC		0x1bacab21
 	char				*hostname;
+	struct vdi_dns			*vs;
+	unsigned			hash;
 	struct director			*hosts[VDI_DNS_GROUP_MAX_BACKENDS];
 	unsigned			nhosts;
 	unsigned			next_host; /* Next to use...*/
 	double				ttl;
+	double				refresh;
+	unsigned			answered;
+	unsigned			queued;
+	unsigned			waiters;
 	VTAILQ_ENTRY(vdi_dns_hostgroup)	list;
+	VTAILQ_ENTRY(vdi_dns_hostgroup)	hlist;
+	VTAILQ_ENTRY(vdi_dns_hostgroup)	qlist;
 };
 
 struct vdi_dns {
@@ -71,10 +87,13 @@ struct vdi_dns {
 	struct director			**hosts;
 	unsigned			nhosts;
 	VTAILQ_HEAD(_cachelist,vdi_dns_hostgroup)	cachelist;
+	struct _cachelist		hash[VDI_DNS_HASH];
 	unsigned			ncachelist;
-	pthread_rwlock_t		rwlock;
+	struct lock			mtx;
+	pthread_cond_t			cond;
 	const char			*suffix;
 	double			ttl;
+	double			negative_ttl;
 };
 
 /* Compare an IPv4 backend to a IPv4 addr/len */
@@ -162,151 +181,237 @@ vdi_dns_pick_host(const struct sess *sp, struct vdi_dns_hostgroup *group) {
 	return (NULL);
 }
 
-/* Remove an item from the dns cache.
- * If *group is NULL, the head is popped.
- * Remember locking.
+/*--------------------------------------------------------------------
+ * The resolver thread.
+ *
+ * Hostgroups which need an answer are queued here, and one thread for
+ * all dns directors looks them up, so no worker ever waits in
+ * getaddrinfo(3).  A group is on the queue, or being looked up, while
+ * its 'queued' flag is set.
  */
-static void
-vdi_dns_pop_cache(struct vdi_dns *vs,
-		  struct vdi_dns_hostgroup *group)
+
+static struct lock			vdr_mtx;
+static pthread_cond_t			vdr_cond;
+static pthread_cond_t			vdr_done;
+static VTAILQ_HEAD(, vdi_dns_hostgroup)	vdr_queue =
+    VTAILQ_HEAD_INITIALIZER(vdr_queue);
+static struct vdi_dns_hostgroup		*vdr_busy;
+static pthread_t			vdr_thread;
+static unsigned				vdr_running;
+
+/* Look the name up in the params->dns_hosts_file, /etc/hosts style */
+static int
+vdr_lookup_file(const char *fn, const char *hostname,
+    struct sockaddr_storage *ss, socklen_t *sl, int max)
 {
-	if (group == NULL)
-		group = VTAILQ_LAST( &vs->cachelist, _cachelist );
-	assert(group != NULL);
-	free(group->hostname);
-	VTAILQ_REMOVE(&vs->cachelist, group, list);
-	FREE_OBJ(group);
-	vs->ncachelist--;
+	struct addrinfo *res, hint;
+	char line[1024], *p, *q, *addr, *save;
+	FILE *f;
+	int n = 0, found;
+
+	f = fopen(fn, "r");
+	if (f == NULL)
+		return (-1);
+	memset(&hint, 0, sizeof hint);
+	hint.ai_family = PF_UNSPEC;
+	hint.ai_socktype = SOCK_STREAM;
+	hint.ai_flags = AI_NUMERICHOST;
+	while (n < max && fgets(line, sizeof line, f) != NULL) {
+		p = strchr(line, '#');
+		if (p != NULL)
+			*p = '\0';
+		addr = strtok_r(line, " \t\r\n", &save);
+		if (addr == NULL)
+			continue;
+		found = 0;
+		while ((q = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+			if (!strcasecmp(q, hostname))
+				found = 1;
+		if (!found || getaddrinfo(addr, "80", &hint, &res))
+			continue;
+		memcpy(&ss[n], res->ai_addr, res->ai_addrlen);
+		sl[n++] = res->ai_addrlen;
+		freeaddrinfo(res);
+	}
+	AZ(fclose(f));
+	return (n > 0 ? n : -1);
 }
 
-/* Dummy in case someone feels like optimizing it? meh...
- */
-static inline int
-vdi_dns_groupmatch(const struct vdi_dns_hostgroup *group, const char *hostname)
+static int
+vdr_lookup(const char *hostname, struct sockaddr_storage *ss, socklen_t *sl,
+    int max)
 {
-	return (!strcmp(group->hostname, hostname));
+	struct addrinfo *res0, *res, hint;
+	int n = 0;
+
+	if (params->dns_hosts_file != NULL && *params->dns_hosts_file != '\0')
+		return (vdr_lookup_file(params->dns_hosts_file, hostname,
+		    ss, sl, max));
+
+	memset(&hint, 0, sizeof hint);
+	hint.ai_family = PF_UNSPEC;
+	hint.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(hostname, "80", &hint, &res0))
+		return (-1);
+	for (res = res0; res != NULL && n < max; res = res->ai_next) {
+		if (res->ai_family != PF_INET && res->ai_family != PF_INET6)
+			continue;
+		memcpy(&ss[n], res->ai_addr, res->ai_addrlen);
+		sl[n++] = res->ai_addrlen;
+	}
+	freeaddrinfo(res0);
+	return (n);
 }
 
-/* Search the cache for 'hostname' and put a backend-pointer as necessary,
- * return true for cache hit. This could still be a NULL backend if we did
- * a lookup earlier and didn't find a host (ie: cache failed too)
- *
- * if rwlock is true, the first timed out object found (if any) is popped
- * and freed.
- */
-static int
-vdi_dns_cache_has(const struct sess *sp,
-		  struct vdi_dns *vs,
-		  const char *hostname,
-		  struct director **backend,
-		  int rwlock)
+static void * __match_proto__(bgthread_t)
+vdr_resolver(struct sess *sp, void *priv)
 {
-	struct director *ret;
-	struct vdi_dns_hostgroup *hostgr;
-	struct vdi_dns_hostgroup *hostgr2;
-	VTAILQ_FOREACH_SAFE(hostgr, &vs->cachelist, list, hostgr2) {
-		CHECK_OBJ_NOTNULL(hostgr, VDI_DNSDIR_MAGIC);
-		if (hostgr->ttl <= sp->t_req) {
-			if (rwlock)
-				vdi_dns_pop_cache(vs, hostgr);
-			return (0);
+	struct vdi_dns_hostgroup *group;
+	struct vdi_dns *vs;
+	struct director *hosts[VDI_DNS_GROUP_MAX_BACKENDS];
+	struct sockaddr_storage ss[VDI_DNS_MAX_ADDR];
+	socklen_t sl[VDI_DNS_MAX_ADDR];
+	int i, n, host;
+	double now, ttl;
+
+	(void)sp;
+	(void)priv;
+	Lck_Lock(&vdr_mtx);
+	while (1) {
+		group = VTAILQ_FIRST(&vdr_queue);
+		if (group == NULL) {
+			Lck_CondWait(&vdr_cond, &vdr_mtx);
+			continue;
 		}
-		if (vdi_dns_groupmatch(hostgr, hostname)) {
-			ret = (vdi_dns_pick_host(sp, hostgr));
-			*backend = ret;
-			if (*backend != NULL)
-				CHECK_OBJ_NOTNULL(*backend, DIRECTOR_MAGIC);
-			return (1);
+		CHECK_OBJ_NOTNULL(group, VDI_DNSDIR_MAGIC);
+		VTAILQ_REMOVE(&vdr_queue, group, qlist);
+		vdr_busy = group;
+		vs = group->vs;
+		Lck_Unlock(&vdr_mtx);
+
+		CHECK_OBJ_NOTNULL(vs, VDI_DNS_MAGIC);
+		n = vdr_lookup(group->hostname, ss, sl, VDI_DNS_MAX_ADDR);
+		VSC_C_main->dir_dns_lookups++;
+		if (n < 0)
+			VSC_C_main->dir_dns_failed++;
+		host = 0;
+		for (n--; n >= 0; n--) {
+			for (i = 0; i < vs->nhosts; i++) {
+				if (host < VDI_DNS_GROUP_MAX_BACKENDS &&
+				    vdi_dns_comp_addrinfo(vs->hosts[i],
+				    &ss[n], sl[n]))
+					hosts[host++] = vs->hosts[i];
+			}
 		}
+
+		now = TIM_real();
+		ttl = host > 0 ? vs->ttl : vs->negative_ttl;
+		Lck_Lock(&vs->mtx);
+		memcpy(group->hosts, hosts, host * sizeof *hosts);
+		group->nhosts = host;
+		group->answered = 1;
+		group->queued = 0;
+		group->ttl = now + ttl;
+		group->refresh = now + ttl * VDI_DNS_REFRESH;
+		AZ(pthread_cond_broadcast(&vs->cond));
+		Lck_Lock(&vdr_mtx);
+		Lck_Unlock(&vs->mtx);
+		vdr_busy = NULL;
+		AZ(pthread_cond_broadcast(&vdr_done));
 	}
-	return (0);
+	NEEDLESS_RETURN(NULL);
 }
 
-/* Add a newly cached item to the dns cache list.
- * (Sorry for the list_add/_add confusion...)
- */
+/* Hand a group to the resolver, unless it already has it */
 static void
-vdi_dns_cache_list_add(const struct sess *sp,
-		       struct vdi_dns *vs,
-		       struct vdi_dns_hostgroup *new)
+vdi_dns_queue(struct vdi_dns *vs, struct vdi_dns_hostgroup *group)
 {
-	if (vs->ncachelist >= VDI_DNS_MAX_CACHE) {
-		VSC_C_main->dir_dns_cache_full++;
-		vdi_dns_pop_cache(vs, NULL);
-	}
-	CHECK_OBJ_NOTNULL(new, VDI_DNSDIR_MAGIC);
-	assert(new->hostname != 0);
-	new->ttl = sp->t_req + vs->ttl;
-	VTAILQ_INSERT_HEAD(&vs->cachelist, new, list);
-	vs->ncachelist++;
+
+	Lck_AssertHeld(&vs->mtx);
+	if (group->queued)
+		return;
+	group->queued = 1;
+	Lck_Lock(&vdr_mtx);
+	VTAILQ_INSERT_TAIL(&vdr_queue, group, qlist);
+	AZ(pthread_cond_signal(&vdr_cond));
+	Lck_Unlock(&vdr_mtx);
 }
 
-/* Add an item to the dns cache.
- * XXX: Might want to factor the getaddrinfo() out of the lock and do the
- * cache_has() afterwards to do multiple dns lookups in parallel...
+/*--------------------------------------------------------------------
+ * The cache of hostgroups, hashed on the hostname and kept in LRU
+ * order on the cachelist.
  */
-static int
-vdi_dns_cache_add(const struct sess *sp,
-		  struct vdi_dns *vs,
-		  const char *hostname,
-		  struct director **backend)
-{
-	int error, i, host = 0;
-	struct addrinfo *res0, *res, hint;
-	struct vdi_dns_hostgroup *new;
-
-	/* Due to possible race while upgrading the lock, we have to
-	 * recheck if the result is already looked up. The overhead for
-	 * this is insignificant unless dns isn't cached properly (all
-	 * unique names or something equally troublesome).
-	 */
 
-	if (vdi_dns_cache_has(sp, vs, hostname, backend, 1))
-		return (1);
+static unsigned
+vdi_dns_hash(const char *hostname)
+{
+	uint32_t h = 2166136261U;	/* FNV-1a */
 
-	memset(&hint, 0, sizeof hint);
-	hint.ai_family = PF_UNSPEC;
-	hint.ai_socktype = SOCK_STREAM;
+	for (; *hostname != '\0'; hostname++)
+		h = (h ^ (uint8_t)*hostname) * 16777619U;
+	return (h % VDI_DNS_HASH);
+}
 
-	ALLOC_OBJ(new, VDI_DNSDIR_MAGIC);
-	XXXAN(new);
+static void
+vdi_dns_free_group(struct vdi_dns *vs, struct vdi_dns_hostgroup *group)
+{
 
-	REPLACE(new->hostname, hostname);
+	VTAILQ_REMOVE(&vs->cachelist, group, list);
+	VTAILQ_REMOVE(&vs->hash[group->hash], group, hlist);
+	vs->ncachelist--;
+	free(group->hostname);
+	FREE_OBJ(group);
+}
 
-	error = getaddrinfo(hostname, "80", &hint, &res0);
-	VSC_C_main->dir_dns_lookups++;
-	if (error) {
-		vdi_dns_cache_list_add(sp, vs, new);
-		VSC_C_main->dir_dns_failed++;
-		return (0);
-	}
+/*
+ * Throw out the least recently used group which nobody is waiting for,
+ * and which the resolver is not working on.
+ */
+static void
+vdi_dns_pop_cache(struct vdi_dns *vs)
+{
+	struct vdi_dns_hostgroup *group;
 
-	for (res = res0; res; res = res->ai_next) {
-		if (res->ai_family != PF_INET && res->ai_family != PF_INET6)
+	Lck_AssertHeld(&vs->mtx);
+	VTAILQ_FOREACH_REVERSE(group, &vs->cachelist, _cachelist, list) {
+		if (group->waiters > 0)
 			continue;
-
-		for (i = 0; i < vs->nhosts; i++) {
-			struct sockaddr_storage ss_hack;
-			memcpy(&ss_hack, res->ai_addr, res->ai_addrlen);
-			if (vdi_dns_comp_addrinfo(vs->hosts[i],
-			    &ss_hack, res->ai_addrlen)) {
-				new->hosts[host] = vs->hosts[i];
-				CHECK_OBJ_NOTNULL(new->hosts[host],
-				    DIRECTOR_MAGIC);
-				host++;
+		if (group->queued) {
+			Lck_Lock(&vdr_mtx);
+			if (vdr_busy == group) {
+				Lck_Unlock(&vdr_mtx);
+				continue;
 			}
+			VTAILQ_REMOVE(&vdr_queue, group, qlist);
+			Lck_Unlock(&vdr_mtx);
 		}
+		VSC_C_main->dir_dns_cache_full++;
+		vdi_dns_free_group(vs, group);
+		return;
 	}
-	freeaddrinfo(res0);
+}
 
-	new->nhosts = host;
-	vdi_dns_cache_list_add(sp, vs, new);
-	*backend = vdi_dns_pick_host(sp, new);
-	return (1);
+static struct vdi_dns_hostgroup *
+vdi_dns_cache_add(struct vdi_dns *vs, const char *hostname, unsigned h)
+{
+	struct vdi_dns_hostgroup *group;
+
+	Lck_AssertHeld(&vs->mtx);
+	if (vs->ncachelist >= VDI_DNS_MAX_CACHE)
+		vdi_dns_pop_cache(vs);
+	ALLOC_OBJ(group, VDI_DNSDIR_MAGIC);
+	XXXAN(group);
+	REPLACE(group->hostname, hostname);
+	group->vs = vs;
+	group->hash = h;
+	VTAILQ_INSERT_HEAD(&vs->cachelist, group, list);
+	VTAILQ_INSERT_HEAD(&vs->hash[h], group, hlist);
+	vs->ncachelist++;
+	return (group);
 }
 
-/* Walk through the cached lookups looking for the relevant host, add one
- * if it isn't already cached.
+/* Find the hostgroup, starting a lookup if we have no answer yet, and
+ * a refresh in the background if the answer is getting old.
  *
  * Returns a backend or NULL.
  */
@@ -315,25 +420,46 @@ vdi_dns_walk_cache(const struct sess *sp,
 		   struct vdi_dns *vs,
 		   const char *hostname)
 {
+	struct vdi_dns_hostgroup *group;
 	struct director *backend = NULL;
-	int ret;
-
-	AZ(pthread_rwlock_rdlock(&vs->rwlock));
-	ret = vdi_dns_cache_has(sp, vs, hostname, &backend, 0);
-	AZ(pthread_rwlock_unlock(&vs->rwlock));
-	if (!ret) {
-		/*
-		 * XXX: Isn't there a race here where another thread
-		 * XXX: could grab the lock and add it before we do ?
-		 * XXX: Should 'ret' be checked for that ?
-		 */
-		AZ(pthread_rwlock_wrlock(&vs->rwlock));
-		ret = vdi_dns_cache_add(sp, vs, hostname, &backend);
-		AZ(pthread_rwlock_unlock(&vs->rwlock));
-	} else
+	unsigned h;
+	double now;
+
+	h = vdi_dns_hash(hostname);
+	now = TIM_real();
+	Lck_Lock(&vs->mtx);
+	VTAILQ_FOREACH(group, &vs->hash[h], hlist) {
+		CHECK_OBJ_NOTNULL(group, VDI_DNSDIR_MAGIC);
+		if (!strcmp(group->hostname, hostname))
+			break;
+	}
+	if (group == NULL) {
+		group = vdi_dns_cache_add(vs, hostname, h);
+	} else if (group != VTAILQ_FIRST(&vs->cachelist)) {
+		VTAILQ_REMOVE(&vs->cachelist, group, list);
+		VTAILQ_INSERT_HEAD(&vs->cachelist, group, list);
+	}
+
+	if (group->answered && now >= group->refresh && !group->queued) {
+		VSC_C_main->dir_dns_refresh++;
+		vdi_dns_queue(vs, group);
+	}
+
+	if (group->answered && (now < group->ttl || group->queued)) {
+		/* Fresh, or being refreshed: use what we have */
 		VSC_C_main->dir_dns_hit++;
+	} else {
+		vdi_dns_queue(vs, group);
+		group->waiters++;
+		while (group->queued && Lck_CondWaitUntil(&vs->cond,
+		    &vs->mtx, now + params->connect_timeout) == 0)
+			continue;
+		group->waiters--;
+	}
+	if (group->answered)
+		backend = vdi_dns_pick_host(sp, group);
+	Lck_Unlock(&vs->mtx);
 
-	/* Bank backend == cached a failure, so to speak */
 	if (backend != NULL)
 		CHECK_OBJ_NOTNULL(backend, DIRECTOR_MAGIC);
 	return (backend);
@@ -423,15 +549,30 @@ static void
 vdi_dns_fini(const struct director *d)
 {
 	struct vdi_dns *vs;
+	struct vdi_dns_hostgroup *group, *group2;
 
 	CHECK_OBJ_NOTNULL(d, DIRECTOR_MAGIC);
 	CAST_OBJ_NOTNULL(vs, d->priv, VDI_DNS_MAGIC);
 
+	/* Take our groups back from the resolver */
+	Lck_Lock(&vdr_mtx);
+	VTAILQ_FOREACH_SAFE(group, &vdr_queue, qlist, group2)
+		if (group->vs == vs)
+			VTAILQ_REMOVE(&vdr_queue, group, qlist);
+	while (vdr_busy != NULL && vdr_busy->vs == vs)
+		Lck_CondWait(&vdr_done, &vdr_mtx);
+	Lck_Unlock(&vdr_mtx);
+
+	Lck_Lock(&vs->mtx);
+	while (!VTAILQ_EMPTY(&vs->cachelist))
+		vdi_dns_free_group(vs, VTAILQ_FIRST(&vs->cachelist));
+	Lck_Unlock(&vs->mtx);
+
 	free(vs->hosts);
 	free(vs->dir.vcl_name);
 	vs->dir.magic = 0;
-	/* FIXME: Free the cache */
-	AZ(pthread_rwlock_destroy(&vs->rwlock));
+	Lck_Delete(&vs->mtx);
+	AZ(pthread_cond_destroy(&vs->cond));
 	FREE_OBJ(vs);
 }
 
@@ -447,6 +588,13 @@ VRT_init_dir_dns(struct cli *cli, struct director **bp, int idx,
 	ASSERT_CLI();
 	(void)cli;
 	t = priv;
+	if (!vdr_running) {
+		vdr_running = 1;
+		Lck_New(&vdr_mtx, lck_dirdns);
+		AZ(pthread_cond_init(&vdr_cond, NULL));
+		AZ(pthread_cond_init(&vdr_done, NULL));
+		WRK_BgThread(&vdr_thread, "dns-resolver", vdr_resolver, NULL);
+	}
 	ALLOC_OBJ(vs, VDI_DNS_MAGIC);
 	XXXAN(vs);
 	vs->hosts = calloc(sizeof(struct director *), t->nmember);
@@ -468,7 +616,11 @@ VRT_init_dir_dns(struct cli *cli, struct director **bp, int idx,
 		vs->hosts[i] = bp[te->host];
 	vs->nhosts = t->nmember;
 	vs->ttl = t->ttl;
+	vs->negative_ttl = t->negative_ttl;
 	VTAILQ_INIT(&vs->cachelist);
-	AZ(pthread_rwlock_init(&vs->rwlock, NULL));
+	for (i = 0; i < VDI_DNS_HASH; i++)
+		VTAILQ_INIT(&vs->hash[i]);
+	Lck_New(&vs->mtx, lck_dirdns);
+	AZ(pthread_cond_init(&vs->cond, NULL));
 	bp[idx] = &vs->dir;
 }
@@ -0,0 +1,178 @@
+/*-
+ * Copyright (c) 2011 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * The least-conn director.
+ *
+ * Picks two of the healthy members at random, and uses the one with
+ * the lower cost ("power of two choices").  The cost of a backend is
+ * its average first byte time, times one more than the number of
+ * connections we have in use to it, so a backend which slows down
+ * soon gets less traffic, and a fast one can take more requests in
+ * parallel before it is passed over.  A backend we have no first byte
+ * time for yet costs nothing, so it gets tried.
+ *
+ * Comparing two random members rather than searching for the best
+ * one keeps all threads from piling onto the same backend before the
+ * counts have caught up.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include "cache.h"
+#include "cache_backend.h"
+#include "vrt.h"
+
+/*--------------------------------------------------------------------*/
+
+struct vdi_least_conn {
+	unsigned		magic;
+#define VDI_LEAST_CONN_MAGIC	0x5b1d2e47
+	struct director		dir;
+
+	unsigned		retries;
+	struct director		**hosts;
+	unsigned		nhosts;
+};
+
+static double
+vdi_least_conn_cost(const struct director *d)
+{
+
+	return (VBE_Latency(d) * (VBE_InFlight(d) + 1));
+}
+
+static struct vbc *
+vdi_least_conn_pick(struct sess *sp, const struct vdi_least_conn *vs)
+{
+	unsigned cand[vs->nhosts];
+	unsigned u, k, n, a, b;
+	struct vbc *vbe;
+
+	n = 0;
+	for (u = 0; u < vs->nhosts; u++)
+		if (VDI_Healthy(vs->hosts[u], sp))
+			cand[n++] = u;
+
+	for (k = 0; k < vs->retries && n > 0; k++) {
+		a = random() % n;
+		if (n > 1) {
+			b = random() % (n - 1);
+			if (b >= a)
+				b++;
+			if (vdi_least_conn_cost(vs->hosts[cand[b]]) <
+			    vdi_least_conn_cost(vs->hosts[cand[a]]))
+				a = b;
+		}
+		vbe = VDI_GetFd(vs->hosts[cand[a]], sp);
+		if (vbe != NULL)
+			return (vbe);
+		cand[a] = cand[--n];
+	}
+	return (NULL);
+}
+
+static struct vbc *
+vdi_least_conn_getfd(const struct director *d, struct sess *sp)
+{
+	struct vdi_least_conn *vs;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(d, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(vs, d->priv, VDI_LEAST_CONN_MAGIC);
+
+	return (vdi_least_conn_pick(sp, vs));
+}
+
+/*
+ * Healthy if just a single backend is...
+ */
+static unsigned
+vdi_least_conn_healthy(const struct director *d, const struct sess *sp)
+{
+	struct vdi_least_conn *vs;
+	unsigned u;
+
+	CHECK_OBJ_NOTNULL(d, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(vs, d->priv, VDI_LEAST_CONN_MAGIC);
+
+	for (u = 0; u < vs->nhosts; u++) {
+		if (VDI_Healthy(vs->hosts[u], sp))
+			return (1);
+	}
+	return (0);
+}
+
+static void
+vdi_least_conn_fini(const struct director *d)
+{
+	struct vdi_least_conn *vs;
+
+	CHECK_OBJ_NOTNULL(d, DIRECTOR_MAGIC);
+	CAST_OBJ_NOTNULL(vs, d->priv, VDI_LEAST_CONN_MAGIC);
+
+	free(vs->hosts);
+	free(vs->dir.vcl_name);
+	vs->dir.magic = 0;
+	FREE_OBJ(vs);
+}
+
+void
+VRT_init_dir_least_conn(struct cli *cli, struct director **bp, int idx,
+    const void *priv)
+{
+	const struct vrt_dir_least_conn *t;
+	struct vdi_least_conn *vs;
+	const struct vrt_dir_least_conn_entry *te;
+	int i;
+
+	ASSERT_CLI();
+	(void)cli;
+	t = priv;
+
+	ALLOC_OBJ(vs, VDI_LEAST_CONN_MAGIC);
+	XXXAN(vs);
+	vs->hosts = calloc(sizeof *vs->hosts, t->nmember);
+	XXXAN(vs->hosts);
+
+	vs->dir.magic = DIRECTOR_MAGIC;
+	vs->dir.priv = vs;
+	vs->dir.name = "least-conn";
+	REPLACE(vs->dir.vcl_name, t->name);
+	vs->dir.getfd = vdi_least_conn_getfd;
+	vs->dir.fini = vdi_least_conn_fini;
+	vs->dir.healthy = vdi_least_conn_healthy;
+
+	vs->retries = t->retries;
+	if (vs->retries == 0)
+		vs->retries = t->nmember;
+	for (i = 0, te = t->members; i < t->nmember; i++, te++) {
+		vs->hosts[i] = bp[te->host];
+		AN(vs->hosts[i]);
+	}
+	vs->nhosts = t->nmember;
+	bp[idx] = &vs->dir;
+}
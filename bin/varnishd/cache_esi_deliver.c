@@ -97,6 +97,8 @@ ved_include(struct sess *sp, const char *src, const char *host)
 	sp->wrk->is_gunzip = 0;
 	sp->wrk->do_gzip = 0;
 	sp->wrk->do_gunzip = 0;
+	sp->wrk->do_zstd = 0;
+	sp->wrk->codec = VCD_NONE;
 	sp->wrk->do_stream = 0;
 
 	sxid = sp->xid;
@@ -481,6 +483,10 @@ ESI_DeliverChild(const struct sess *sp)
 	int i, j;
 	uint8_t tailbuf[8];
 
+	if (sp->obj->codec != VCD_NONE) {
+		VCD_Deliver(sp, ved_pretend_gzip);
+		return;
+	}
 	if (!sp->obj->gziped) {
 		VTAILQ_FOREACH(st, &sp->obj->store, list)
 			ved_pretend_gzip(sp, st->ptr, st->len);
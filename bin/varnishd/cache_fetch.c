@@ -31,12 +31,15 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <math.h>
+#include <poll.h>
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
 
 #include "cache.h"
 #include "stevedore.h"
+#include "hash_slinger.h"
 #include "cli_priv.h"
 #include "vct.h"
 
@@ -154,7 +157,9 @@ vfp_nop_bytes(struct sess *sp, struct http_conn *htc, ssize_t bytes)
 	struct storage *st;
 
 	while (bytes > 0) {
-		st = FetchStorage(sp, 0);
+		/* With a Content-Length, 'bytes' is exactly what is left */
+		st = FetchStorage(sp,
+		    sp->wrk->body_status == BS_LENGTH ? bytes : 0);
 		if (st == NULL)
 			return(-1);
 		l = st->space - st->len;
@@ -195,7 +200,8 @@ vfp_nop_end(struct sess *sp)
 		STV_free(st);
 		return (0);
 	}
-	if (st->len < st->space)
+	/* Stream followers may be sending from it */
+	if (st->len < st->space && HSH_StreamFreeze(sp->obj) == 0)
 		STV_trim(st, st->len);
 	return (0);
 }
@@ -209,8 +215,17 @@ static struct vfp vfp_nop = {
 /*--------------------------------------------------------------------
  * Fetch Storage to put object into.
  *
+ * 'sz' is how much we expect, if known.  If not, each new segment is
+ * as large as what we have stored so far, so that big bodies of unknown
+ * length get few, large segments, and thus few, large reads.
+ *
+ * The growth stops at FETCH_GROW times fetch_chunksize, because the
+ * tail segment is only trimmed if there are no stream followers, and
+ * half of it may be air.
  */
 
+#define FETCH_GROW	32
+
 struct storage *
 FetchStorage(const struct sess *sp, ssize_t sz)
 {
@@ -224,18 +239,99 @@ FetchStorage(const struct sess *sp, ssize_t sz)
 	l = fetchfrag;
 	if (l == 0)
 		l = sz;
-	if (l == 0)
+	if (l == 0) {
 		l = params->fetch_chunksize * 1024LL;
+		if (l < sp->obj->len)
+			l = sp->obj->len;
+		if (l > params->fetch_chunksize * 1024LL * FETCH_GROW)
+			l = params->fetch_chunksize * 1024LL * FETCH_GROW;
+	}
 	st = STV_alloc(sp, l);
 	if (st == NULL) {
 		(void)FetchError(sp, "Could not get storage");
 		return (NULL);
 	}
+	sp->wrk->stats.fetch_segments++;
 	AZ(st->len);
 	VTAILQ_INSERT_TAIL(&sp->obj->store, st, list);
 	return (st);
 }
 
+/*--------------------------------------------------------------------
+ * The backend said 304 to our conditional request: make the response
+ * look like the 200 we had, with the headers the 304 sent replacing
+ * ours, except those describing the body we are going to copy.
+ */
+
+void
+FetchStaleHdr(struct sess *sp)
+{
+	struct http *hp;
+	const struct object *o;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	o = sp->stale_obj;
+	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+	hp = sp->wrk->beresp;
+	CHECK_OBJ_NOTNULL(hp, HTTP_MAGIC);
+
+	sp->wrk->stats.fetch_revalidated++;
+	http_Unset(hp, H_Content_Length);
+	http_Unset(hp, H_Content_Encoding);
+	http_Unset(hp, H_Transfer_Encoding);
+	http_CopyResp(hp, o->http);
+	http_MergeHdr(sp->wrk, sp->vbc->fd, hp, o->http);
+	sp->wrk->body_status = BS_STALE;
+}
+
+/*--------------------------------------------------------------------
+ * ...and copy the body of the object we revalidated, as it was stored.
+ */
+
+static int
+fetch_stale(struct sess *sp)
+{
+	const struct object *o;
+	struct storage *st, *st2;
+	const unsigned char *p;
+	ssize_t l, w;
+
+	o = sp->stale_obj;
+	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+	VTAILQ_FOREACH(st, &o->store, list) {
+		p = st->ptr;
+		l = st->len;
+		while (l > 0) {
+			st2 = FetchStorage(sp, o->len - sp->obj->len);
+			if (st2 == NULL)
+				return (-1);
+			w = st2->space - st2->len;
+			if (w > l)
+				w = l;
+			memcpy(st2->ptr + st2->len, p, w);
+			st2->len += w;
+			sp->obj->len += w;
+			p += w;
+			l -= w;
+		}
+	}
+	if (o->esidata != NULL) {
+		sp->obj->esidata = STV_alloc(sp, o->esidata->len);
+		if (sp->obj->esidata == NULL)
+			return (FetchError(sp,
+			    "Could not allocate storage for esidata"));
+		memcpy(sp->obj->esidata->ptr, o->esidata->ptr,
+		    o->esidata->len);
+		sp->obj->esidata->len = o->esidata->len;
+	}
+	sp->obj->gziped = o->gziped;
+	sp->obj->codec = o->codec;
+	sp->obj->gzip_start = o->gzip_start;
+	sp->obj->gzip_last = o->gzip_last;
+	sp->obj->gzip_stop = o->gzip_stop;
+	return (0);
+}
+
 /*--------------------------------------------------------------------
  * Convert a string to a size_t safely
  */
@@ -283,11 +379,32 @@ fetch_straight(struct sess *sp, struct http_conn *htc, ssize_t cl)
 /*--------------------------------------------------------------------
  * Read a chunked HTTP object.
  *
- * XXX: Reading one byte at a time is pretty pessimal.
+ * The chunk framing is parsed a byte at a time, so when the connection
+ * has nothing buffered we read ahead into a local buffer and let it
+ * pose as the pipeline, which is where HTC_Read() looks first.  Chunk
+ * bodies are thus copied out of the read-ahead, and only go directly
+ * to the socket once it is empty.
  */
 
+#define FETCH_READAHEAD		4096
+
 static int
-fetch_chunked(struct sess *sp, struct http_conn *htc)
+fetch_getc(struct sess *sp, struct http_conn *htc, char *c, char *ra)
+{
+	ssize_t i;
+
+	if (htc->pipeline.b == NULL) {
+		i = HTC_Read(sp->wrk, htc, ra, FETCH_READAHEAD);
+		if (i <= 0)
+			return (-1);
+		htc->pipeline.b = ra;
+		htc->pipeline.e = ra + i;
+	}
+	return (HTC_Read(sp->wrk, htc, c, 1));
+}
+
+static int
+fetch_chunked_ra(struct sess *sp, struct http_conn *htc, char *ra)
 {
 	int i;
 	char buf[20];		/* XXX: 20 is arbitrary */
@@ -298,7 +415,7 @@ fetch_chunked(struct sess *sp, struct http_conn *htc)
 	do {
 		/* Skip leading whitespace */
 		do {
-			if (HTC_Read(sp->wrk, htc, buf, 1) <= 0)
+			if (fetch_getc(sp, htc, buf, ra) <= 0)
 				return (-1);
 		} while (vct_islws(buf[0]));
 
@@ -308,7 +425,7 @@ fetch_chunked(struct sess *sp, struct http_conn *htc)
 		/* Collect hex digits, skipping leading zeros */
 		for (u = 1; u < sizeof buf; u++) {
 			do {
-				if (HTC_Read(sp->wrk, htc, buf + u, 1) <= 0)
+				if (fetch_getc(sp, htc, buf + u, ra) <= 0)
 					return (-1);
 			} while (u == 1 && buf[0] == '0' && buf[u] == '0');
 			if (!vct_ishex(buf[u]))
@@ -321,7 +438,7 @@ fetch_chunked(struct sess *sp, struct http_conn *htc)
 
 		/* Skip trailing white space */
 		while(vct_islws(buf[u]) && buf[u] != '\n')
-			if (HTC_Read(sp->wrk, htc, buf + u, 1) <= 0)
+			if (fetch_getc(sp, htc, buf + u, ra) <= 0)
 				return (-1);
 
 		if (buf[u] != '\n') 
@@ -335,10 +452,10 @@ fetch_chunked(struct sess *sp, struct http_conn *htc)
 		if (cl > 0 && VFP_Bytes(sp, htc, cl) <= 0)
 			return (-1);
 
-		i = HTC_Read(sp->wrk, htc, buf, 1);
+		i = fetch_getc(sp, htc, buf, ra);
 		if (i <= 0)
 			return (-1);
-		if (buf[0] == '\r' && HTC_Read(sp->wrk, htc, buf, 1) <= 0)
+		if (buf[0] == '\r' && fetch_getc(sp, htc, buf, ra) <= 0)
 			return (-1);
 		if (buf[0] != '\n')
 			return (FetchError(sp,"chunked tail no NL"));
@@ -346,6 +463,21 @@ fetch_chunked(struct sess *sp, struct http_conn *htc)
 	return (0);
 }
 
+static int
+fetch_chunked(struct sess *sp, struct http_conn *htc)
+{
+	char ra[FETCH_READAHEAD];
+	int i;
+
+	i = fetch_chunked_ra(sp, htc, ra);
+	if (htc->pipeline.b >= ra && htc->pipeline.b < ra + sizeof ra) {
+		/* Bytes after the last chunk: don't reuse the connection */
+		sp->wrk->do_close = 1;
+		htc->pipeline.b = htc->pipeline.e = NULL;
+	}
+	return (i);
+}
+
 /*--------------------------------------------------------------------*/
 
 static int
@@ -397,12 +529,153 @@ FetchReqBody(struct sess *sp)
 	}
 	if (http_GetHdr(sp->http, H_Transfer_Encoding, NULL)) {
 		/* XXX: Handle chunked encoding. */
-		WSL(sp->wrk, SLT_Debug, sp->fd, "Transfer-Encoding in request");
+		WSL(sp->wrk, SLT_Debug, sp->id, "Transfer-Encoding in request");
 		return (1);
 	}
 	return (0);
 }
 
+/*--------------------------------------------------------------------
+ * Hedged requests.
+ *
+ * If the backend has not started to answer an idempotent request by
+ * the hedge_percentile of its first byte times, we ask the director for
+ * another connection and send the request there too.  Whichever answers
+ * first is used, the other is closed.
+ *
+ * Hedges are paid for from a bucket which hedge_budget percent of all
+ * backend requests pour tokens into, so that a backend which is slow
+ * for everybody does not get all its requests twice.
+ */
+
+#define HEDGE_BURST	10.
+
+static struct lock hedge_mtx;
+static double hedge_tokens;
+static uint64_t hedge_nreq;
+
+static int
+fetch_hedge_budget(void)
+{
+	uint64_t n;
+	int i = 0;
+
+	Lck_Lock(&hedge_mtx);
+	n = VSC_C_main->backend_req;
+	hedge_tokens += (n - hedge_nreq) * params->hedge_budget * 1e-2;
+	hedge_nreq = n;
+	if (hedge_tokens > HEDGE_BURST)
+		hedge_tokens = HEDGE_BURST;
+	if (hedge_tokens >= 1.) {
+		hedge_tokens -= 1.;
+		i = 1;
+	}
+	Lck_Unlock(&hedge_mtx);
+	return (i);
+}
+
+static int
+fetch_wait(struct pollfd *pfd, int n, double until)
+{
+	int i, tmo;
+
+	for (i = 0; i < n; i++)
+		pfd[i].revents = 0;
+	tmo = (int)ceil((until - TIM_real()) * 1e3);
+	if (tmo <= 0)
+		return (0);
+	return (poll(pfd, n, tmo));
+}
+
+/*
+ * Called with the request sent on sp->vbc at time *t.  Leaves the
+ * connection to use in sp->vbc, and the time the request was sent on
+ * it in *t.
+ */
+
+static void
+fetch_hedge(struct sess *sp, double *t, int addhost)
+{
+	struct worker *w;
+	struct http *hp;
+	struct vbc *vc, *vc2;
+	struct pollfd pfd[2];
+	double d, t2;
+	const char *m;
+
+	w = sp->wrk;
+	hp = w->bereq;
+	vc = sp->vbc;
+	CHECK_OBJ_NOTNULL(vc, VBC_MAGIC);
+
+	if (params->hedge_percentile == 0)
+		return;
+	m = http_GetReq(hp);
+	if (strcmp(m, "GET") && strcmp(m, "HEAD"))
+		return;
+	if (http_GetHdr(sp->http, H_Content_Length, NULL))
+		return;
+	d = VBE_FirstBytePct(vc, params->hedge_percentile);
+	if (d <= 0. || (vc->first_byte_timeout > 0. &&
+	    d >= vc->first_byte_timeout))
+		return;
+
+	pfd[0].fd = vc->fd;
+	pfd[0].events = POLLIN;
+	if (fetch_wait(pfd, 1, *t + d) != 0)
+		return;		/* Answer (or trouble) on time */
+
+	if (!fetch_hedge_budget()) {
+		VSC_C_main->backend_hedge_budget++;
+		return;
+	}
+
+	vc2 = VDI_GetFd(NULL, sp);
+	if (vc2 == NULL)
+		return;
+	sp->vbc = vc2;
+	if (addhost) {
+		http_Unset(hp, H_Host);
+		VDI_AddHostHeader(sp);
+	}
+	(void)VTCP_blocking(vc2->fd);
+	WRW_Reserve(w, &vc2->fd);
+	(void)http_Write(w, hp, 0);
+	if (WRW_FlushRelease(w)) {
+		VDI_CloseFd(sp);
+		vc2 = NULL;
+	} else {
+		t2 = TIM_real();
+		VSC_C_main->backend_req++;
+		VSC_C_main->backend_hedge++;
+		WSL_Flush(w, 0);
+
+		pfd[1].fd = vc2->fd;
+		pfd[1].events = POLLIN;
+		(void)fetch_wait(pfd, 2, vc->first_byte_timeout > 0. ?
+		    *t + vc->first_byte_timeout : t2 + 3600.);
+		if (pfd[1].revents && !pfd[0].revents) {
+			/* The hedge won */
+			VSC_C_main->backend_hedge_win++;
+			VBE_FirstByte(vc, TIM_real() - *t, 0);
+			sp->vbc = vc;
+			VDI_CloseFd(sp);
+			sp->vbc = vc2;
+			*t = t2;
+			return;
+		}
+		VSC_C_main->backend_hedge_loss++;
+		VDI_CloseFd(sp);
+	}
+
+	/* Back to the first connection */
+	sp->vbc = vc;
+	if (addhost) {
+		http_Unset(hp, H_Host);
+		VDI_AddHostHeader(sp);
+	}
+}
+
 /*--------------------------------------------------------------------
  * Send request, and receive the HTTP protocol response, but not the
  * response body.
@@ -421,7 +694,8 @@ FetchHdr(struct sess *sp)
 	char *b;
 	struct http *hp;
 	int retry = -1;
-	int i;
+	int i, addhost;
+	double t;
 
 	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
 	CHECK_OBJ_NOTNULL(sp->wrk, WORKER_MAGIC);
@@ -451,7 +725,8 @@ FetchHdr(struct sess *sp)
 	 * header if one is necessary.  This cannot be done in the VCL
 	 * because the backend may be chosen by a director.
 	 */
-	if (!http_GetHdr(hp, H_Host, &b))
+	addhost = !http_GetHdr(hp, H_Host, &b);
+	if (addhost)
 		VDI_AddHostHeader(sp);
 
 	(void)VTCP_blocking(vc->fd);	/* XXX: we should timeout instead */
@@ -473,6 +748,11 @@ FetchHdr(struct sess *sp)
 
 	/* XXX is this the right place? */
 	VSC_C_main->backend_req++;
+	t = TIM_real();
+
+	fetch_hedge(sp, &t, addhost);
+	vc = sp->vbc;
+	retry = vc->recycled ? 1 : -1;
 
 	/* Receive response */
 
@@ -482,6 +762,7 @@ FetchHdr(struct sess *sp)
 	VTCP_set_read_timeout(vc->fd, vc->first_byte_timeout);
 
 	i = HTC_Rx(w->htc);
+	VBE_FirstByte(vc, TIM_real() - t, i >= 0);
 
 	if (i < 0) {
 		WSP(sp, SLT_FetchError, "http first read error: %d %d (%s)",
@@ -525,6 +806,7 @@ FetchBody(struct sess *sp)
 	int cls;
 	struct storage *st;
 	struct worker *w;
+	struct busyobj *bo;
 	int mklen;
 	ssize_t cl;
 
@@ -546,6 +828,7 @@ FetchBody(struct sess *sp)
 	/* XXX: pick up estimate from objdr ? */
 	cl = 0;
 	w->fetch_failed = 0;
+	w->htc->reads = 0;
 	switch (w->body_status) {
 	case BS_NONE:
 		cls = 0;
@@ -580,6 +863,10 @@ FetchBody(struct sess *sp)
 		if (VFP_End(sp))
 			cls = -1;
 		break;
+	case BS_STALE:
+		cls = fetch_stale(sp);
+		mklen = 1;
+		break;
 	case BS_ERROR:
 		cls = 1;
 		mklen = 0;
@@ -590,6 +877,7 @@ FetchBody(struct sess *sp)
 		INCOMPL();
 	}
 	AZ(w->vgz_rx);
+	w->stats.fetch_reads += w->htc->reads;
 
 	/*
 	 * It is OK for ->end to just leave the last storage segment
@@ -610,7 +898,9 @@ FetchBody(struct sess *sp)
 	if (cls < 0) {
 		w->stats.fetch_failed++;
 		/* XXX: Wouldn't this store automatically be released ? */
-		while (!VTAILQ_EMPTY(&sp->obj->store)) {
+		/* ...not while stream followers are sending from it */
+		while (HSH_StreamFreeze(sp->obj) == 0 &&
+		    !VTAILQ_EMPTY(&sp->obj->store)) {
 			st = VTAILQ_FIRST(&sp->obj->store);
 			VTAILQ_REMOVE(&sp->obj->store, st, list);
 			STV_free(st);
@@ -641,9 +931,17 @@ FetchBody(struct sess *sp)
 	}
 
 	if (mklen > 0) {
+		/* Stream followers may be copying the headers */
+		bo = NULL;
+		if (sp->obj->objcore != NULL)
+			bo = sp->obj->objcore->busyobj;
+		if (bo != NULL)
+			Lck_Lock(&bo->mtx);
 		http_Unset(sp->obj->http, H_Content_Length);
 		http_PrintfHeader(w, sp->fd, sp->obj->http,
 		    "Content-Length: %jd", (intmax_t)sp->obj->len);
+		if (bo != NULL)
+			Lck_Unlock(&bo->mtx);
 	}
 
 	if (cls)
@@ -680,5 +978,6 @@ void
 Fetch_Init(void)
 {
 
+	Lck_New(&hedge_mtx, lck_hedge);
 	CLI_AddFuncs(debug_cmds);
 }
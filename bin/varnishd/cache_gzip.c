@@ -65,19 +65,23 @@
  */
 
 #include "config.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "vsl.h"
 #include "cache.h"
 #include "stevedore.h"
+#include "vend.h"
 
 #include "vgz.h"
 
+struct pgz_job;
+
 struct vgz {
 	unsigned		magic;
 #define VGZ_MAGIC		0x162df0cb
-	enum {VGZ_GZ,VGZ_UN}	dir;
+	enum {VGZ_GZ,VGZ_UN,VGZ_PGZ}	dir;
 	struct sess		*sess;
 	const char		*id;
 	struct ws		*tmp;
@@ -87,6 +91,12 @@ struct vgz {
 	struct storage		*obuf;
 
 	z_stream		vz;
+
+	/* VGZ_PGZ: blocks being compressed, in output order */
+	VTAILQ_HEAD(,pgz_job)	pjobs;
+	unsigned		npjobs;
+	struct pgz_job		*pjob;		/* being filled */
+	uint32_t		pcrc;
 };
 
 /*--------------------------------------------------------------------*/
@@ -425,7 +435,11 @@ VGZ_Destroy(struct vgz **vgp)
 	    (intmax_t)vg->vz.stop_bit);
 	if (vg->tmp != NULL)
 		WS_Reset(vg->tmp, vg->tmp_snapshot);
-	if (vg->dir == VGZ_GZ)
+	if (vg->dir == VGZ_PGZ) {
+		AZ(vg->npjobs);
+		AZ(vg->pjob);
+		i = Z_OK;
+	} else if (vg->dir == VGZ_GZ)
 		i = deflateEnd(&vg->vz);
 	else
 		i = inflateEnd(&vg->vz);
@@ -604,6 +618,379 @@ struct vfp vfp_gzip = {
         .end    =       vfp_gzip_end,
 };
 
+/*--------------------------------------------------------------------
+ * VFP_PGZIP
+ *
+ * Like VFP_GZIP, but the body is cut into gzip_block sized pieces which
+ * a pool of helper threads compress as independent raw deflate streams,
+ * the way pigz does it.  Each piece is primed with the tail of the one
+ * before it as dictionary, so the compression ratio hardly suffers, and
+ * all but the last end with a sync flush, so they can be concatenated
+ * as they are.  The fetching worker compresses the last piece itself,
+ * and writes the gzip header and trailer around them, combining the
+ * CRCs of the pieces with crc32_combine().
+ */
+
+struct pgz_job {
+	unsigned		magic;
+#define PGZ_JOB_MAGIC		0x5b3e02a6
+	VTAILQ_ENTRY(pgz_job)	list;		/* pgz_queue */
+	VTAILQ_ENTRY(pgz_job)	order;		/* vgz->pjobs */
+	enum {PGZ_FILL, PGZ_QUEUED, PGZ_BUSY, PGZ_DONE} state;
+	int			last;
+
+	int			level;
+	int			window;
+	int			memlevel;
+
+	unsigned char		*dict;
+	size_t			ldict;
+	unsigned char		*ibuf;
+	size_t			lbuf;
+	size_t			ilen;
+	unsigned char		*obuf;
+	size_t			olen;
+
+	uint32_t		crc;
+	uLong			last_bit;
+	uLong			stop_bit;
+};
+
+/* Worst case raw deflate size, see deflateBound(), plus a sync flush */
+#define PGZ_BOUND(l)	((l) + ((l) + 7) / 8 + ((l) + 63) / 64 + 32)
+
+static struct lock pgz_mtx;
+static pthread_cond_t pgz_work_cond;
+static pthread_cond_t pgz_done_cond;
+static VTAILQ_HEAD(,pgz_job) pgz_queue = VTAILQ_HEAD_INITIALIZER(pgz_queue);
+static unsigned pgz_nthreads;
+
+static struct pgz_job *
+pgz_newjob(const struct pgz_job *prev)
+{
+	struct pgz_job *pj;
+	size_t w;
+
+	ALLOC_OBJ(pj, PGZ_JOB_MAGIC);
+	AN(pj);
+	pj->level = params->gzip_level;
+	pj->window = params->gzip_window;
+	pj->memlevel = params->gzip_memlevel;
+	pj->lbuf = params->gzip_block * 1024;
+	w = 1U << pj->window;
+	pj->dict = malloc(w + pj->lbuf + PGZ_BOUND(pj->lbuf));
+	AN(pj->dict);
+	pj->ibuf = pj->dict + w;
+	pj->obuf = pj->ibuf + pj->lbuf;
+	if (prev != NULL) {
+		pj->ldict = prev->ilen < w ? prev->ilen : w;
+		memcpy(pj->dict, prev->ibuf + prev->ilen - pj->ldict,
+		    pj->ldict);
+	}
+	return (pj);
+}
+
+static void
+pgz_freejob(struct pgz_job *pj)
+{
+
+	CHECK_OBJ_NOTNULL(pj, PGZ_JOB_MAGIC);
+	free(pj->dict);
+	FREE_OBJ(pj);
+}
+
+/* Runs on a helper thread, or on the fetching worker for the last one */
+static void
+pgz_compress(struct pgz_job *pj)
+{
+	z_stream vz;
+	int i;
+
+	CHECK_OBJ_NOTNULL(pj, PGZ_JOB_MAGIC);
+	memset(&vz, 0, sizeof vz);
+	i = deflateInit2(&vz, pj->level, Z_DEFLATED, -pj->window,
+	    pj->memlevel, Z_DEFAULT_STRATEGY);
+	assert(Z_OK == i);
+	if (pj->ldict > 0)
+		assert(Z_OK ==
+		    deflateSetDictionary(&vz, pj->dict, pj->ldict));
+	vz.next_in = pj->ibuf;
+	vz.avail_in = pj->ilen;
+	vz.next_out = pj->obuf;
+	vz.avail_out = PGZ_BOUND(pj->lbuf);
+	i = deflate(&vz, pj->last ? Z_FINISH : Z_SYNC_FLUSH);
+	assert(i == (pj->last ? Z_STREAM_END : Z_OK));
+	AZ(vz.avail_in);
+	AN(vz.avail_out);
+	pj->olen = vz.total_out;
+	pj->last_bit = vz.last_bit;
+	pj->stop_bit = vz.stop_bit;
+	pj->crc = crc32(0L, pj->ibuf, pj->ilen);
+	(void)deflateEnd(&vz);
+}
+
+static void *
+pgz_helper(void *priv)
+{
+	struct pgz_job *pj;
+
+	(void)priv;
+	THR_SetName("gzip-helper");
+	Lck_Lock(&pgz_mtx);
+	while (1) {
+		pj = VTAILQ_FIRST(&pgz_queue);
+		if (pj == NULL) {
+			Lck_CondWait(&pgz_work_cond, &pgz_mtx);
+			continue;
+		}
+		VTAILQ_REMOVE(&pgz_queue, pj, list);
+		pj->state = PGZ_BUSY;
+		Lck_Unlock(&pgz_mtx);
+		pgz_compress(pj);
+		Lck_Lock(&pgz_mtx);
+		pj->state = PGZ_DONE;
+		AZ(pthread_cond_broadcast(&pgz_done_cond));
+	}
+	NEEDLESS_RETURN(NULL);
+}
+
+/* Append to the object, like VGZ_ObufStorage() does for deflate() */
+static int
+pgz_emit(const struct sess *sp, struct vgz *vg, const void *ptr, size_t len)
+{
+	struct storage *st;
+	const unsigned char *p = ptr;
+	size_t l;
+
+	while (len > 0) {
+		st = FetchStorage(sp, 0);
+		if (st == NULL)
+			return (-1);
+		l = st->space - st->len;
+		if (l > len)
+			l = len;
+		memcpy(st->ptr + st->len, p, l);
+		st->len += l;
+		sp->obj->len += l;
+		vg->vz.total_out += l;
+		p += l;
+		len -= l;
+	}
+	return (0);
+}
+
+/* Hand the block being filled to the helpers, start on the next */
+static void
+pgz_submit(const struct sess *sp, struct vgz *vg)
+{
+	struct pgz_job *pj;
+
+	pj = vg->pjob;
+	CHECK_OBJ_NOTNULL(pj, PGZ_JOB_MAGIC);
+	vg->pjob = pgz_newjob(pj);
+	VTAILQ_INSERT_TAIL(&vg->pjobs, pj, order);
+	vg->npjobs++;
+	sp->wrk->stats.n_gzip_block++;
+	Lck_Lock(&pgz_mtx);
+	pj->state = PGZ_QUEUED;
+	VTAILQ_INSERT_TAIL(&pgz_queue, pj, list);
+	AZ(pthread_cond_signal(&pgz_work_cond));
+	Lck_Unlock(&pgz_mtx);
+}
+
+/* Emit finished blocks in order, waiting until at most 'keep' are left */
+static int
+pgz_reap(const struct sess *sp, struct vgz *vg, unsigned keep)
+{
+	struct pgz_job *pj;
+	int i;
+
+	while ((pj = VTAILQ_FIRST(&vg->pjobs)) != NULL) {
+		Lck_Lock(&pgz_mtx);
+		while (pj->state != PGZ_DONE && vg->npjobs > keep)
+			Lck_CondWait(&pgz_done_cond, &pgz_mtx);
+		i = (pj->state == PGZ_DONE);
+		Lck_Unlock(&pgz_mtx);
+		if (!i)
+			break;
+		VTAILQ_REMOVE(&vg->pjobs, pj, order);
+		vg->npjobs--;
+		vg->pcrc = crc32_combine(vg->pcrc, pj->crc, pj->ilen);
+		vg->vz.total_in += pj->ilen;
+		i = pgz_emit(sp, vg, pj->obuf, pj->olen);
+		pgz_freejob(pj);
+		if (i)
+			return (-1);
+	}
+	return (0);
+}
+
+/* Withdraw what the helpers have not started on, wait for the rest */
+static void
+pgz_abort(struct vgz *vg)
+{
+	struct pgz_job *pj;
+
+	Lck_Lock(&pgz_mtx);
+	while ((pj = VTAILQ_FIRST(&vg->pjobs)) != NULL) {
+		if (pj->state == PGZ_QUEUED)
+			VTAILQ_REMOVE(&pgz_queue, pj, list);
+		else if (pj->state != PGZ_DONE) {
+			Lck_CondWait(&pgz_done_cond, &pgz_mtx);
+			continue;
+		}
+		VTAILQ_REMOVE(&vg->pjobs, pj, order);
+		vg->npjobs--;
+		pgz_freejob(pj);
+	}
+	Lck_Unlock(&pgz_mtx);
+	if (vg->pjob != NULL) {
+		pgz_freejob(vg->pjob);
+		vg->pjob = NULL;
+	}
+}
+
+static void __match_proto__()
+vfp_pgzip_begin(struct sess *sp, size_t estimate)
+{
+	static const unsigned char hdr[10] =
+	    { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 0x03 };
+	struct vgz *vg;
+
+	(void)estimate;
+	AZ(sp->wrk->vgz_rx);
+	vg = vgz_alloc_vgz(sp, "G F P");
+	vg->dir = VGZ_PGZ;
+	VTAILQ_INIT(&vg->pjobs);
+	vg->pjob = pgz_newjob(NULL);
+	VSC_C_main->n_gzip++;
+	sp->wrk->vgz_rx = vg;
+	if (!pgz_emit(sp, vg, hdr, sizeof hdr))
+		vg->vz.start_bit = vg->vz.total_out * 8;
+}
+
+static int __match_proto__()
+vfp_pgzip_bytes(struct sess *sp, struct http_conn *htc, ssize_t bytes)
+{
+	struct vgz *vg;
+	struct pgz_job *pj;
+	ssize_t l, w;
+
+	vg = sp->wrk->vgz_rx;
+	CHECK_OBJ_NOTNULL(vg, VGZ_MAGIC);
+	while (bytes > 0) {
+		pj = vg->pjob;
+		CHECK_OBJ_NOTNULL(pj, PGZ_JOB_MAGIC);
+		l = pj->lbuf - pj->ilen;
+		if (l > bytes)
+			l = bytes;
+		w = HTC_Read(sp->wrk, htc, pj->ibuf + pj->ilen, l);
+		if (w <= 0)
+			return (w);
+		pj->ilen += w;
+		bytes -= w;
+		if (pj->ilen < pj->lbuf)
+			continue;
+		pgz_submit(sp, vg);
+		if (pgz_reap(sp, vg, 2 * pgz_nthreads))
+			return (-1);
+		if (sp->wrk->do_stream)
+			RES_StreamPoll(sp);
+	}
+	return (1);
+}
+
+static int __match_proto__()
+vfp_pgzip_end(struct sess *sp)
+{
+	struct vgz *vg;
+	struct pgz_job *pj;
+	unsigned char tlr[8];
+	uLong base;
+	int i;
+
+	vg = sp->wrk->vgz_rx;
+	CHECK_OBJ_NOTNULL(vg, VGZ_MAGIC);
+	sp->wrk->vgz_rx = NULL;
+
+	if (sp->wrk->fetch_failed) {
+		pgz_abort(vg);
+		(void)VGZ_Destroy(&vg);
+		return(0);
+	}
+	pj = vg->pjob;
+	vg->pjob = NULL;
+	pj->last = 1;
+	pgz_compress(pj);
+	if (pgz_reap(sp, vg, 0)) {
+		pgz_freejob(pj);
+		pgz_abort(vg);
+		(void)VGZ_Destroy(&vg);
+		return (-1);
+	}
+	AZ(vg->npjobs);
+	vg->pcrc = crc32_combine(vg->pcrc, pj->crc, pj->ilen);
+	vg->vz.total_in += pj->ilen;
+	base = vg->vz.total_out * 8;
+	vg->vz.last_bit = base + pj->last_bit;
+	vg->vz.stop_bit = base + pj->stop_bit;
+	i = pgz_emit(sp, vg, pj->obuf, pj->olen);
+	pgz_freejob(pj);
+	vle32enc(tlr, vg->pcrc);
+	vle32enc(tlr + 4, (uint32_t)vg->vz.total_in);
+	if (i || pgz_emit(sp, vg, tlr, sizeof tlr)) {
+		(void)VGZ_Destroy(&vg);
+		return (-1);
+	}
+	if (sp->wrk->do_stream)
+		RES_StreamPoll(sp);
+	vg->last_i = Z_STREAM_END;
+	VGZ_UpdateObj(vg, sp->obj);
+	if (VGZ_Destroy(&vg) != VGZ_END)
+		return(FetchError(sp, "Gzip error at the very end"));
+	return (0);
+}
+
+struct vfp vfp_pgzip = {
+        .begin  =       vfp_pgzip_begin,
+        .bytes  =       vfp_pgzip_bytes,
+        .end    =       vfp_pgzip_end,
+};
+
+/*--------------------------------------------------------------------
+ * Each job mallocs a window, a block and its worst case output, which is
+ * only worth it for bodies we know will fill the blocks.
+ */
+
+int
+VGZ_Parallel(const struct sess *sp)
+{
+	char *p;
+	long long cl;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	if (pgz_nthreads == 0 || sp->wrk->h_content_length == NULL)
+		return (0);
+	cl = strtoll(sp->wrk->h_content_length, &p, 10);
+	return (*p == '\0' && cl >= params->gzip_block * 1024LL);
+}
+
+void
+VGZ_Init(void)
+{
+	pthread_t tp;
+	unsigned u;
+
+	Lck_New(&pgz_mtx, lck_pgzip);
+	AZ(pthread_cond_init(&pgz_work_cond, NULL));
+	AZ(pthread_cond_init(&pgz_done_cond, NULL));
+	pgz_nthreads = params->gzip_threads;
+	for (u = 0; u < pgz_nthreads; u++) {
+		AZ(pthread_create(&tp, NULL, pgz_helper, NULL));
+		AZ(pthread_detach(tp));
+	}
+}
+
 /*--------------------------------------------------------------------
  * VFP_TESTGZIP
  *
@@ -64,10 +64,219 @@
 #include "stevedore.h"
 #include "hash_slinger.h"
 #include "vsha256.h"
+#include "hash_digest.h"
 #include "cache_backend.h"
 
 static const struct hash_slinger *hash;
 
+/*---------------------------------------------------------------------
+ * Busyobjs carry a lock and a condvar for streaming followers, so they
+ * are recycled through the worker rather than freed whenever possible.
+ */
+
+static struct busyobj *
+hsh_newbusyobj(void)
+{
+	struct busyobj *bo;
+
+	ALLOC_OBJ(bo, BUSYOBJ_MAGIC);
+	XXXAN(bo);
+	Lck_New(&bo->mtx, lck_busyobj);
+	AZ(pthread_cond_init(&bo->cond, NULL));
+	bo->stream_clen = -1;
+	return (bo);
+}
+
+static void
+hsh_freebusyobj(struct worker *w, struct busyobj *bo)
+{
+
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	AZ(bo->stream_nfollow);
+	AZ(bo->stream_nwait);
+	if (w != NULL && w->nbusyobj == NULL) {
+		bo->vary = NULL;
+		bo->stream_state = BOS_NONE;
+		bo->stream_obj = NULL;
+		bo->stream_len = 0;
+		bo->stream_clen = -1;
+		w->nbusyobj = bo;
+		return;
+	}
+	AZ(pthread_cond_destroy(&bo->cond));
+	Lck_Delete(&bo->mtx);
+	FREE_OBJ(bo);
+}
+
+/*---------------------------------------------------------------------
+ * The objhead vary index, see struct vryidx.  All under oh->mtx.
+ *
+ * Busy objects are not indexed, they stay on the tail of oh->objcs
+ * until HSH_Unbusy() moves them to the front and indexes them.
+ */
+
+static struct objcorehead *
+hsh_vrybucket(const struct vryidx *vi, uint32_t key)
+{
+
+	return (&vi->bucket[key & (vi->nbucket - 1)]);
+}
+
+static void
+hsh_vrygrow(struct vryidx *vi)
+{
+	struct objcorehead *ob;
+	struct objcore *oc;
+	unsigned u, n;
+
+	n = vi->nbucket == 0 ? 4 : vi->nbucket * 2;
+	ob = calloc(n, sizeof *ob);
+	if (ob == NULL)
+		return;
+	for (u = 0; u < n; u++)
+		VTAILQ_INIT(&ob[u]);
+	/* Each new bucket gets from one old bucket, take them in order */
+	for (u = 0; u < vi->nbucket; u++) {
+		while (!VTAILQ_EMPTY(&vi->bucket[u])) {
+			oc = VTAILQ_FIRST(&vi->bucket[u]);
+			VTAILQ_REMOVE(&vi->bucket[u], oc, vary_list);
+			VTAILQ_INSERT_TAIL(&ob[oc->vary_key & (n - 1)],
+			    oc, vary_list);
+		}
+	}
+	free(vi->bucket);
+	vi->bucket = ob;
+	vi->nbucket = n;
+}
+
+static struct vryidx *
+hsh_newvryidx(struct objhead *oh)
+{
+	struct vryidx *vi;
+	struct objcore *oc;
+
+	ALLOC_OBJ(vi, VRYIDX_MAGIC);
+	if (vi == NULL)
+		return (NULL);
+	VTAILQ_INIT(&vi->plain);
+	hsh_vrygrow(vi);
+	if (vi->bucket == NULL) {
+		FREE_OBJ(vi);
+		return (NULL);
+	}
+	/* Whatever is there already we know nothing about */
+	VTAILQ_FOREACH(oc, &oh->objcs, list) {
+		if (oc->flags & OC_F_BUSY)
+			continue;
+		AZ(oc->vary_spec);
+		oc->vary_spec = OC_VRY_PLAIN;
+		VTAILQ_INSERT_TAIL(&vi->plain, oc, vary_list);
+	}
+	oh->vryidx = vi;
+	return (vi);
+}
+
+/*
+ * Add a not-busy objcore, with its object if we have it.  Objects with
+ * a Vary: go in their bucket, oc->vary_key must be VRY_Key() of it.
+ */
+
+static void
+hsh_vryinsert(struct objhead *oh, struct objcore *oc, const struct object *o)
+{
+	struct vryidx *vi;
+	unsigned u, f;
+
+	Lck_AssertHeld(&oh->mtx);
+	AZ(oc->flags & OC_F_BUSY);
+	AZ(oc->vary_spec);
+	vi = oh->vryidx;
+	if (vi == NULL) {
+		/* Nothing varies, the objhead list will do */
+		if (o == NULL || o->vary == NULL)
+			return;
+		vi = hsh_newvryidx(oh);
+		if (vi == NULL)
+			return;
+		/* That picked up oc as well */
+		VTAILQ_REMOVE(&vi->plain, oc, vary_list);
+		oc->vary_spec = OC_VRY_NONE;
+	}
+	CHECK_OBJ_NOTNULL(vi, VRYIDX_MAGIC);
+
+	f = 0;
+	u = VRYIDX_NSPEC;
+	if (o != NULL && o->vary != NULL) {
+		for (u = 0; u < VRYIDX_NSPEC; u++) {
+			if (vi->spec[u].names == NULL) {
+				if (f == 0)
+					f = u + 1;
+			} else if (VRY_SameNames(vi->spec[u].names, o->vary))
+				break;
+		}
+		if (u == VRYIDX_NSPEC && f != 0) {
+			u = f - 1;
+			vi->spec[u].names = VRY_Names(o->vary);
+		}
+	}
+	if (u == VRYIDX_NSPEC) {
+		/* No Vary: or too many different ones */
+		oc->vary_spec = OC_VRY_PLAIN;
+		VTAILQ_INSERT_HEAD(&vi->plain, oc, vary_list);
+		return;
+	}
+	vi->spec[u].refcnt++;
+	oc->vary_spec = u + 1;
+	if (++vi->nobj > 2 * vi->nbucket)
+		hsh_vrygrow(vi);
+	VTAILQ_INSERT_HEAD(hsh_vrybucket(vi, oc->vary_key), oc, vary_list);
+}
+
+static void
+hsh_vryremove(struct objhead *oh, struct objcore *oc)
+{
+	struct vryidx *vi;
+	struct vryspec *vs;
+
+	Lck_AssertHeld(&oh->mtx);
+	if (oc->vary_spec == OC_VRY_NONE)
+		return;
+	vi = oh->vryidx;
+	CHECK_OBJ_NOTNULL(vi, VRYIDX_MAGIC);
+	if (oc->vary_spec == OC_VRY_PLAIN) {
+		VTAILQ_REMOVE(&vi->plain, oc, vary_list);
+	} else {
+		assert(oc->vary_spec <= VRYIDX_NSPEC);
+		vs = &vi->spec[oc->vary_spec - 1];
+		VTAILQ_REMOVE(hsh_vrybucket(vi, oc->vary_key), oc, vary_list);
+		assert(vi->nobj > 0);
+		vi->nobj--;
+		assert(vs->refcnt > 0);
+		if (--vs->refcnt == 0) {
+			free(vs->names);
+			vs->names = NULL;
+		}
+	}
+	oc->vary_spec = OC_VRY_NONE;
+}
+
+static void
+hsh_delvryidx(struct objhead *oh)
+{
+	struct vryidx *vi;
+	unsigned u;
+
+	vi = oh->vryidx;
+	oh->vryidx = NULL;
+	CHECK_OBJ_NOTNULL(vi, VRYIDX_MAGIC);
+	AZ(vi->nobj);
+	assert(VTAILQ_EMPTY(&vi->plain));
+	for (u = 0; u < VRYIDX_NSPEC; u++)
+		AZ(vi->spec[u].names);
+	free(vi->bucket);
+	FREE_OBJ(vi);
+}
+
 /*---------------------------------------------------------------------*/
 /* Precreate an objhead and object for later use */
 void
@@ -111,10 +320,8 @@ HSH_Prealloc(const struct sess *sp)
 	}
 	CHECK_OBJ_NOTNULL(w->nwaitinglist, WAITINGLIST_MAGIC);
 
-	if (w->nbusyobj == NULL) {
-		ALLOC_OBJ(w->nbusyobj, BUSYOBJ_MAGIC);
-		XXXAN(w->nbusyobj);
-	}
+	if (w->nbusyobj == NULL)
+		w->nbusyobj = hsh_newbusyobj();
 
 	if (hash->prep != NULL)
 		hash->prep(sp);
@@ -145,7 +352,7 @@ HSH_Cleanup(struct worker *w)
 		w->nhashpriv = NULL;
 	}
 	if (w->nbusyobj != NULL) {
-		FREE_OBJ(w->nbusyobj);
+		hsh_freebusyobj(NULL, w->nbusyobj);
 		w->nbusyobj = NULL;
 	}
 }
@@ -156,11 +363,27 @@ HSH_DeleteObjHead(struct worker *w, struct objhead *oh)
 
 	AZ(oh->refcnt);
 	assert(VTAILQ_EMPTY(&oh->objcs));
+	if (oh->vryidx != NULL)
+		hsh_delvryidx(oh);
 	Lck_Delete(&oh->mtx);
 	w->stats.n_objecthead--;
 	FREE_OBJ(oh);
 }
 
+void
+HSH_DigestInit(const struct sess *sp)
+{
+
+	hsh_digest->init(sp->wrk->hshctx);
+}
+
+void
+HSH_DigestFinal(struct sess *sp)
+{
+
+	hsh_digest->final(sp->wrk->hshctx, sp->digest);
+}
+
 void
 HSH_AddString(const struct sess *sp, const char *str)
 {
@@ -170,8 +393,8 @@ HSH_AddString(const struct sess *sp, const char *str)
 		str = "";
 	l = strlen(str);
 
-	SHA256_Update(sp->wrk->sha256ctx, str, l);
-	SHA256_Update(sp->wrk->sha256ctx, "#", 1);
+	hsh_digest->update(sp->wrk->hshctx, str, l);
+	hsh_digest->update(sp->wrk->hshctx, "#", 1);
 
 	if (params->log_hash)
 		WSP(sp, SLT_Hash, "%s", str);
@@ -293,12 +516,227 @@ HSH_Insert(const struct sess *sp)
 	VTAILQ_INSERT_HEAD(&oh->objcs, oc, list);
 	/* NB: do not deref objhead the new object inherits our reference */
 	oc->objhead = oh;
+	/* We don't know what it varies on without loading it */
+	hsh_vryinsert(oh, oc, NULL);
 	Lck_Unlock(&oh->mtx);
 	sp->wrk->stats.n_vampireobject++;
 	return (oc);
 }
 
 /*---------------------------------------------------------------------
+ * Look at an objcore for HSH_Lookup(), remembering busy and grace
+ * candidates.  Returns true if it holds a valid object for us.
+ */
+
+static int
+hsh_check(struct sess *sp, const struct objhead *oh, struct objcore *oc,
+    struct objcore **busy_oc, struct objcore **grace_oc, double *grace_ttl)
+{
+	struct object *o;
+
+	/* Must be at least our own ref + the objcore we examine */
+	assert(oh->refcnt > 1);
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	assert(oc->objhead == oh);
+
+	if (oc->flags & OC_F_BUSY) {
+		CHECK_OBJ_NOTNULL(oc->busyobj, BUSYOBJ_MAGIC);
+		if (sp->hash_ignore_busy || sp->hash_always_miss)
+			return (0);
+
+		if (oc->busyobj->vary != NULL &&
+		    !VRY_Match(sp, oc->busyobj->vary))
+			return (0);
+
+		*busy_oc = oc;
+		return (0);
+	}
+
+	o = oc_getobj(sp->wrk, oc);
+	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+
+	if (o->exp.ttl <= 0.)
+		return (0);
+	if (BAN_CheckObject(o, sp))
+		return (0);
+	if (o->vary != NULL && !VRY_Match(sp, o->vary))
+		return (0);
+
+	/* If still valid, use it */
+	if (EXP_Ttl(sp, o) >= sp->t_req)
+		return (1);
+
+	/*
+	 * Remember any matching objects inside their grace period
+	 * and if there are several, use the least expired one.
+	 */
+	if (EXP_Grace(sp, o) >= sp->t_req) {
+		if (*grace_oc == NULL ||
+		    *grace_ttl < o->exp.entered + o->exp.ttl) {
+			*grace_oc = oc;
+			*grace_ttl = o->exp.entered + o->exp.ttl;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Only look at the busy objects, the plain list and the buckets the
+ * request hashes to.  Each list is newest first, so we take the first
+ * valid object on each and the newest of those.
+ */
+
+static struct objcore *
+hsh_vrylookup(struct sess *sp, const struct objhead *oh,
+    struct objcore **busy_oc, struct objcore **grace_oc, double *grace_ttl)
+{
+	struct vryidx *vi;
+	struct objcore *oc, *best = NULL;
+	uint32_t key;
+	unsigned u;
+
+	vi = oh->vryidx;
+	CHECK_OBJ_NOTNULL(vi, VRYIDX_MAGIC);
+
+	VTAILQ_FOREACH_REVERSE(oc, &oh->objcs, objcorehead, list) {
+		if (!(oc->flags & OC_F_BUSY))
+			break;
+		(void)hsh_check(sp, oh, oc, busy_oc, grace_oc, grace_ttl);
+	}
+
+	VTAILQ_FOREACH(oc, &vi->plain, vary_list)
+		if (hsh_check(sp, oh, oc, busy_oc, grace_oc, grace_ttl))
+			break;
+	best = oc;
+
+	for (u = 0; u < VRYIDX_NSPEC; u++) {
+		if (vi->spec[u].names == NULL)
+			continue;
+		/* Also records our values for a busyobj if we miss */
+		(void)VRY_Match(sp, vi->spec[u].names);
+		key = VRY_ReqKey(sp, vi->spec[u].names);
+		VTAILQ_FOREACH(oc, hsh_vrybucket(vi, key), vary_list) {
+			if (oc->vary_key != key || oc->vary_spec != u + 1)
+				continue;
+			if (hsh_check(sp, oh, oc,
+			    busy_oc, grace_oc, grace_ttl))
+				break;
+		}
+		if (oc != NULL && (best == NULL ||
+		    oc_getobj(sp->wrk, oc)->exp.entered >
+		    oc_getobj(sp->wrk, best)->exp.entered))
+			best = oc;
+	}
+	return (best);
+}
+
+/*---------------------------------------------------------------------
+ * Attach to a busy object which is being streamed, rather than wait for
+ * the fetch to complete.
+ */
+
+static void hsh_rush(struct objhead *oh);
+
+static int
+hsh_follow(struct sess *sp, const struct objhead *oh, struct objcore *oc)
+{
+	struct busyobj *bo;
+	const struct object *o;
+	int retval = 0;
+
+	Lck_AssertHeld(&oh->mtx);
+	bo = oc->busyobj;
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	if (!params->stream_follow || sp->esi_level > 0 || !sp->wantbody)
+		return (0);
+	/* RES_StreamFollow() only does full 200s, let these wait for 304/206 */
+	if (sp->http->conds || (params->http_range_support &&
+	    http_GetHdr(sp->http, H_Range, NULL)))
+		return (0);
+	Lck_Lock(&bo->mtx);
+	if (bo->stream_state == BOS_STREAM) {
+		o = bo->stream_obj;
+		CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+		/* We found it busy, without looking at Vary or bans */
+		if ((o->vary != NULL && !VRY_Match(sp, o->vary)) ||
+		    BAN_Match(o, sp)) {
+			Lck_Unlock(&bo->mtx);
+			return (0);
+		}
+		bo->stream_nfollow++;
+		AZ(sp->wrk->stream_bo);
+		sp->wrk->stream_bo = bo;
+		retval = 1;
+	}
+	Lck_Unlock(&bo->mtx);
+	return (retval);
+}
+
+/*---------------------------------------------------------------------
+ * Find the least expired object we still have, even if req.grace says
+ * it is too old, for when the waiting list is full, or for a conditional
+ * fetch.
+ */
+
+static struct objcore *
+hsh_stale(struct sess *sp, const struct objhead *oh)
+{
+	struct objcore *oc, *stale_oc = NULL;
+	struct object *o;
+	double stale_ttl = 0.;
+
+	Lck_AssertHeld(&oh->mtx);
+	VTAILQ_FOREACH(oc, &oh->objcs, list) {
+		CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+		if (oc->flags & (OC_F_BUSY | OC_F_PASS))
+			continue;
+		o = oc_getobj(sp->wrk, oc);
+		CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+		if (o->exp.ttl <= 0.)
+			continue;
+		if (BAN_CheckObject(o, sp))
+			continue;
+		if (o->vary != NULL && !VRY_Match(sp, o->vary))
+			continue;
+		if (stale_oc == NULL ||
+		    stale_ttl < o->exp.entered + o->exp.ttl) {
+			stale_oc = oc;
+			stale_ttl = o->exp.entered + o->exp.ttl;
+		}
+	}
+	return (stale_oc);
+}
+
+/*---------------------------------------------------------------------
+ * Take a ref on the object we found and let go of the objhead.
+ */
+
+static struct objcore *
+hsh_found(struct sess *sp, struct objhead *oh, struct objcore *oc,
+    struct objhead **poh)
+{
+	struct object *o;
+
+	o = oc_getobj(sp->wrk, oc);
+	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+	assert(oc->objhead == oh);
+
+	oc->refcnt++;
+	if (o->hits < INT_MAX)
+		o->hits++;
+	assert(oh->refcnt > 1);
+	Lck_Unlock(&oh->mtx);
+	assert(hash->deref(oh));
+	*poh = oh;
+	return (oc);
+}
+
+/*---------------------------------------------------------------------
+ * Returns the objcore to use, with *poh set to its objhead.
+ *
+ * Returns NULL if the session was parked on the waiting list of *poh,
+ * in which case it no longer belongs to us, or with *poh == NULL if the
+ * waiting list was full and the session should get an error.
  */
 
 struct objcore *
@@ -307,7 +745,7 @@ HSH_Lookup(struct sess *sp, struct objhead **poh)
 	struct worker *w;
 	struct objhead *oh;
 	struct objcore *oc;
-	struct objcore *busy_oc, *grace_oc;
+	struct objcore *busy_oc, *grace_oc, *bg_oc;
 	struct object *o;
 	double grace_ttl;
 
@@ -318,6 +756,18 @@ HSH_Lookup(struct sess *sp, struct objhead **poh)
 	AN(hash);
 	w = sp->wrk;
 
+	if (sp->hash_objcore != NULL) {
+		/*
+		 * HSH_Unbusy() served this sess from the waiting list,
+		 * it brings a ref on the object but none on the objhead.
+		 */
+		oc = sp->hash_objcore;
+		sp->hash_objcore = NULL;
+		CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+		*poh = oc->objhead;
+		return (oc);
+	}
+
 	HSH_Prealloc(sp);
 	memcpy(sp->wrk->nobjhead->digest, sp->digest, sizeof sp->digest);
 	if (params->diag_bitmap & 0x80000000)
@@ -344,50 +794,13 @@ HSH_Lookup(struct sess *sp, struct objhead **poh)
 	busy_oc = NULL;
 	grace_oc = NULL;
 	grace_ttl = NAN;
-	VTAILQ_FOREACH(oc, &oh->objcs, list) {
-		/* Must be at least our own ref + the objcore we examine */
-		assert(oh->refcnt > 1);
-		CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
-		assert(oc->objhead == oh);
-
-		if (oc->flags & OC_F_BUSY) {
-			CHECK_OBJ_NOTNULL(oc->busyobj, BUSYOBJ_MAGIC);
-			if (sp->hash_ignore_busy || sp->hash_always_miss)
-				continue;
-
-			if (oc->busyobj->vary != NULL &&
-			    !VRY_Match(sp, oc->busyobj->vary))
-				continue;
-
-			busy_oc = oc;
-			continue;
-		}
-
-		o = oc_getobj(sp->wrk, oc);
-		CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
-
-		if (o->exp.ttl <= 0.)
-			continue;
-		if (BAN_CheckObject(o, sp))
-			continue;
-		if (o->vary != NULL && !VRY_Match(sp, o->vary))
-			continue;
-
-		/* If still valid, use it */
-		if (EXP_Ttl(sp, o) >= sp->t_req)
-			break;
-
-		/*
-		 * Remember any matching objects inside their grace period
-		 * and if there are several, use the least expired one.
-		 */
-		if (EXP_Grace(sp, o) >= sp->t_req) {
-			if (grace_oc == NULL ||
-			    grace_ttl < o->exp.entered + o->exp.ttl) {
-				grace_oc = oc;
-				grace_ttl = o->exp.entered + o->exp.ttl;
-			}
-		}
+	if (oh->vryidx != NULL) {
+		oc = hsh_vrylookup(sp, oh, &busy_oc, &grace_oc, &grace_ttl);
+	} else {
+		VTAILQ_FOREACH(oc, &oh->objcs, list)
+			if (hsh_check(sp, oh, oc,
+			    &busy_oc, &grace_oc, &grace_ttl))
+				break;
 	}
 
 	/*
@@ -402,6 +815,7 @@ HSH_Lookup(struct sess *sp, struct objhead **poh)
 
 	AZ(sp->objcore);
 	sp->objcore = grace_oc;		/* XXX: Hack-ish */
+	bg_oc = NULL;
 	if (oc == NULL			/* We found no live object */
 	    && grace_oc != NULL		/* There is a grace candidate */
 	    && (busy_oc != NULL		/* Somebody else is already busy */
@@ -410,23 +824,64 @@ HSH_Lookup(struct sess *sp, struct objhead **poh)
 		o = oc_getobj(sp->wrk, grace_oc);
 		CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
 		oc = grace_oc;
+	} else if (oc == NULL && grace_oc != NULL && !sp->hash_always_miss &&
+	    sp->esi_level == 0 && params->wthread_bgfetch > 0) {
+		/*
+		 * Serve the grace object, and have a background fetch
+		 * refresh it, holding a ref on it for the conditional
+		 * request.  The busy objcore can not know the Vary: of
+		 * the fetch, so it holds up all variants, as above.
+		 */
+		oc = grace_oc;
+		oc->refcnt++;
+		bg_oc = w->nobjcore;
+		w->nobjcore = NULL;
+		AN(bg_oc->flags & OC_F_BUSY);
+		bg_oc->refcnt = 1;
+		w->nbusyobj->vary = NULL;
+		bg_oc->busyobj = w->nbusyobj;
+		w->nbusyobj = NULL;
+		VTAILQ_INSERT_TAIL(&oh->objcs, bg_oc, list);
+		bg_oc->objhead = oh;
+		oh->refcnt++;
 	}
 	sp->objcore = NULL;
 
 	if (oc != NULL && !sp->hash_always_miss) {
-		o = oc_getobj(sp->wrk, oc);
-		CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
-		assert(oc->objhead == oh);
-
 		/* We found an object we like */
-		oc->refcnt++;
-		if (o->hits < INT_MAX)
-			o->hits++;
+		oc = hsh_found(sp, oh, oc, poh);
+		if (bg_oc != NULL)
+			CNT_Refresh(sp, bg_oc, oc);
+		return (oc);
+	}
+
+	if (busy_oc != NULL && hsh_follow(sp, oh, busy_oc)) {
+		/* Stream along with the fetch, and let others do so too */
+		busy_oc->refcnt++;
+		if (oh->waitinglist != NULL)
+			hsh_rush(oh);
 		assert(oh->refcnt > 1);
 		Lck_Unlock(&oh->mtx);
 		assert(hash->deref(oh));
 		*poh = oh;
-		return (oc);
+		return (busy_oc);
+	}
+
+	if (busy_oc != NULL && sp->esi_level == 0 && !sp->hash_always_miss &&
+	    params->waitinglist_max > 0 && oh->waitinglist != NULL &&
+	    oh->waitinglist->nwait >= params->waitinglist_max) {
+		/* Enough are waiting already, make do with what we have */
+		w->stats.cache_busyfull++;
+		oc = NULL;
+		if (params->waitinglist_grace)
+			oc = hsh_stale(sp, oh);
+		if (oc != NULL)
+			return (hsh_found(sp, oh, oc, poh));
+		assert(oh->refcnt > 1);
+		Lck_Unlock(&oh->mtx);
+		assert(hash->deref(oh));
+		*poh = NULL;
+		return (NULL);
 	}
 
 	if (busy_oc != NULL) {
@@ -439,6 +894,7 @@ HSH_Lookup(struct sess *sp, struct objhead **poh)
 				sp->wrk->nwaitinglist = NULL;
 			}
 			VTAILQ_INSERT_TAIL(&oh->waitinglist->list, sp, list);
+			oh->waitinglist->nwait++;
 		}
 		if (params->diag_bitmap & 0x20)
 			WSP(sp, SLT_Debug,
@@ -452,9 +908,26 @@ HSH_Lookup(struct sess *sp, struct objhead **poh)
 		sp->hash_objhead = oh;
 		sp->wrk = NULL;
 		Lck_Unlock(&oh->mtx);
+		*poh = oh;
 		return (NULL);
 	}
 
+	/* An expired copy the fetch can ask the backend to revalidate */
+	AZ(sp->stale_obj);
+	oc = NULL;
+	if (params->fetch_conditional)
+		oc = hsh_stale(sp, oh);
+	if (oc != NULL) {
+		o = oc_getobj(sp->wrk, oc);
+		CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+		if (o->response == 200 &&
+		    (http_GetHdr(o->http, H_ETag, NULL) ||
+		    http_GetHdr(o->http, H_Last_Modified, NULL))) {
+			oc->refcnt++;
+			sp->stale_obj = o;
+		}
+	}
+
 	/* Insert (precreated) objcore in objecthead */
 	oc = w->nobjcore;
 	w->nobjcore = NULL;
@@ -503,6 +976,8 @@ hsh_rush(struct objhead *oh)
 		CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
 		AZ(sp->wrk);
 		VTAILQ_REMOVE(&wl->list, sp, list);
+		assert(wl->nwait > 0);
+		wl->nwait--;
 		DSL(0x20, SLT_Debug, sp->id, "off waiting list");
 		if (WRK_QueueSession(sp)) {
 			/*
@@ -519,6 +994,55 @@ hsh_rush(struct objhead *oh)
 	}
 }
 
+/*---------------------------------------------------------------------
+ * Give a newly unbusied object to the sessions waiting for it which
+ * would find it if they looked again, moving them to the bulk list.
+ * Those which would not, because of Vary:, req.ttl, bans or
+ * req.hash_always_miss, are left for hsh_rush().
+ */
+
+static void
+hsh_bulk(struct objhead *oh, struct objcore *oc, struct object *o,
+    struct waitinglist *bulk)
+{
+	struct sess *sp, *sp2;
+	struct waitinglist *wl;
+
+	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
+	Lck_AssertHeld(&oh->mtx);
+	wl = oh->waitinglist;
+	CHECK_OBJ_NOTNULL(wl, WAITINGLIST_MAGIC);
+	VTAILQ_FOREACH_SAFE(sp, &wl->list, list, sp2) {
+		CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+		AZ(sp->wrk);
+		assert(sp->hash_objhead == oh);
+		if (o->exp.ttl <= 0.)
+			break;
+		/* It wants a fetch of its own, not our object */
+		if (sp->hash_always_miss)
+			continue;
+		if (o->vary != NULL && !VRY_Match(sp, o->vary))
+			continue;
+		/* Leave it to the lookup, which has a worker to ban it */
+		if (BAN_Match(o, sp))
+			break;
+		if (EXP_Ttl(sp, o) < sp->t_req)
+			continue;
+		VTAILQ_REMOVE(&wl->list, sp, list);
+		wl->nwait--;
+		VTAILQ_INSERT_TAIL(&bulk->list, sp, list);
+		bulk->nwait++;
+		oc->refcnt++;
+		if (o->hits < INT_MAX)
+			o->hits++;
+		sp->hash_objcore = oc;
+	}
+	if (VTAILQ_EMPTY(&wl->list)) {
+		oh->waitinglist = NULL;
+		FREE_OBJ(wl);
+	}
+}
+
 /*---------------------------------------------------------------------
  * Purge an entire objhead
  */
@@ -606,6 +1130,10 @@ HSH_Unbusy(const struct sess *sp)
 	struct object *o;
 	struct objhead *oh;
 	struct objcore *oc;
+	struct busyobj *bo;
+	struct waitinglist bulk;
+	struct sess *sp2;
+	unsigned r;
 
 	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
 	o = sp->obj;
@@ -625,6 +1153,9 @@ HSH_Unbusy(const struct sess *sp)
 		WSP(sp, SLT_Debug,
 		    "Object %u workspace free %u", o->xid, WS_Free(o->ws_o));
 
+	if (o->vary != NULL)
+		oc->vary_key = VRY_Key(o->vary);
+
 	/* XXX: pretouch neighbors on oh->objcs to prevent page-on under mtx */
 	Lck_Lock(&oh->mtx);
 	assert(oh->refcnt > 0);
@@ -632,14 +1163,180 @@ HSH_Unbusy(const struct sess *sp)
 	VTAILQ_REMOVE(&oh->objcs, oc, list);
 	VTAILQ_INSERT_HEAD(&oh->objcs, oc, list);
 	oc->flags &= ~OC_F_BUSY;
-	AZ(sp->wrk->nbusyobj);
-	sp->wrk->nbusyobj = oc->busyobj;
+	hsh_vryinsert(oh, oc, o);
+	bo = oc->busyobj;
 	oc->busyobj = NULL;
+	memset(&bulk, 0, sizeof bulk);
+	bulk.magic = WAITINGLIST_MAGIC;
+	VTAILQ_INIT(&bulk.list);
+	if (oh->waitinglist != NULL && params->waitinglist_bulk)
+		hsh_bulk(oh, oc, o, &bulk);
 	if (oh->waitinglist != NULL)
 		hsh_rush(oh);
 	AN(oc->ban);
 	Lck_Unlock(&oh->mtx);
 	assert(oc_getobj(sp->wrk, oc) == o);
+
+	/*
+	 * The served sessions hold a ref on the object now, which keeps
+	 * the objhead around, so we can drop their objhead refs for them.
+	 */
+	sp->wrk->stats.cache_hitbulk += bulk.nwait;
+	while ((sp2 = VTAILQ_FIRST(&bulk.list)) != NULL) {
+		VTAILQ_REMOVE(&bulk.list, sp2, list);
+		sp2->hash_objhead = NULL;
+		assert(hash->deref(oh));
+		DSL(0x20, SLT_Debug, sp2->id, "off waiting list, served");
+		if (WRK_QueueSession(sp2)) {
+			VSC_C_main->client_drop_late++;
+			(void)HSH_Deref(sp->wrk, oc, NULL);
+		}
+	}
+
+	/* Stream followers now own the busyobj, the last one frees it */
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	Lck_Lock(&bo->mtx);
+	bo->stream_len = o->len;
+	bo->stream_state = BOS_DONE;
+	if (bo->stream_nwait > 0)
+		AZ(pthread_cond_broadcast(&bo->cond));
+	r = bo->stream_nfollow;
+	Lck_Unlock(&bo->mtx);
+	if (r == 0)
+		hsh_freebusyobj(sp->wrk, bo);
+}
+
+/*---------------------------------------------------------------------
+ * Streaming followers.
+ *
+ * Once the fetcher starts streaming a cacheable object, lookups for it
+ * attach to the busyobj instead of going on the waiting list.  The
+ * fetcher publishes how many bytes are in storage and the followers
+ * deliver them from the object as they arrive.
+ *
+ * Storage segments are only ever appended while streaming, and the
+ * followers never look past the published length, so they can walk the
+ * list without locking.  The tail segment must not be trimmed or freed
+ * while anybody follows, HSH_StreamFreeze() tells the fetcher if it can.
+ */
+
+static struct busyobj *
+hsh_streambo(const struct object *o)
+{
+	struct objcore *oc;
+
+	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+	oc = o->objcore;
+	if (oc == NULL || !(oc->flags & OC_F_BUSY))
+		return (NULL);
+	CHECK_OBJ_NOTNULL(oc->busyobj, BUSYOBJ_MAGIC);
+	return (oc->busyobj);
+}
+
+void
+HSH_StreamStart(const struct sess *sp, ssize_t clen)
+{
+	struct objcore *oc;
+	struct objhead *oh;
+	struct busyobj *bo;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(sp->obj, OBJECT_MAGIC);
+	oc = sp->obj->objcore;
+	if (!params->stream_follow || oc == NULL || (oc->flags & OC_F_PASS))
+		return;
+	bo = hsh_streambo(sp->obj);
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	oh = oc->objhead;
+	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
+
+	Lck_Lock(&oh->mtx);
+	Lck_Lock(&bo->mtx);
+	AZ(bo->stream_state);
+	bo->stream_obj = sp->obj;
+	bo->stream_len = sp->obj->len;
+	bo->stream_clen = clen;
+	bo->stream_state = BOS_STREAM;
+	Lck_Unlock(&bo->mtx);
+	/* Anybody waiting for this object can follow it now */
+	if (oh->waitinglist != NULL)
+		hsh_rush(oh);
+	Lck_Unlock(&oh->mtx);
+}
+
+void
+HSH_StreamPoll(const struct object *o)
+{
+	struct busyobj *bo;
+
+	bo = hsh_streambo(o);
+	/* Only the fetcher changes the state, so peeking is safe */
+	if (bo == NULL || bo->stream_state != BOS_STREAM)
+		return;
+	Lck_Lock(&bo->mtx);
+	bo->stream_len = o->len;
+	if (bo->stream_nwait > 0)
+		AZ(pthread_cond_broadcast(&bo->cond));
+	Lck_Unlock(&bo->mtx);
+}
+
+/*
+ * The body is complete, stop accepting followers.  Returns the number
+ * of followers which may still be reading the storage.
+ */
+
+unsigned
+HSH_StreamFreeze(const struct object *o)
+{
+	struct busyobj *bo;
+	unsigned r;
+
+	bo = hsh_streambo(o);
+	if (bo == NULL || bo->stream_state == BOS_NONE)
+		return (0);
+	Lck_Lock(&bo->mtx);
+	if (bo->stream_state == BOS_STREAM) {
+		bo->stream_len = o->len;
+		bo->stream_state = BOS_FROZEN;
+	}
+	r = bo->stream_nfollow;
+	Lck_Unlock(&bo->mtx);
+	return (r);
+}
+
+void
+HSH_StreamFail(const struct object *o)
+{
+	struct busyobj *bo;
+
+	bo = hsh_streambo(o);
+	if (bo == NULL || bo->stream_state == BOS_NONE)
+		return;
+	Lck_Lock(&bo->mtx);
+	bo->stream_state = BOS_FAILED;
+	if (bo->stream_nwait > 0)
+		AZ(pthread_cond_broadcast(&bo->cond));
+	Lck_Unlock(&bo->mtx);
+}
+
+void
+HSH_StreamRelease(struct worker *w)
+{
+	struct busyobj *bo;
+	unsigned r, done;
+
+	CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+	bo = w->stream_bo;
+	w->stream_bo = NULL;
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	Lck_Lock(&bo->mtx);
+	assert(bo->stream_nfollow > 0);
+	r = --bo->stream_nfollow;
+	done = (bo->stream_state == BOS_DONE);
+	Lck_Unlock(&bo->mtx);
+	/* Until unbusied the busyobj belongs to the objcore */
+	if (r == 0 && done)
+		hsh_freebusyobj(w, bo);
 }
 
 void
@@ -707,9 +1404,10 @@ HSH_Deref(struct worker *w, struct objcore *oc, struct object **oo)
 	assert(oh->refcnt > 0);
 	assert(oc->refcnt > 0);
 	r = --oc->refcnt;
-	if (!r)
+	if (!r) {
 		VTAILQ_REMOVE(&oh->objcs, oc, list);
-	else {
+		hsh_vryremove(oh, oc);
+	} else {
 		/* Must have an object */
 		AN(oc->methods);
 	}
@@ -723,15 +1421,12 @@ HSH_Deref(struct worker *w, struct objcore *oc, struct object **oo)
 	AZ(oc->ban);
 
 	if (oc->flags & OC_F_BUSY) {
-		CHECK_OBJ_NOTNULL(oc->busyobj, BUSYOBJ_MAGIC);
-		if (w->nbusyobj == NULL)
-			w->nbusyobj = oc->busyobj;
-		else
-			FREE_OBJ(oc->busyobj);
+		hsh_freebusyobj(w, oc->busyobj);
 		oc->busyobj = NULL;
 	}
 	AZ(oc->busyobj);
 
+	RES_GunzipFree(oc);
 	if (oc->methods != NULL) {
 		oc_freeobj(oc);
 		w->stats.n_object--;
@@ -130,6 +130,55 @@ HTTP_create(void *p, uint16_t nhttp)
 	return (hp);
 }
 
+/*--------------------------------------------------------------------
+ * Header name index.
+ *
+ * The name of each header (up to the ':') is hashed case-insensitively.
+ * Seven bits are kept in the HDF_HASH part of hdf[], so http_findhdr()
+ * can skip most of the strncasecmp()'s, and two other groups of bits
+ * select the bits in the hdbloom filter, so we can tell that a header
+ * is absent without looking at hd[] at all.
+ *
+ * Collisions only cost a string compare, so removing headers just
+ * leaves their bloom bits set until the filter is rebuilt.
+ */
+
+static inline unsigned
+http_namehash(const char *p, unsigned l)
+{
+	unsigned h = 2166136261U;
+
+	/* NB: |0x20 folds case on letters, and doesn't matter on tokens */
+	while (l-- > 0) {
+		h ^= (unsigned char)*p++ | 0x20;
+		h *= 16777619U;
+	}
+	h ^= h >> 15;
+	h *= 0x2c1b3c6dU;
+	h ^= h >> 12;
+	return (h);
+}
+
+#define HDH_TAG(h)	((unsigned char)((h) << 1) & HDF_HASH)
+#define HDH_BLOOM(h)	((1ULL << (((h) >> 8) & 63)) | \
+			    (1ULL << (((h) >> 16) & 63)))
+
+static void
+http_hashhdr(struct http *hp, unsigned n)
+{
+	const char *q;
+	unsigned h;
+
+	assert(n >= HTTP_HDR_FIRST && n < hp->shd);
+	Tcheck(hp->hd[n]);
+	q = memchr(hp->hd[n].b, ':', Tlen(hp->hd[n]));
+	if (q == NULL)
+		q = hp->hd[n].e;
+	h = http_namehash(hp->hd[n].b, pdiff(hp->hd[n].b, q));
+	hp->hdf[n] = (hp->hdf[n] & ~HDF_HASH) | HDH_TAG(h);
+	hp->hdbloom |= HDH_BLOOM(h);
+}
+
 /*--------------------------------------------------------------------*/
 
 void
@@ -216,8 +265,10 @@ http_CollectHdr(struct http *hp, const char *hdr)
 				b = e;
 
 			/* Shift remaining headers up one slot */
-			for (v = u; v < hp->nhd - 1; v++)
+			for (v = u; v < hp->nhd - 1; v++) {
 				hp->hd[v] = hp->hd[v + 1];
+				hp->hdf[v] = hp->hdf[v + 1];
+			}
 			hp->nhd--;
 		}
 
@@ -241,9 +292,16 @@ http_CollectHdr(struct http *hp, const char *hdr)
 static unsigned
 http_findhdr(const struct http *hp, unsigned l, const char *hdr)
 {
-	unsigned u;
+	unsigned u, h;
+	unsigned char t;
 
+	h = http_namehash(hdr, l);
+	if ((hp->hdbloom & HDH_BLOOM(h)) != HDH_BLOOM(h))
+		return (0);
+	t = HDH_TAG(h);
 	for (u = HTTP_HDR_FIRST; u < hp->nhd; u++) {
+		if ((hp->hdf[u] & HDF_HASH) != t)
+			continue;
 		Tcheck(hp->hd[u]);
 		if (hp->hd[u].e < hp->hd[u].b + l + 1)
 			continue;
@@ -495,6 +553,7 @@ http_dissect_hdrs(struct worker *w, struct http *hp, int fd, char *p,
 		p++;
 
 	hp->nhd = HTTP_HDR_FIRST;
+	hp->hdbloom = 0;
 	hp->conds = 0;
 	r = NULL;		/* For FlexeLint */
 	for (; p < t.e; p = r) {
@@ -502,6 +561,9 @@ http_dissect_hdrs(struct worker *w, struct http *hp, int fd, char *p,
 		/* Find end of next header */
 		q = r = p;
 		while (r < t.e) {
+			r = TRUST_ME(VCT_FindCRLF(r, t.e));
+			if (r >= t.e)
+				break;
 			if (!vct_iscrlf(r)) {
 				r++;
 				continue;
@@ -544,6 +606,7 @@ http_dissect_hdrs(struct worker *w, struct http *hp, int fd, char *p,
 			hp->hdf[hp->nhd] = 0;
 			hp->hd[hp->nhd].b = p;
 			hp->hd[hp->nhd].e = q;
+			http_hashhdr(hp, hp->nhd);
 			WSLH(w, fd, hp, hp->nhd);
 			hp->nhd++;
 		} else {
@@ -802,6 +865,7 @@ http_copyheader(struct worker *w, int fd, struct http *to,
 	if (to->nhd < to->shd) {
 		to->hd[to->nhd] = fm->hd[n];
 		to->hdf[to->nhd] = 0;
+		http_hashhdr(to, to->nhd);
 		to->nhd++;
 	} else  {
 		VSC_C_main->losthdr++;
@@ -809,6 +873,24 @@ http_copyheader(struct worker *w, int fd, struct http *to,
 	}
 }
 
+/*--------------------------------------------------------------------
+ * Does filtering according to 'how' remove this header ?
+ */
+
+static int
+http_isfiltered(const struct http *fm, unsigned u, unsigned how)
+{
+
+	if (fm->hdf[u] & HDF_FILTER)
+		return (1);
+#define HTTPH(a, b, c, d, e, f, g) \
+	if (((e) & how) && http_IsHdr(&fm->hd[u], (b))) \
+		return (1);
+#include "http_headers.h"
+#undef HTTPH
+	return (0);
+}
+
 /*--------------------------------------------------------------------
  * Estimate how much workspace we need to Filter this header according
  * to 'how'.
@@ -825,13 +907,8 @@ http_EstimateWS(const struct http *fm, unsigned how, uint16_t *nhd)
 	for (u = 0; u < fm->nhd; u++) {
 		if (fm->hd[u].b == NULL)
 			continue;
-		if (fm->hdf[u] & HDF_FILTER)
-			continue;
-#define HTTPH(a, b, c, d, e, f, g) \
-		if (((e) & how) && http_IsHdr(&fm->hd[u], (b))) \
+		if (http_isfiltered(fm, u, how))
 			continue;
-#include "http_headers.h"
-#undef HTTPH
 		l += PRNDUP(Tlen(fm->hd[u]) + 1);
 		(*nhd)++;
 		// fm->hdf[u] |= HDF_COPY;
@@ -850,21 +927,100 @@ http_FilterFields(struct worker *w, int fd, struct http *to,
 	CHECK_OBJ_NOTNULL(fm, HTTP_MAGIC);
 	CHECK_OBJ_NOTNULL(to, HTTP_MAGIC);
 	to->nhd = HTTP_HDR_FIRST;
+	to->hdbloom = 0;
 	to->status = fm->status;
 	for (u = HTTP_HDR_FIRST; u < fm->nhd; u++) {
 		if (fm->hd[u].b == NULL)
 			continue;
-		if (fm->hdf[u] & HDF_FILTER)
-			continue;
-#define HTTPH(a, b, c, d, e, f, g) \
-		if (((e) & how) && http_IsHdr(&fm->hd[u], (b))) \
+		if (http_isfiltered(fm, u, how))
 			continue;
-#include "http_headers.h"
-#undef HTTPH
 		http_copyheader(w, fd, to, fm, u);
 	}
 }
 
+/*--------------------------------------------------------------------
+ * Add the headers of fm which to does not have, the way the headers of
+ * a 304 response update those of the object it revalidates.  The strings
+ * are not copied, fm must stay around until to has been filtered.
+ */
+
+void
+http_MergeHdr(struct worker *w, int fd, struct http *to,
+    const struct http *fm)
+{
+	unsigned u, l, n;
+	unsigned char have[fm->nhd];
+	const char *p;
+
+	CHECK_OBJ_NOTNULL(fm, HTTP_MAGIC);
+	CHECK_OBJ_NOTNULL(to, HTTP_MAGIC);
+	/* Decide before we add any, fm may have several of a kind */
+	n = 0;
+	for (u = HTTP_HDR_FIRST; u < fm->nhd; u++) {
+		have[u] = 1;
+		if (fm->hd[u].b == NULL)
+			continue;
+		p = strchr(fm->hd[u].b, ':');
+		if (p == NULL)
+			continue;
+		l = p - fm->hd[u].b;
+		have[u] = http_findhdr(to, l, fm->hd[u].b) != 0;
+		n += !have[u];
+	}
+	if (n == 0)
+		return;
+	for (u = HTTP_HDR_FIRST; u < fm->nhd; u++)
+		if (!have[u])
+			http_SetHeader(w, fd, to, fm->hd[u].b);
+}
+
+/*--------------------------------------------------------------------
+ * Serialize the headers http_FilterFields() would copy into a single
+ * "Name: value\r\n..." block on the workspace, so they can later be
+ * written with one iovec.  Returns the number of headers in the block,
+ * and which header was the last, or zero if there was nothing to do
+ * or no space for it.
+ */
+
+unsigned
+http_FilterBlock(struct ws *ws, const struct http *fm, unsigned how,
+    txt *blk, const char **last)
+{
+	unsigned u, l, n;
+	char *p, *q;
+
+	CHECK_OBJ_NOTNULL(fm, HTTP_MAGIC);
+	AN(blk);
+	AN(last);
+	l = WS_Reserve(ws, 0);
+	p = q = ws->f;
+	n = 0;
+	for (u = HTTP_HDR_FIRST; u < fm->nhd; u++) {
+		if (fm->hd[u].b == NULL)
+			continue;
+		if (http_isfiltered(fm, u, how))
+			continue;
+		if (Tlen(fm->hd[u]) + 2 > l - (q - p)) {
+			WS_Release(ws, 0);
+			return (0);
+		}
+		memcpy(q, fm->hd[u].b, Tlen(fm->hd[u]));
+		q += Tlen(fm->hd[u]);
+		*q++ = '\r';
+		*q++ = '\n';
+		*last = fm->hd[u].b;
+		n++;
+	}
+	if (n == 0) {
+		WS_Release(ws, 0);
+		return (0);
+	}
+	WS_Release(ws, q - p);
+	blk->b = p;
+	blk->e = q;
+	return (n);
+}
+
 /*--------------------------------------------------------------------*/
 
 void
@@ -929,6 +1085,7 @@ http_ClrHeader(struct http *to)
 
 	CHECK_OBJ_NOTNULL(to, HTTP_MAGIC);
 	to->nhd = HTTP_HDR_FIRST;
+	to->hdbloom = 0;
 	to->status = 0;
 	to->protover = 0;
 	to->conds = 0;
@@ -947,7 +1104,8 @@ http_SetHeader(struct worker *w, int fd, struct http *to, const char *hdr)
 		WSL(w, SLT_LostHeader, fd, "%s", hdr);
 		return;
 	}
-	http_SetH(to, to->nhd++, hdr);
+	http_SetH(to, to->nhd, hdr);
+	http_hashhdr(to, to->nhd++);
 }
 
 /*--------------------------------------------------------------------*/
@@ -1025,6 +1183,7 @@ http_PrintfHeader(struct worker *w, int fd, struct http *to,
 		to->hd[to->nhd].b = to->ws->f;
 		to->hd[to->nhd].e = to->ws->f + n;
 		to->hdf[to->nhd] = 0;
+		http_hashhdr(to, to->nhd);
 		WS_Release(to->ws, n + 1);
 		to->nhd++;
 	}
@@ -1036,6 +1195,8 @@ http_Unset(struct http *hp, const char *hdr)
 {
 	uint16_t u, v;
 
+	/* Rebuild the bloom filter from what is left while we are at it */
+	hp->hdbloom = 0;
 	for (v = u = HTTP_HDR_FIRST; u < hp->nhd; u++) {
 		if (hp->hd[u].b == NULL)
 			continue;
@@ -1045,6 +1206,7 @@ http_Unset(struct http *hp, const char *hdr)
 			memcpy(&hp->hd[v], &hp->hd[u], sizeof *hp->hd);
 			memcpy(&hp->hdf[v], &hp->hdf[u], sizeof *hp->hdf);
 		}
+		http_hashhdr(hp, v);
 		v++;
 	}
 	hp->nhd = v;
@@ -1061,6 +1223,7 @@ HTTP_Copy(struct http *to, const struct http * const fm)
 	to->status = fm->status;
 	to->protover = fm->protover;
 	to->nhd = fm->nhd;
+	to->hdbloom = fm->hdbloom;
 	assert(fm->nhd <= to->shd);
 	memcpy(to->hd, fm->hd, fm->nhd * sizeof *to->hd);
 	memcpy(to->hdf, fm->hdf, fm->nhd * sizeof *to->hdf);
@@ -1068,8 +1231,9 @@ HTTP_Copy(struct http *to, const struct http * const fm)
 
 /*--------------------------------------------------------------------*/
 
-unsigned
-http_Write(struct worker *w, const struct http *hp, int resp)
+static unsigned
+http_write(struct worker *w, const struct http *hp, int resp,
+    const txt *blk, unsigned nblk)
 {
 	unsigned u, l;
 	int fd = *(w->wrw.wfd);
@@ -1098,7 +1262,14 @@ http_Write(struct worker *w, const struct http *hp, int resp)
 		l += WRW_WriteH(w, &hp->hd[HTTP_HDR_PROTO], "\r\n");
 		WSLH(w, fd, hp, HTTP_HDR_PROTO);
 	}
-	for (u = HTTP_HDR_FIRST; u < hp->nhd; u++) {
+	u = HTTP_HDR_FIRST;
+	if (blk != NULL) {
+		assert(hp->nhd >= u + nblk);
+		l += WRW_Write(w, blk->b, Tlen(*blk));
+		for (; nblk > 0; nblk--, u++)
+			WSLH(w, fd, hp, u);
+	}
+	for (; u < hp->nhd; u++) {
 		if (hp->hd[u].b == NULL)
 			continue;
 		AN(hp->hd[u].b);
@@ -1110,6 +1281,27 @@ http_Write(struct worker *w, const struct http *hp, int resp)
 	return (l);
 }
 
+unsigned
+http_Write(struct worker *w, const struct http *hp, int resp)
+{
+
+	return (http_write(w, hp, resp, NULL, 0));
+}
+
+/*--------------------------------------------------------------------
+ * Write a response where the first nblk headers are already serialized
+ * in blk, see http_FilterBlock().
+ */
+
+unsigned
+http_WriteBlock(struct worker *w, const struct http *hp, const txt *blk,
+    unsigned nblk)
+{
+
+	AN(blk);
+	return (http_write(w, hp, 1, blk, nblk));
+}
+
 /*--------------------------------------------------------------------*/
 
 void
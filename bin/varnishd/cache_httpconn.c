@@ -59,8 +59,9 @@
  */
 
 static int
-htc_header_complete(txt *t)
+htc_header_complete(struct http_conn *htc)
 {
+	txt *t = &htc->rxbuf;
 	const char *p;
 
 	Tcheck(*t);
@@ -72,12 +73,22 @@ htc_header_complete(txt *t)
 		/* All white space */
 		t->e = t->b;
 		*t->e = '\0';
+		htc->rxscan = t->b;
 		return (0);
 	}
+	/*
+	 * Don't rescan what we looked at on previous calls.  The last
+	 * two bytes may be the start of a terminator, so look at those
+	 * again.
+	 */
+	if (htc->rxscan > p)
+		p = htc->rxscan;
 	while (1) {
-		p = strchr(p, '\n');
-		if (p == NULL)
+		p = memchr(p, '\n', t->e - p);
+		if (p == NULL) {
+			htc->rxscan = t->e - 2 > t->b ? t->e - 2 : t->b;
 			return (0);
+		}
 		p++;
 		if (*p == '\r')
 			p++;
@@ -104,9 +115,11 @@ HTC_Init(struct http_conn *htc, struct ws *ws, int fd, unsigned maxbytes,
 	(void)WS_Reserve(htc->ws, htc->maxbytes);
 	htc->rxbuf.b = ws->f;
 	htc->rxbuf.e = ws->f;
+	htc->rxscan = ws->f;
 	*htc->rxbuf.e = '\0';
 	htc->pipeline.b = NULL;
 	htc->pipeline.e = NULL;
+	htc->reads = 0;
 }
 
 /*--------------------------------------------------------------------
@@ -124,6 +137,7 @@ HTC_Reinit(struct http_conn *htc)
 	(void)WS_Reserve(htc->ws, htc->maxbytes);
 	htc->rxbuf.b = htc->ws->f;
 	htc->rxbuf.e = htc->ws->f;
+	htc->rxscan = htc->ws->f;
 	if (htc->pipeline.b != NULL) {
 		l = Tlen(htc->pipeline);
 		memmove(htc->rxbuf.b, htc->pipeline.b, l);
@@ -145,7 +159,7 @@ HTC_Complete(struct http_conn *htc)
 	int i;
 
 	CHECK_OBJ_NOTNULL(htc, HTTP_CONN_MAGIC);
-	i = htc_header_complete(&htc->rxbuf);
+	i = htc_header_complete(htc);
 	assert(i >= 0);
 	if (i == 0)
 		return (0);
@@ -223,6 +237,7 @@ HTC_Read(struct worker *w, struct http_conn *htc, void *d, size_t len)
 	}
 	if (len == 0)
 		return (l);
+	htc->reads++;
 	i = read(htc->fd, p, len);
 	if (i < 0) {
 		WSL(w, SLT_FetchError, htc->fd, "%s", strerror(errno));
@@ -35,6 +35,8 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <math.h>
 #include <stdio.h>
 
 #include <stdlib.h>
@@ -154,6 +156,29 @@ Lck_CondWait(pthread_cond_t *cond, struct lock *lck)
 	ilck->owner = pthread_self();
 }
 
+/* As Lck_CondWait(), but give up at 'when' (TIM_real()) with ETIMEDOUT */
+
+int __match_proto__()
+Lck_CondWaitUntil(pthread_cond_t *cond, struct lock *lck, double when)
+{
+	struct ilck *ilck;
+	struct timespec ts;
+	int i;
+
+	CAST_OBJ_NOTNULL(ilck, lck->priv, ILCK_MAGIC);
+	AN(ilck->held);
+	assert(pthread_equal(ilck->owner, pthread_self()));
+	ts.tv_sec = (time_t)floor(when);
+	ts.tv_nsec = (long)((when - ts.tv_sec) * 1e9);
+	ilck->held = 0;
+	i = pthread_cond_timedwait(cond, &ilck->mtx, &ts);
+	assert(i == 0 || i == ETIMEDOUT);
+	AZ(ilck->held);
+	ilck->held = 1;
+	ilck->owner = pthread_self();
+	return (i);
+}
+
 void
 Lck__New(struct lock *lck, struct VSC_C_lck *st, const char *w)
 {
@@ -106,6 +106,7 @@ child_main(void)
 	PAN_Init();
 	CLI_Init();
 	Fetch_Init();
+	VGZ_Init();
 
 	CNT_Init();
 	VCL_Init();
@@ -122,6 +123,7 @@ child_main(void)
 	BAN_Init();
 
 	VCA_Init();
+	PIPE_Init();
 
 	SMS_Init();
 	SMP_Init();
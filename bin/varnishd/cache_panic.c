@@ -246,6 +246,7 @@ pan_sess(const struct sess *sp)
 	if (sp->wrk->do_stream)	VSB_printf(vsp, " do_stream");
 	if (sp->wrk->do_gzip)	VSB_printf(vsp, " do_gzip");
 	if (sp->wrk->do_gunzip)	VSB_printf(vsp, " do_gunzip");
+	if (sp->wrk->do_zstd)	VSB_printf(vsp, " do_zstd");
 	if (sp->wrk->do_esi)	VSB_printf(vsp, " do_esi");
 	if (sp->wrk->do_close)	VSB_printf(vsp, " do_close");
 	if (sp->wrk->is_gzip)	VSB_printf(vsp, " is_gzip");
@@ -31,6 +31,8 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -39,6 +41,322 @@
 #include <sys/socket.h>
 
 #include "cache.h"
+#include "cache_backend.h"
+
+/*--------------------------------------------------------------------
+ * Pipe relay
+ *
+ * Once the request has been passed on, a piped session is just two
+ * sockets shovelling bytes at each other, and there is no reason to
+ * park a worker thread in poll(2) for the lifetime of the connection.
+ *
+ * If the pipe_relay parameter is set, the worker hands both file
+ * descriptors to a single epoll(2) driven relay thread and goes back
+ * to the pool.  The relay moves the data with splice(2) through a
+ * kernel pipe per direction, so the payload never enters userland.
+ */
+
+#if defined(HAVE_EPOLL_CTL) && defined(HAVE_SPLICE)
+
+#include <sys/epoll.h>
+
+#ifndef EPOLLRDHUP
+#  define EPOLLRDHUP 0
+#endif
+
+#define VPR_NEEV	100
+#define VPR_CHUNK	(64 * 1024)
+
+struct vpr_dir {
+	int			src;
+	int			dst;
+	int			pfd[2];		/* Kernel pipe */
+	ssize_t			inpipe;		/* Bytes in kernel pipe */
+	uint64_t		bytes;
+	unsigned		done;
+};
+
+struct vpr {
+	unsigned		magic;
+#define VPR_MAGIC		0x5f2e1a03
+	int			id;
+	int			fd;
+	struct vbc		*vbc;
+	double			t_last;
+	struct vpr_dir		dir[2];		/* [0] = c->b, [1] = b->c */
+	VTAILQ_ENTRY(vpr)	list;
+};
+
+static VTAILQ_HEAD(, vpr) vpr_head = VTAILQ_HEAD_INITIALIZER(vpr_head);
+static VTAILQ_HEAD(, vpr) vpr_dead = VTAILQ_HEAD_INITIALIZER(vpr_dead);
+static pthread_t vpr_thread;
+static int vpr_pipes[2] = { -1, -1 };
+static int vpr_epfd = -1;
+
+/*--------------------------------------------------------------------
+ * Move as many bytes as we can in one direction without blocking.
+ * Errors are treated like EOF: we shut down this half of the relay
+ * and let the other direction finish on its own, like rdf() does.
+ */
+
+static void
+vpr_pump(struct vpr_dir *d)
+{
+	ssize_t i;
+
+	while (!d->done) {
+		if (d->inpipe > 0) {
+			i = splice(d->pfd[0], NULL, d->dst, NULL, d->inpipe,
+			    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (i < 0 && errno == EAGAIN)
+				return;
+			if (i <= 0)
+				break;
+			d->inpipe -= i;
+			d->bytes += i;
+			continue;
+		}
+		i = splice(d->src, NULL, d->pfd[1], NULL, VPR_CHUNK,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (i < 0 && errno == EAGAIN)
+			return;
+		if (i <= 0)
+			break;
+		d->inpipe += i;
+	}
+	if (d->done)
+		return;
+	(void)shutdown(d->src, SHUT_RD);
+	(void)shutdown(d->dst, SHUT_WR);
+	d->done = 1;
+}
+
+static void
+vpr_close(struct vpr *vp, const char *why)
+{
+	struct vbc *vc;
+	struct backend *bp;
+	int i, j;
+
+	CHECK_OBJ_NOTNULL(vp, VPR_MAGIC);
+	vc = vp->vbc;
+	CHECK_OBJ_NOTNULL(vc, VBC_MAGIC);
+	bp = vc->backend;
+	CHECK_OBJ_NOTNULL(bp, BACKEND_MAGIC);
+
+	VTAILQ_REMOVE(&vpr_head, vp, list);
+	VSC_C_main->n_pipe_relay--;
+	VSC_C_main->s_pipe_relay_bytes +=
+	    vp->dir[0].bytes + vp->dir[1].bytes;
+
+	VSL(SLT_PipeAcct, vp->id, "%ju %ju",
+	    (uintmax_t)vp->dir[0].bytes, (uintmax_t)vp->dir[1].bytes);
+	VSL(SLT_BackendClose, vc->fd, "%s", bp->vcl_name);
+	VTCP_close(&vc->fd);
+	VBE_DropRefConn(bp);
+	vc->backend = NULL;
+	VBE_ReleaseConn(vc);
+
+	VSL(SLT_SessionClose, vp->id, "%s", why);
+	i = close(vp->fd);
+	assert(i == 0 || errno != EBADF);
+	vp->fd = -1;
+
+	for (j = 0; j < 2; j++) {
+		AZ(close(vp->dir[j].pfd[0]));
+		AZ(close(vp->dir[j].pfd[1]));
+	}
+
+	/* Other events for this relay may be pending in this batch */
+	VTAILQ_INSERT_TAIL(&vpr_dead, vp, list);
+}
+
+static void
+vpr_event(struct vpr *vp)
+{
+	uint64_t b;
+
+	CHECK_OBJ_NOTNULL(vp, VPR_MAGIC);
+	if (vp->fd < 0)
+		return;
+	b = vp->dir[0].bytes + vp->dir[1].bytes;
+	vpr_pump(&vp->dir[0]);
+	vpr_pump(&vp->dir[1]);
+	if (vp->dir[0].done && vp->dir[1].done) {
+		vpr_close(vp, "pipe");
+		return;
+	}
+	if (b != vp->dir[0].bytes + vp->dir[1].bytes) {
+		/* Keep the list in order of last activity for timeouts */
+		vp->t_last = TIM_real();
+		VTAILQ_REMOVE(&vpr_head, vp, list);
+		VTAILQ_INSERT_TAIL(&vpr_head, vp, list);
+	}
+}
+
+static void
+vpr_add(struct vpr *vp)
+{
+	struct epoll_event ev;
+
+	CHECK_OBJ_NOTNULL(vp, VPR_MAGIC);
+	vp->t_last = TIM_real();
+	VTAILQ_INSERT_TAIL(&vpr_head, vp, list);
+	VSC_C_main->pipe_relay++;
+	VSC_C_main->n_pipe_relay++;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = vp;
+	AZ(epoll_ctl(vpr_epfd, EPOLL_CTL_ADD, vp->fd, &ev));
+	AZ(epoll_ctl(vpr_epfd, EPOLL_CTL_ADD, vp->vbc->fd, &ev));
+
+	/* There may be data waiting already, edge triggering won't tell */
+	vpr_event(vp);
+}
+
+static void
+vpr_reap(void)
+{
+	struct vpr *vp;
+
+	while (1) {
+		vp = VTAILQ_FIRST(&vpr_dead);
+		if (vp == NULL)
+			break;
+		VTAILQ_REMOVE(&vpr_dead, vp, list);
+		FREE_OBJ(vp);
+	}
+}
+
+static void *
+vpr_main(void *arg)
+{
+	struct epoll_event ev[VPR_NEEV], *ep;
+	struct vpr *vpa[VPR_NEEV], *vp;
+	double deadline, t_tick;
+	int i, j, k, n;
+
+	THR_SetName("cache-pipe-relay");
+	(void)arg;
+
+	memset(ev, 0, sizeof ev);
+	ev[0].events = EPOLLIN | EPOLLPRI;
+	ev[0].data.ptr = vpr_pipes;
+	AZ(epoll_ctl(vpr_epfd, EPOLL_CTL_ADD, vpr_pipes[0], &ev[0]));
+
+	t_tick = TIM_real();
+	while (1) {
+		n = epoll_wait(vpr_epfd, ev, VPR_NEEV, 1000);
+		for (ep = ev, i = 0; i < n; i++, ep++) {
+			if (ep->data.ptr != vpr_pipes) {
+				vpr_event(ep->data.ptr);
+				continue;
+			}
+			j = read(vpr_pipes[0], vpa, sizeof vpa);
+			if (j == -1 && errno == EAGAIN)
+				continue;
+			assert(j > 0 && (j % sizeof vpa[0]) == 0);
+			for (k = 0; k < j / sizeof vpa[0]; k++)
+				vpr_add(vpa[k]);
+		}
+		vpr_reap();
+
+		if (TIM_real() - t_tick < 1.0)
+			continue;
+		t_tick = TIM_real();
+		deadline = t_tick - params->pipe_timeout;
+		while (1) {
+			vp = VTAILQ_FIRST(&vpr_head);
+			if (vp == NULL || vp->t_last > deadline)
+				break;
+			vpr_close(vp, "pipe timeout");
+		}
+		vpr_reap();
+	}
+	return (NULL);
+}
+
+/*--------------------------------------------------------------------
+ * Try to hand a piped session over to the relay thread.  On success the
+ * relay owns both the client and the backend connection.
+ */
+
+static int
+vpr_handoff(struct sess *sp)
+{
+	struct vpr *vp;
+	int j;
+
+	if (!params->pipe_relay || vpr_epfd < 0)
+		return (0);
+
+	ALLOC_OBJ(vp, VPR_MAGIC);
+	if (vp == NULL)
+		return (0);
+	for (j = 0; j < 2; j++) {
+		if (pipe(vp->dir[j].pfd)) {
+			if (j == 1) {
+				AZ(close(vp->dir[0].pfd[0]));
+				AZ(close(vp->dir[0].pfd[1]));
+			}
+			FREE_OBJ(vp);
+			return (0);
+		}
+	}
+	vp->id = sp->id;
+	vp->fd = sp->fd;
+	vp->vbc = sp->vbc;
+	vp->dir[0].src = vp->fd;
+	vp->dir[0].dst = vp->vbc->fd;
+	vp->dir[1].src = vp->vbc->fd;
+	vp->dir[1].dst = vp->fd;
+	(void)VTCP_nonblocking(vp->fd);
+	(void)VTCP_nonblocking(vp->vbc->fd);
+
+	/* The relay logs with our fd's, make sure we get there first */
+	WSL_Flush(sp->wrk, 0);
+
+	sp->fd = -1;
+	sp->vbc = NULL;
+	sp->wrk->do_close = 0;
+	assert(write(vpr_pipes[1], &vp, sizeof vp) == sizeof vp);
+	return (1);
+}
+
+void
+PIPE_Init(void)
+{
+	int i;
+
+	vpr_epfd = epoll_create(1);
+	if (vpr_epfd < 0)
+		return;
+	AZ(pipe(vpr_pipes));
+	i = fcntl(vpr_pipes[0], F_GETFL);
+	assert(i != -1);
+	i |= O_NONBLOCK;
+	i = fcntl(vpr_pipes[0], F_SETFL, i);
+	assert(i != -1);
+	AZ(pthread_create(&vpr_thread, NULL, vpr_main, NULL));
+}
+
+#else /* !(HAVE_EPOLL_CTL && HAVE_SPLICE) */
+
+static int
+vpr_handoff(const struct sess *sp)
+{
+
+	(void)sp;
+	return (0);
+}
+
+void
+PIPE_Init(void)
+{
+}
+
+#endif
 
 static int
 rdf(int fd0, int fd1)
@@ -94,6 +412,9 @@ PipeSession(struct sess *sp)
 
 	sp->t_resp = TIM_real();
 
+	if (vpr_handoff(sp))
+		return;
+
 	memset(fds, 0, sizeof fds);
 
 	// XXX: not yet (void)VTCP_linger(vc->fd, 0);
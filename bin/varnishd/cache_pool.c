@@ -57,6 +57,7 @@
 #include "stevedore.h"
 #include "hash_slinger.h"
 #include "vsha256.h"
+#include "hash_digest.h"
 
 VTAILQ_HEAD(workerhead, worker);
 
@@ -77,6 +78,7 @@ struct wq {
 
 static struct wq		**wq;
 static unsigned			nwq;
+static struct wq		*fetchwq;
 static unsigned			queue_max;
 static unsigned			nthr_max;
 
@@ -116,7 +118,7 @@ WRK_SumStat(struct worker *w)
 
 static void *
 wrk_thread_real(struct wq *qp, unsigned shm_workspace, unsigned sess_workspace,
-    uint16_t nhttp, unsigned http_space, unsigned siov)
+    uint16_t nhttp, unsigned http_space, unsigned siov, unsigned scbuf)
 {
 	struct worker *w, ww;
 	uint32_t wlog[shm_workspace / 4];
@@ -126,7 +128,8 @@ wrk_thread_real(struct wq *qp, unsigned shm_workspace, unsigned sess_workspace,
 	unsigned char http1[http_space];
 	unsigned char http2[http_space];
 	struct iovec iov[siov];
-	struct SHA256Context sha256;
+	char *cbuf;
+	struct hsh_ctx hshctx;
 	int stats_clean;
 
 	THR_SetName("cache-worker");
@@ -136,13 +139,18 @@ wrk_thread_real(struct wq *qp, unsigned shm_workspace, unsigned sess_workspace,
 	w->lastused = NAN;
 	w->wlb = w->wlp = wlog;
 	w->wle = wlog + (sizeof wlog) / 4;
-	w->sha256ctx = &sha256;
+	w->hshctx = &hshctx;
 	w->bereq = HTTP_create(http0, nhttp);
 	w->beresp = HTTP_create(http1, nhttp);
 	w->resp = HTTP_create(http2, nhttp);
+	/* Can be larger than we want on the stack */
+	cbuf = malloc(scbuf + 1L);
+	AN(cbuf);
 	w->wrw.iov = iov;
 	w->wrw.siov = siov;
 	w->wrw.ciov = siov;
+	w->wrw.cbuf = cbuf;
+	w->wrw.scbuf = scbuf;
 	AZ(pthread_cond_init(&w->cond, NULL));
 
 	WS_Init(w->ws, "wrk", ws, sess_workspace);
@@ -215,6 +223,7 @@ wrk_thread_real(struct wq *qp, unsigned shm_workspace, unsigned sess_workspace,
 	AZ(pthread_cond_destroy(&w->cond));
 	HSH_Cleanup(w);
 	WRK_SumStat(w);
+	free(cbuf);
 	return (NULL);
 }
 
@@ -235,7 +244,7 @@ wrk_thread(void *priv)
 	return (wrk_thread_real(qp,
 	    params->shm_workspace,
 	    params->wthread_workspace,
-	    nhttp, HTTP_estimate(nhttp), siov));
+	    nhttp, HTTP_estimate(nhttp), siov, params->send_coalesce));
 }
 
 /*--------------------------------------------------------------------
@@ -245,23 +254,9 @@ wrk_thread(void *priv)
  */
 
 static int
-WRK_Queue(struct sess *sp)
+wrk_queue(struct wq *qp, struct sess *sp)
 {
 	struct worker *w;
-	struct wq *qp;
-	static unsigned nq = 0;
-	unsigned onq;
-
-	/*
-	 * Select which pool we issue to
-	 * XXX: better alg ?
-	 * XXX: per CPU ?
-	 */
-	onq = nq + 1;
-	if (onq >= nwq)
-		onq = 0;
-	qp = wq[onq];
-	nq = onq;
 
 	Lck_Lock(&qp->mtx);
 
@@ -286,10 +281,32 @@ WRK_Queue(struct sess *sp)
 	qp->nqueue++;
 	qp->lqueue++;
 	Lck_Unlock(&qp->mtx);
-	AZ(pthread_cond_signal(&herder_cond));
+	if (qp != fetchwq)
+		AZ(pthread_cond_signal(&herder_cond));
 	return (0);
 }
 
+static int
+WRK_Queue(struct sess *sp)
+{
+	struct wq *qp;
+	static unsigned nq = 0;
+	unsigned onq;
+
+	/*
+	 * Select which pool we issue to
+	 * XXX: better alg ?
+	 * XXX: per CPU ?
+	 */
+	onq = nq + 1;
+	if (onq >= nwq)
+		onq = 0;
+	qp = wq[onq];
+	nq = onq;
+
+	return (wrk_queue(qp, sp));
+}
+
 /*--------------------------------------------------------------------*/
 
 int
@@ -319,10 +336,40 @@ WRK_QueueSession(struct sess *sp)
 	return (1);
 }
 
+/*--------------------------------------------------------------------
+ * Background fetches go to their own pool, so they cannot be starved
+ * by (or starve) the clients, and we do not kill the session if they
+ * cannot be queued, the caller cleans up.
+ */
+
+int
+WRK_QueueFetch(struct sess *sp)
+{
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	AZ(sp->wrk);
+	if (fetchwq == NULL)
+		return (-1);
+	return (wrk_queue(fetchwq, sp));
+}
+
 /*--------------------------------------------------------------------
  * Add (more) thread pools
  */
 
+static struct wq *
+wrk_newpool(void)
+{
+	struct wq *qp;
+
+	qp = calloc(sizeof *qp, 1);
+	XXXAN(qp);
+	qp->magic = WQ_MAGIC;
+	Lck_New(&qp->mtx, lck_wq);
+	VTAILQ_INIT(&qp->queue);
+	VTAILQ_INIT(&qp->idle);
+	return (qp);
+}
+
 static void
 wrk_addpools(const unsigned pools)
 {
@@ -336,14 +383,8 @@ wrk_addpools(const unsigned pools)
 		memcpy(pwq, wq, sizeof *pwq * nwq);
 	owq = wq;
 	wq = pwq;
-	for (u = nwq; u < pools; u++) {
-		wq[u] = calloc(sizeof *wq[0], 1);
-		XXXAN(wq[u]);
-		wq[u]->magic = WQ_MAGIC;
-		Lck_New(&wq[u]->mtx, lck_wq);
-		VTAILQ_INIT(&wq[u]->queue);
-		VTAILQ_INIT(&wq[u]->idle);
-	}
+	for (u = nwq; u < pools; u++)
+		wq[u] = wrk_newpool();
 	(void)owq;	/* XXX: avoid race, leak it. */
 	nwq = pools;
 }
@@ -588,6 +629,7 @@ void
 WRK_Init(void)
 {
 	pthread_t tp;
+	unsigned u;
 
 	AZ(pthread_cond_init(&herder_cond, NULL));
 	Lck_New(&herder_mtx, lck_herder);
@@ -598,6 +640,13 @@ WRK_Init(void)
 		nthr_max = params->wthread_min;
 
 	wrk_addpools(params->wthread_pools);
+	if (params->wthread_bgfetch > 0) {
+		fetchwq = wrk_newpool();
+		for (u = 0; u < params->wthread_bgfetch; u++) {
+			AZ(pthread_create(&tp, NULL, wrk_thread, fetchwq));
+			AZ(pthread_detach(tp));
+		}
+	}
 	AZ(pthread_create(&tp, NULL, wrk_herdtimer_thread, NULL));
 	AZ(pthread_detach(tp));
 	AZ(pthread_create(&tp, NULL, wrk_herder_thread, NULL));
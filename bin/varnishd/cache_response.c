@@ -37,12 +37,14 @@
 
 #include "cache.h"
 #include "stevedore.h"
+#include "hash_slinger.h"
 #include "vct.h"
 
 /*--------------------------------------------------------------------*/
 
 static void
-res_dorange(const struct sess *sp, const char *r, ssize_t *plow, ssize_t *phigh)
+res_dorange(const struct sess *sp, const char *r, ssize_t len, ssize_t *plow,
+    ssize_t *phigh)
 {
 	ssize_t low, high, has_low;
 
@@ -62,7 +64,7 @@ res_dorange(const struct sess *sp, const char *r, ssize_t *plow, ssize_t *phigh)
 		r++;
 	}
 
-	if (low >= sp->obj->len)
+	if (low >= len)
 		return;
 
 	if (*r != '-')
@@ -78,23 +80,23 @@ res_dorange(const struct sess *sp, const char *r, ssize_t *plow, ssize_t *phigh)
 			r++;
 		}
 		if (!has_low) {
-			low = sp->obj->len - high;
-			high = sp->obj->len - 1;
+			low = len - high;
+			high = len - 1;
 		}
 	} else
-		high = sp->obj->len - 1;
+		high = len - 1;
 	if (*r != '\0')
 		return;
 
-	if (high >= sp->obj->len)
-		high = sp->obj->len - 1;
+	if (high >= len)
+		high = len - 1;
 
 	if (low > high)
 		return;
 
 	http_PrintfHeader(sp->wrk, sp->fd, sp->wrk->resp,
 	    "Content-Range: bytes %jd-%jd/%jd",
-	    (intmax_t)low, (intmax_t)high, (intmax_t)sp->obj->len);
+	    (intmax_t)low, (intmax_t)high, (intmax_t)len);
 	http_Unset(sp->wrk->resp, H_Content_Length);
 	assert(sp->wrk->res_mode & RES_LEN);
 	http_PrintfHeader(sp->wrk, sp->fd, sp->wrk->resp,
@@ -133,6 +135,13 @@ RES_BuildHttp(const struct sess *sp)
 		http_SetHeader(sp->wrk, sp->fd, sp->wrk->resp,
 		    "Transfer-Encoding: chunked");
 
+	if (sp->wrk->res_mode & RES_GUNZIPPED) {
+		http_Unset(sp->wrk->resp, H_Content_Length);
+		http_PrintfHeader(sp->wrk, sp->fd, sp->wrk->resp,
+		    "Content-Length: %jd",
+		    (intmax_t)sp->obj->objcore->gunzip_copy->len);
+	}
+
 	http_Unset(sp->wrk->resp, H_Date);
 	TIM_format(TIM_real(), time_str);
 	http_PrintfHeader(sp->wrk, sp->fd, sp->wrk->resp, "Date: %s", time_str);
@@ -150,6 +159,55 @@ RES_BuildHttp(const struct sess *sp)
 	    sp->doclose ? "close" : "keep-alive");
 }
 
+/*--------------------------------------------------------------------
+ * Serialize the headers RES_BuildHttp() will copy from the object, so
+ * that deliveries can send them in one go.
+ *
+ * Must be called when the object headers are final and before other
+ * sessions can see the object.
+ */
+
+void
+RES_BuildHdrBlock(const struct sess *sp)
+{
+	struct object *o;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	o = sp->obj;
+	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+	AZ(o->hdrblk_nhd);
+	o->hdrblk_nhd = http_FilterBlock(o->ws_o, o->http, HTTPH_A_DELIVER,
+	    &o->hdrblk, &o->hdrblk_last);
+}
+
+/*--------------------------------------------------------------------
+ * Send the response headers.
+ *
+ * RES_BuildHttp() put the object headers first in resp, and the only
+ * way they can have been changed since is by http_Unset(), which keeps
+ * the order.  If the last of them is still in its place, none of them
+ * are missing and we can use the prebuilt block.
+ */
+
+static unsigned
+res_WriteHttp(const struct sess *sp)
+{
+	const struct object *o;
+	const struct http *hp;
+	unsigned n;
+
+	o = sp->obj;
+	hp = sp->wrk->resp;
+	n = HTTP_HDR_FIRST + o->hdrblk_nhd;
+	if (o->hdrblk_nhd > 0 && hp->nhd >= n &&
+	    hp->hd[n - 1].b == o->hdrblk_last) {
+		VSC_C_main->n_objhdrblock++;
+		return (http_WriteBlock(sp->wrk, hp, &o->hdrblk,
+		    o->hdrblk_nhd));
+	}
+	return (http_Write(sp->wrk, hp, 1));
+}
+
 /*--------------------------------------------------------------------
  * We have a gzip'ed object and need to ungzip it for a client which
  * does not understand gzip.
@@ -193,10 +251,172 @@ res_WriteGunzipObj(struct sess *sp)
 	assert(u == sp->obj->len);
 }
 
+/*--------------------------------------------------------------------
+ * Where VCD_Deliver() puts the decoded body.
+ */
+
+static void __match_proto__()
+res_decode_sink(const struct sess *sp, const uint8_t *p, ssize_t l)
+{
+
+	sp->wrk->acct_tmp.bodybytes += l;
+	(void)WRW_Write(sp->wrk, p, l);
+	/* p is on VCD_Deliver()'s stack */
+	(void)WRW_Flush(sp->wrk);
+}
+
+/*--------------------------------------------------------------------
+ * Once a gzip'ed object has been gunzip'ed for gunzip_cache deliveries,
+ * we keep an uncompressed copy of the body with the object, so further
+ * clients which don't grok gzip get it straight from storage, with a
+ * Content-Length and range support.  Hanging off the objcore, the copy
+ * has the TTL and bans of the object, and goes when the object goes.
+ *
+ * The delivery which passes the limit makes the copy.  Returns true if
+ * this delivery can use it.
+ */
+
+static int
+res_gunzip_copy(struct sess *sp, struct storagehead *sh, ssize_t *plen)
+{
+	struct vgz *vg;
+	struct storage *sst, *st = NULL;
+	const void *dp;
+	size_t dl;
+	ssize_t l, len = 0;
+	int i = VGZ_OK;
+
+	vg = VGZ_NewUngzip(sp, "U D C");
+	VTAILQ_FOREACH(sst, &sp->obj->store, list) {
+		VGZ_Ibuf(vg, sst->ptr, sst->len);
+		do {
+			if (st == NULL || st->len == st->space) {
+				/* Grow like FetchStorage() does */
+				l = params->fetch_chunksize * 1024LL;
+				if (l < len)
+					l = len;
+				st = STV_alloc(sp, l);
+				if (st == NULL) {
+					i = VGZ_ERROR;
+					break;
+				}
+				VTAILQ_INSERT_TAIL(sh, st, list);
+			}
+			VGZ_Obuf(vg, st->ptr + st->len, st->space - st->len);
+			i = VGZ_Gunzip(vg, &dp, &dl);
+			st->len += dl;
+			len += dl;
+		} while (i == VGZ_OK &&
+		    (!VGZ_IbufEmpty(vg) || VGZ_ObufFull(vg)));
+		if (i != VGZ_OK && i != VGZ_STUCK)
+			break;
+	}
+	if (VGZ_Destroy(&vg) != VGZ_END)
+		i = VGZ_ERROR;
+	if (st != NULL && i == VGZ_END) {
+		if (st->len == 0) {
+			VTAILQ_REMOVE(sh, st, list);
+			STV_free(st);
+		} else if (st->len < st->space)
+			STV_trim(st, st->len);
+	}
+	if (i != VGZ_END) {
+		while ((st = VTAILQ_FIRST(sh)) != NULL) {
+			VTAILQ_REMOVE(sh, st, list);
+			STV_free(st);
+		}
+		return (-1);
+	}
+	*plen = len;
+	return (0);
+}
+
+int
+RES_Gunzipped(struct sess *sp)
+{
+	struct object *o;
+	struct objcore *oc;
+	struct objhead *oh;
+	struct gunzip_copy *gc;
+	struct storagehead sh;
+	ssize_t len = 0;
+	unsigned u;
+	int i, claim;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	o = sp->obj;
+	CHECK_OBJ_NOTNULL(o, OBJECT_MAGIC);
+	AN(o->gziped);
+	oc = o->objcore;
+	if (params->gunzip_cache == 0 || oc == NULL ||
+	    (oc->flags & (OC_F_BUSY|OC_F_PASS)) ||
+	    sp->wrk->stream_bo != NULL || o->esidata != NULL)
+		return (0);
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	oh = oc->objhead;
+	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
+
+	claim = 0;
+	Lck_Lock(&oh->mtx);
+	gc = oc->gunzip_copy;
+	if (gc == NULL) {
+		ALLOC_OBJ(gc, GUNZIP_COPY_MAGIC);
+		AN(gc);
+		VTAILQ_INIT(&gc->store);
+		oc->gunzip_copy = gc;
+	}
+	u = gc->state;
+	if (u == GUNZIP_COPY_NONE &&
+	    ++gc->deliveries >= params->gunzip_cache) {
+		gc->state = GUNZIP_COPY_BUSY;
+		claim = 1;
+	}
+	Lck_Unlock(&oh->mtx);
+	if (!claim)
+		return (u == GUNZIP_COPY_DONE);
+
+	VTAILQ_INIT(&sh);
+	i = res_gunzip_copy(sp, &sh, &len);
+
+	Lck_Lock(&oh->mtx);
+	if (i == 0) {
+		VTAILQ_CONCAT(&gc->store, &sh, list);
+		gc->len = len;
+		gc->state = GUNZIP_COPY_DONE;
+	} else
+		gc->state = GUNZIP_COPY_FAIL;
+	Lck_Unlock(&oh->mtx);
+	if (i == 0)
+		sp->wrk->stats.n_gunzip_copy++;
+	return (i == 0);
+}
+
+/* Called from HSH_Deref() when the objcore goes */
+
+void
+RES_GunzipFree(struct objcore *oc)
+{
+	struct gunzip_copy *gc;
+	struct storage *st;
+
+	CHECK_OBJ_NOTNULL(oc, OBJCORE_MAGIC);
+	gc = oc->gunzip_copy;
+	if (gc == NULL)
+		return;
+	oc->gunzip_copy = NULL;
+	CHECK_OBJ(gc, GUNZIP_COPY_MAGIC);
+	while ((st = VTAILQ_FIRST(&gc->store)) != NULL) {
+		VTAILQ_REMOVE(&gc->store, st, list);
+		STV_free(st);
+	}
+	FREE_OBJ(gc);
+}
+
 /*--------------------------------------------------------------------*/
 
 static void
-res_WriteDirObj(const struct sess *sp, ssize_t low, ssize_t high)
+res_WriteDirObj(const struct sess *sp, const struct storagehead *sh,
+    ssize_t l, ssize_t low, ssize_t high)
 {
 	ssize_t u = 0;
 	size_t ptr, off, len;
@@ -205,7 +425,7 @@ res_WriteDirObj(const struct sess *sp, ssize_t low, ssize_t high)
 	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
 
 	ptr = 0;
-	VTAILQ_FOREACH(st, &sp->obj->store, list) {
+	VTAILQ_FOREACH(st, sh, list) {
 		CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
 		CHECK_OBJ_NOTNULL(st, STORAGE_MAGIC);
 		u += st->len;
@@ -243,10 +463,17 @@ res_WriteDirObj(const struct sess *sp, ssize_t low, ssize_t high)
 			continue;
 		}
 #endif /* SENDFILE_WORKS */
+#ifdef ZEROCOPY_WORKS
+		if (len >= params->zerocopy_threshold) {
+			VSC_C_main->n_objzerocopy++;
+			WRW_SendZeroCopy(sp->wrk, st->ptr + off, len);
+			continue;
+		}
+#endif /* ZEROCOPY_WORKS */
 		VSC_C_main->n_objwrite++;
 		(void)WRW_Write(sp->wrk, st->ptr + off, len);
 	}
-	assert(u == sp->obj->len);
+	assert(u == l);
 }
 
 /*--------------------------------------------------------------------
@@ -258,7 +485,7 @@ void
 RES_WriteObj(struct sess *sp)
 {
 	char *r;
-	ssize_t low, high;
+	ssize_t len, low, high;
 
 	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
 
@@ -276,29 +503,32 @@ RES_WriteObj(struct sess *sp)
 	/*
 	 * If nothing special planned, we can attempt Range support
 	 */
+	len = sp->obj->len;
+	if (sp->wrk->res_mode & RES_GUNZIPPED)
+		len = sp->obj->objcore->gunzip_copy->len;
 	low = 0;
-	high = sp->obj->len - 1;
+	high = len - 1;
 	if (
 	    sp->wantbody &&
 	    (sp->wrk->res_mode & RES_LEN) &&
-	    !(sp->wrk->res_mode & (RES_ESI|RES_ESI_CHILD|RES_GUNZIP)) &&
+	    !(sp->wrk->res_mode &
+	    (RES_ESI|RES_ESI_CHILD|RES_GUNZIP|RES_DECODE)) &&
 	    params->http_range_support &&
 	    sp->obj->response == 200 &&
 	    http_GetHdr(sp->http, H_Range, &r))
-		res_dorange(sp, r, &low, &high);
+		res_dorange(sp, r, len, &low, &high);
 
 	/*
 	 * Always remove C-E if client don't grok it
 	 */
-	if (sp->wrk->res_mode & RES_GUNZIP)
+	if (sp->wrk->res_mode & (RES_GUNZIP|RES_GUNZIPPED|RES_DECODE))
 		http_Unset(sp->wrk->resp, H_Content_Encoding);
 
 	/*
 	 * Send HTTP protocol header, unless interior ESI object
 	 */
 	if (!(sp->wrk->res_mode & RES_ESI_CHILD))
-		sp->wrk->acct_tmp.hdrbytes +=
-		    http_Write(sp->wrk, sp->wrk->resp, 1);
+		sp->wrk->acct_tmp.hdrbytes += res_WriteHttp(sp);
 
 	if (!sp->wantbody)
 		sp->wrk->res_mode &= ~RES_CHUNKED;
@@ -317,10 +547,18 @@ RES_WriteObj(struct sess *sp)
 	} else if (sp->wrk->res_mode & RES_ESI_CHILD &&
 	    !sp->wrk->gzip_resp && sp->obj->gziped) {
 		res_WriteGunzipObj(sp);
+	} else if ((sp->wrk->res_mode & (RES_ESI_CHILD|RES_DECODE)) &&
+	    sp->obj->codec != VCD_NONE) {
+		/* ESI parents can only take identity or gzip */
+		VCD_Deliver(sp, res_decode_sink);
 	} else if (sp->wrk->res_mode & RES_GUNZIP) {
 		res_WriteGunzipObj(sp);
+	} else if (sp->wrk->res_mode & RES_GUNZIPPED) {
+		sp->wrk->stats.n_gunzip_copy_hit++;
+		res_WriteDirObj(sp, &sp->obj->objcore->gunzip_copy->store,
+		    sp->obj->objcore->gunzip_copy->len, low, high);
 	} else {
-		res_WriteDirObj(sp, low, high);
+		res_WriteDirObj(sp, &sp->obj->store, sp->obj->len, low, high);
 	}
 
 	if (sp->wrk->res_mode & RES_CHUNKED &&
@@ -376,6 +614,7 @@ RES_StreamPoll(const struct sess *sp)
 	if (sp->obj->len == sctx->stream_next)
 		return;
 	assert(sp->obj->len > sctx->stream_next);
+	HSH_StreamPoll(sp->obj);
 	l = sctx->stream_front;
 	VTAILQ_FOREACH(st, &sp->obj->store, list) {
 		if (st->len + l <= sctx->stream_next) {
@@ -430,3 +669,95 @@ RES_StreamEnd(struct sess *sp)
 	if (WRW_FlushRelease(sp->wrk))
 		vca_close_session(sp, "remote closed");
 }
+
+/*--------------------------------------------------------------------
+ * Deliver an object another session is fetching, as the body arrives.
+ *
+ * We only ever look at storage below the length the fetcher published,
+ * see HSH_StreamStart().  Segments fill up before the next one is added,
+ * so if there are published bytes beyond the segment we are in, it is
+ * complete and has a successor.
+ */
+
+void
+RES_StreamFollow(struct sess *sp)
+{
+	struct busyobj *bo;
+	struct stream_ctx sctx;
+	struct storage *st;
+	ssize_t l, l2, len;
+	unsigned state;
+	uint8_t obuf[sp->wrk->res_mode & RES_GUNZIP ?
+	    params->gzip_stack_buffer : 1];
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(sp->obj, OBJECT_MAGIC);
+	bo = sp->wrk->stream_bo;
+	CHECK_OBJ_NOTNULL(bo, BUSYOBJ_MAGIC);
+	assert(bo->stream_obj == sp->obj);
+
+	memset(&sctx, 0, sizeof sctx);
+	sctx.magic = STREAM_CTX_MAGIC;
+	AZ(sp->wrk->sctx);
+	sp->wrk->sctx = &sctx;
+
+	if (sp->wrk->res_mode & RES_GUNZIP) {
+		sctx.vgz = VGZ_NewUngzip(sp, "U F -");
+		sctx.obuf = obuf;
+		sctx.obuf_len = sizeof (obuf);
+	}
+
+	RES_StreamStart(sp);
+
+	st = NULL;
+	l = 0;
+	Lck_Lock(&bo->mtx);
+	while (1) {
+		while (bo->stream_len == sctx.stream_next &&
+		    bo->stream_state < BOS_FAILED) {
+			bo->stream_nwait++;
+			Lck_CondWait(&bo->cond, &bo->mtx);
+			bo->stream_nwait--;
+		}
+		len = bo->stream_len;
+		state = bo->stream_state;
+		Lck_Unlock(&bo->mtx);
+		if (state == BOS_FAILED || len == sctx.stream_next)
+			break;
+		while (sctx.stream_next < len) {
+			if (st == NULL) {
+				st = VTAILQ_FIRST(&sp->obj->store);
+			} else if (sctx.stream_next == l + st->len) {
+				l += st->len;
+				st = VTAILQ_NEXT(st, list);
+			}
+			CHECK_OBJ_NOTNULL(st, STORAGE_MAGIC);
+			l2 = st->len + l - sctx.stream_next;
+			if (l2 > len - sctx.stream_next)
+				l2 = len - sctx.stream_next;
+			if (l2 == 0)
+				continue;
+			if (sp->wrk->res_mode & RES_GUNZIP) {
+				(void)VGZ_WrwGunzip(sp, sctx.vgz,
+				    st->ptr + (sctx.stream_next - l), l2,
+				    sctx.obuf, sctx.obuf_len, &sctx.obuf_ptr);
+			} else {
+				(void)WRW_Write(sp->wrk,
+				    st->ptr + (sctx.stream_next - l), l2);
+			}
+			sctx.stream_next += l2;
+		}
+		if (!(sp->wrk->res_mode & RES_GUNZIP))
+			(void)WRW_Flush(sp->wrk);
+		if (WRW_Error(sp->wrk))
+			break;
+		Lck_Lock(&bo->mtx);
+	}
+	if (state == BOS_FAILED)
+		sp->doclose = "Stream error";
+
+	RES_StreamEnd(sp);
+	if (sp->wrk->res_mode & RES_GUNZIP)
+		(void)VGZ_Destroy(&sctx.vgz);
+	sp->wrk->sctx = NULL;
+}
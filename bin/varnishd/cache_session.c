@@ -76,6 +76,7 @@ static struct lock		ses_mem_mtx;
 static struct lock		stat_mtx;
 static volatile uint64_t	n_sess_grab = 0;
 static uint64_t			n_sess_rel = 0;
+static uint64_t			n_sess_fetch = 0;
 
 /*--------------------------------------------------------------------*/
 
@@ -240,6 +241,39 @@ SES_Alloc(void)
 	return (sp);
 }
 
+/*--------------------------------------------------------------------
+ * Get a session for a background fetch.  Unlike SES_Alloc() this is
+ * released with SES_Delete(), so it is counted.  We can only take
+ * recycled sessions from the locked queue, the acceptor owns the other.
+ */
+
+struct sess *
+SES_NewFetch(void)
+{
+	struct sessmem *sm;
+	struct sess *sp;
+
+	Lck_Lock(&ses_mem_mtx);
+	sm = VTAILQ_FIRST(&ses_free_mem[1 - ses_qp]);
+	if (sm != NULL)
+		VTAILQ_REMOVE(&ses_free_mem[1 - ses_qp], sm, list);
+	Lck_Unlock(&ses_mem_mtx);
+	if (sm == NULL) {
+		sm = ses_sm_alloc();
+		if (sm == NULL)
+			return (NULL);
+		ses_setup(sm);
+	}
+	sp = &sm->sess;
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	sp->fd = -1;
+
+	Lck_Lock(&stat_mtx);
+	n_sess_fetch++;
+	Lck_Unlock(&stat_mtx);
+	return (sp);
+}
+
 /*--------------------------------------------------------------------
  * Recycle a session.  If the workspace has changed, deleted it,
  * otherwise wash it, and put it up for adoption.
@@ -284,7 +318,7 @@ SES_Delete(struct sess *sp)
 	if (sm == NULL)
 		VSC_C_main->n_sess_mem--;
 	n_sess_rel++;
-	VSC_C_main->n_sess = n_sess_grab - n_sess_rel;
+	VSC_C_main->n_sess = n_sess_grab + n_sess_fetch - n_sess_rel;
 	Lck_Unlock(&stat_mtx);
 
 	/* Try to precreate some ses-mem so the acceptor will not have to */
@@ -257,3 +257,121 @@ VRY_Validate(const uint8_t *vary)
 		vary += vry_len(vary);
 	}
 }
+
+/*--------------------------------------------------------------------
+ * Keys for the objhead vary index.
+ *
+ * The key is a FNV-1a hash over the entries of a vary matching string,
+ * and VRY_ReqKey() produces the same key from the request headers, so
+ * objects can be found by the values the request has.  Accept-Encoding
+ * is left out, vry_cmp() ignores it when we do gzip processing.
+ *
+ * The names string is a vary matching string where all the headers are
+ * absent, it tells VRY_ReqKey() which headers to look at.
+ */
+
+#define VRY_FNV_BASIS	2166136261U
+#define VRY_FNV_PRIME	16777619U
+
+static uint32_t
+vry_hash(uint32_t h, const uint8_t *p, unsigned l)
+{
+
+	while (l-- > 0) {
+		h ^= *p++;
+		h *= VRY_FNV_PRIME;
+	}
+	return (h);
+}
+
+static uint32_t
+vry_hashentry(uint32_t h, const uint8_t *name, unsigned l, const char *v)
+{
+	uint8_t len[2];
+
+	if (!strcasecmp(H_Accept_Encoding, (const char *)name))
+		return (h);
+	vbe16enc(len, (uint16_t)l);
+	h = vry_hash(h, name, name[0] + 2);
+	h = vry_hash(h, len, 2);
+	if (l != 0xffff)
+		h = vry_hash(h, (const uint8_t *)v, l);
+	return (h);
+}
+
+uint32_t
+VRY_Key(const uint8_t *vary)
+{
+	uint32_t h = VRY_FNV_BASIS;
+
+	AN(vary);
+	while (vary[2]) {
+		h = vry_hashentry(h, vary + 2, vbe16dec(vary),
+		    (const char *)vary + 2 + vary[2] + 2);
+		vary += vry_len(vary);
+	}
+	return (h);
+}
+
+uint32_t
+VRY_ReqKey(const struct sess *sp, const uint8_t *names)
+{
+	uint32_t h = VRY_FNV_BASIS;
+	char *v, *e;
+	unsigned l;
+
+	AN(names);
+	while (names[2]) {
+		if (http_GetHdr(sp->http, (const char *)names + 2, &v)) {
+			/* Same trimming as VRY_Create() and VRY_Match() */
+			e = strchr(v, '\0');
+			while (e > v && vct_issp(e[-1]))
+				e--;
+			l = e - v;
+			assert(l < 0xffff);
+		} else {
+			v = NULL;
+			l = 0xffff;
+		}
+		h = vry_hashentry(h, names + 2, l, v);
+		names += vry_len(names);
+	}
+	return (h);
+}
+
+uint8_t *
+VRY_Names(const uint8_t *vary)
+{
+	const uint8_t *p;
+	uint8_t *names, *q;
+	unsigned l;
+
+	l = 3;
+	for (p = vary; p[2]; p += vry_len(p))
+		l += 2 + p[2] + 2;
+	names = malloc(l);
+	XXXAN(names);
+	q = names;
+	for (p = vary; p[2]; p += vry_len(p)) {
+		vbe16enc(q, 0xffff);
+		memcpy(q + 2, p + 2, p[2] + 2);
+		q += 2 + p[2] + 2;
+	}
+	q[0] = 0xff;
+	q[1] = 0xff;
+	q[2] = 0;
+	return (names);
+}
+
+int
+VRY_SameNames(const uint8_t *names, const uint8_t *vary)
+{
+
+	while (names[2] && vary[2]) {
+		if (memcmp(names + 2, vary + 2, names[2] + 2))
+			return (0);
+		names += vry_len(names);
+		vary += vry_len(vary);
+	}
+	return (names[2] == vary[2]);
+}
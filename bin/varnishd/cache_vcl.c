@@ -115,6 +115,22 @@ VCL_Rel(struct VCL_conf **vcc)
 	Lck_Unlock(&vcl_mtx);
 }
 
+/*--------------------------------------------------------------------
+ * Take another reference on a VCL somebody already holds, for a
+ * background fetch which must run the same VCL as its client.
+ */
+
+void
+VCL_Ref(struct VCL_conf *vc)
+{
+
+	AN(vc);
+	Lck_Lock(&vcl_mtx);
+	assert(vc->busy > 0);
+	vc->busy++;
+	Lck_Unlock(&vcl_mtx);
+}
+
 /*--------------------------------------------------------------------*/
 
 static struct vcls *
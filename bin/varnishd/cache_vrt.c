@@ -86,7 +86,7 @@ VRT_count(const struct sess *sp, unsigned u)
 void
 VRT_acl_log(const struct sess *sp, const char *msg)
 {
-	WSL(sp->wrk, SLT_VCL_acl, sp->fd, msg);
+	WSL(sp->wrk, SLT_VCL_acl, sp->id, msg);
 }
 
 /*--------------------------------------------------------------------*/
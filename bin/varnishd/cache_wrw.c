@@ -50,6 +50,13 @@
 #endif
 #endif /* SENDFILE_WORKS */
 
+#ifdef ZEROCOPY_WORKS
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <poll.h>
+#endif
+
 #include "cache.h"
 
 /*--------------------------------------------------------------------
@@ -73,6 +80,8 @@ WRW_Reserve(struct worker *w, int *fd)
 	wrw->werr = 0;
 	wrw->liov = 0;
 	wrw->niov = 0;
+	wrw->ncbuf = 0;
+	AZ(wrw->zcsent);
 	wrw->ciov = wrw->siov;
 	wrw->wfd = fd;
 }
@@ -85,9 +94,11 @@ WRW_Release(struct worker *w)
 	CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
 	wrw = &w->wrw;
 	AN(wrw->wfd);
+	AZ(wrw->zcsent);
 	wrw->werr = 0;
 	wrw->liov = 0;
 	wrw->niov = 0;
+	wrw->ncbuf = 0;
 	wrw->ciov = wrw->siov;
 	wrw->wfd = NULL;
 }
@@ -123,6 +134,9 @@ WRW_Flush(struct worker *w)
 			wrw->iov[wrw->ciov].iov_len = 0;
 		}
 		i = writev(*wrw->wfd, wrw->iov, wrw->niov);
+		w->stats.s_wrw_syscalls++;
+		if (i > 0)
+			w->stats.s_wrw_bytes += i;
 		while (i != wrw->liov && i > 0) {
 			/* Remove sent data from start of I/O vector,
 			 * then retry; we hit a timeout, but some data
@@ -160,6 +174,9 @@ WRW_Flush(struct worker *w)
 				used += wrw->iov[j].iov_len;
 			}
 			i = writev(*wrw->wfd, wrw->iov, wrw->niov);
+			w->stats.s_wrw_syscalls++;
+			if (i > 0)
+				w->stats.s_wrw_bytes += i;
 		}
 		if (i <= 0) {
 			wrw->werr++;
@@ -171,11 +188,16 @@ WRW_Flush(struct worker *w)
 	wrw->liov = 0;
 	wrw->cliov = 0;
 	wrw->niov = 0;
+	wrw->ncbuf = 0;
 	if (wrw->ciov < wrw->siov)
 		wrw->ciov = wrw->niov++;
 	return (wrw->werr);
 }
 
+#ifdef ZEROCOPY_WORKS
+static void wrw_ZeroCopyWait(struct worker *w);
+#endif
+
 unsigned
 WRW_FlushRelease(struct worker *w)
 {
@@ -184,6 +206,10 @@ WRW_FlushRelease(struct worker *w)
 	CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
 	AN(w->wrw.wfd);
 	u = WRW_Flush(w);
+#ifdef ZEROCOPY_WORKS
+	if (w->wrw.zcsent > 0)
+		wrw_ZeroCopyWait(w);
+#endif
 	WRW_Release(w);
 	return (u);
 }
@@ -209,6 +235,7 @@ unsigned
 WRW_Write(struct worker *w, const void *ptr, int len)
 {
 	struct wrw *wrw;
+	char *p;
 
 	CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
 	wrw = &w->wrw;
@@ -219,10 +246,25 @@ WRW_Write(struct worker *w, const void *ptr, int len)
 		len = strlen(ptr);
 	if (wrw->niov >= wrw->siov - (wrw->ciov < wrw->siov ? 1 : 0))
 		(void)WRW_Flush(w);
-	wrw->iov[wrw->niov].iov_base = TRUST_ME(ptr);
-	wrw->iov[wrw->niov].iov_len = len;
+
+	/* Small writes are copied to the coalescing buffer... */
+	if (len <= wrw->scbuf / 8 && wrw->ncbuf + len <= wrw->scbuf) {
+		p = wrw->cbuf + wrw->ncbuf;
+		memcpy(p, ptr, len);
+		wrw->ncbuf += len;
+		ptr = p;
+	}
+	/* ...so they can extend the previous iovec, like adjacent storage */
+	if (wrw->niov > 0 && wrw->niov - 1 != wrw->ciov &&
+	    (const char *)wrw->iov[wrw->niov - 1].iov_base +
+	    wrw->iov[wrw->niov - 1].iov_len == ptr) {
+		wrw->iov[wrw->niov - 1].iov_len += len;
+	} else {
+		wrw->iov[wrw->niov].iov_base = TRUST_ME(ptr);
+		wrw->iov[wrw->niov].iov_len = len;
+		wrw->niov++;
+	}
 	wrw->liov += len;
-	wrw->niov++;
 	if (wrw->ciov < wrw->siov) {
 		assert(wrw->niov < wrw->siov);
 		wrw->cliov += len;
@@ -299,12 +341,20 @@ WRW_Sendfile(struct worker *w, int fd, off_t off, unsigned len)
 			wrw->werr++;
 		wrw->liov = 0;
 		wrw->niov = 0;
+		wrw->ncbuf = 0;
 	} while (0);
 #elif defined(__linux__)
 	do {
-		if (WRW_Flush(w) == 0 &&
-		    sendfile(*wrw->wfd, fd, &off, len) != len)
-			wrw->werr++;
+		ssize_t i;
+
+		if (WRW_Flush(w) == 0) {
+			i = sendfile(*wrw->wfd, fd, &off, len);
+			w->stats.s_wrw_syscalls++;
+			if (i > 0)
+				w->stats.s_wrw_bytes += i;
+			if (i != len)
+				wrw->werr++;
+		}
 	} while (0);
 #elif defined(__sun) && defined(HAVE_SENDFILEV)
 	do {
@@ -328,6 +378,7 @@ WRW_Sendfile(struct worker *w, int fd, off_t off, unsigned len)
 			wrw->werr++;
 		wrw->liov = 0;
 		wrw->niov = 0;
+		wrw->ncbuf = 0;
 	} while (0);
 #elif defined(__sun) && defined(HAVE_SENDFILE)
 	do {
@@ -341,3 +392,191 @@ WRW_Sendfile(struct worker *w, int fd, off_t off, unsigned len)
 }
 #endif /* SENDFILE_WORKS */
 
+
+#ifdef ZEROCOPY_WORKS
+/*--------------------------------------------------------------------
+ * Send a piece of object storage with MSG_ZEROCOPY.
+ *
+ * The kernel holds on to the pages until the data has been ACK'ed, so
+ * the storage must stay put until the completions come back on the
+ * socket error queue.  We simply wait for them in WRW_FlushRelease(),
+ * before the caller can let go of its object reference.
+ *
+ * Only the storage itself is sent this way, anything else on the iovec
+ * lives on the workspace or stack, which will not stay put.
+ *
+ * SO_ZEROCOPY sticks to the socket, so we remember in the session if we
+ * set it already, or if the socket refused it.
+ */
+
+void
+WRW_SendZeroCopy(struct worker *w, const void *ptr, unsigned len)
+{
+	struct wrw *wrw;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t i;
+	int j;
+
+	CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(w->sp, SESS_MAGIC);
+	wrw = &w->wrw;
+	assert(wrw->wfd == &w->sp->fd);
+	AN(ptr);
+	assert(len > 0);
+
+	/* Chunk headers are on the stack, so not for chunked */
+	if (wrw->ciov < wrw->siov || w->sp->zcon == 2) {
+		(void)WRW_Write(w, ptr, len);
+		return;
+	}
+	if (WRW_Flush(w))
+		return;
+	if (w->sp->zcon == 0) {
+		j = 1;
+		if (setsockopt(*wrw->wfd, SOL_SOCKET, SO_ZEROCOPY,
+		    &j, sizeof j)) {
+			w->sp->zcon = 2;
+			(void)WRW_Write(w, ptr, len);
+			return;
+		}
+		w->sp->zcon = 1;
+	}
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	iov.iov_base = TRUST_ME(ptr);
+	iov.iov_len = len;
+	while (iov.iov_len > 0) {
+		i = sendmsg(*wrw->wfd, &msg, MSG_ZEROCOPY);
+		w->stats.s_wrw_syscalls++;
+		if (i < 0 && errno == ENOBUFS) {
+			/* Out of optmem for notifications, copy the rest */
+			(void)WRW_Write(w, iov.iov_base, iov.iov_len);
+			return;
+		}
+		if (i <= 0) {
+			wrw->werr++;
+			WSL(w, SLT_Debug, *wrw->wfd,
+			    "Zerocopy error, retval = %zd, len = %zu, errno = %s",
+			    i, iov.iov_len, strerror(errno));
+			return;
+		}
+		/* Every successful send produces one completion */
+		wrw->zcsent++;
+		w->stats.s_wrw_bytes += i;
+		iov.iov_base = (char *)iov.iov_base + i;
+		iov.iov_len -= i;
+		if (iov.iov_len > 0 &&
+		    TIM_real() - w->sp->t_resp > params->send_timeout) {
+			WSL(w, SLT_Debug, *wrw->wfd,
+			    "Hit total send timeout, zerocopy");
+			wrw->werr++;
+			return;
+		}
+	}
+}
+
+/*--------------------------------------------------------------------
+ * Collect the completions of our zerocopy sends.
+ *
+ * Until they are all in, the kernel may still read from the storage, so
+ * we cannot return and let the caller drop the object.  If the client
+ * has not ACK'ed it all by send_timeout, we abort the connection with a
+ * connect(AF_UNSPEC), which throws away the unsent data and the page
+ * references along with it, and then wait for the completions of that.
+ * The fd stays open, so the error queue can still be read.
+ *
+ * Should those never come, we give up after WRW_ZC_PURGE seconds rather
+ * than pin the worker for good.  The kernel keeps its own references on
+ * the pages, and the connection is gone, so whatever ends up in them
+ * after we let go of the storage is never sent.
+ */
+
+#define WRW_ZC_PURGE	1.0
+
+static void
+wrw_ZeroCopyAbort(struct worker *w, const char *why)
+{
+	struct sockaddr sa;
+
+	WSL(w, SLT_Debug, *w->wrw.wfd,
+	    "Zerocopy %s, %u pending, aborting connection",
+	    why, w->wrw.zcsent);
+	memset(&sa, 0, sizeof sa);
+	sa.sa_family = AF_UNSPEC;
+	(void)connect(*w->wrw.wfd, &sa, sizeof sa);
+	w->wrw.werr++;
+}
+
+static void
+wrw_ZeroCopyWait(struct worker *w)
+{
+	struct wrw *wrw;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err serr;
+	struct pollfd pfd;
+	char cbuf[CMSG_SPACE(sizeof serr) * 4];
+	double t, t_abort = 0.;
+	unsigned n;
+	int i;
+
+	CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+	wrw = &w->wrw;
+	AN(wrw->wfd);
+	while (wrw->zcsent > 0) {
+		memset(&msg, 0, sizeof msg);
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof cbuf;
+		i = recvmsg(*wrw->wfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+		if (i < 0 && errno == EINTR)
+			continue;
+		if (i < 0) {
+			if (errno != EAGAIN && t_abort == 0.) {
+				wrw_ZeroCopyAbort(w, strerror(errno));
+				t_abort = TIM_real();
+			}
+			t = params->send_timeout - (TIM_real() - w->sp->t_resp);
+			if (t <= 0. && t_abort == 0.) {
+				wrw_ZeroCopyAbort(w, "send timeout");
+				t_abort = TIM_real();
+			}
+			if (t_abort != 0.) {
+				t = WRW_ZC_PURGE - (TIM_real() - t_abort);
+				if (t <= 0.) {
+					WSL(w, SLT_Debug, *wrw->wfd,
+					    "Zerocopy gave up on %u completions",
+					    wrw->zcsent);
+					wrw->zcsent = 0;
+					break;
+				}
+			}
+			memset(&pfd, 0, sizeof pfd);
+			pfd.fd = *wrw->wfd;
+			/* The error queue signals POLLERR, no need to ask */
+			if (poll(&pfd, 1, (int)(t * 1e3) + 1) > 0 &&
+			    !(pfd.revents & POLLERR))
+				/* Connection gone, wait for the purge */
+				TIM_sleep(0.001);
+			continue;
+		}
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+		    cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm->cmsg_level == SOL_IP &&
+			    cm->cmsg_type == IP_RECVERR) ||
+			    (cm->cmsg_level == SOL_IPV6 &&
+			    cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+			memcpy(&serr, CMSG_DATA(cm), sizeof serr);
+			if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/* ee_info..ee_data is the range of sends completed */
+			n = serr.ee_data - serr.ee_info + 1;
+			if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				w->stats.s_wrw_zccopied += n;
+			wrw->zcsent -= n > wrw->zcsent ? wrw->zcsent : n;
+		}
+	}
+}
+#endif /* ZEROCOPY_WORKS */
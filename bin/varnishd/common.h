@@ -36,6 +36,9 @@ extern pid_t mgt_pid;
 /* cache_acceptor.c */
 void VCA_tweak_waiter(struct cli *cli, const char *arg);
 
+/* hash_digest.c */
+void HSH_tweak_digest(struct cli *cli, const char *arg);
+
 /* mgt_shmem.c */
 extern struct VSC_C_main *VSC_C_main;
 
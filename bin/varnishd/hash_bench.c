@@ -0,0 +1,453 @@
+/*-
+ * Copyright (c) 2011 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Multithreaded micro-benchmark of the hash slingers.
+ *
+ * The slingers are linked in with just enough of the cache process
+ * stubbed out to run them, and each of them is hammered with lookups
+ * and derefs from a number of threads.  A fraction of the keys is held
+ * referenced for the duration, so lookups on those are hits, while the
+ * rest are inserted and deleted all the time.
+ *
+ * Each slinger runs in its own process, as they keep global state.
+ *
+ * Before that, the digest functions are timed on what vcl_hash feeds
+ * them for a request with the default VCL: the URL and the Host: header.
+ *
+ * Usage: hash_bench [-k keys] [-m miss-percent] [-n threads] [-t seconds]
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "hash_slinger.h"
+#include "vsha256.h"
+#include "hash_digest.h"
+
+static const char * const hb_modes[] = {
+	"classic",
+	"critbit",
+	"critbit,lockfree",
+	NULL
+};
+
+static unsigned			hb_nkey = 100000;
+static unsigned			hb_miss = 10;
+static unsigned			hb_nthr = 8;
+static double			hb_time = 1.0;
+
+static const struct hb_hashfunc {
+	const struct hsh_digest	*hd;
+	int			accel;
+} hb_hashfuncs[] = {
+	{ &hsd_sha256,	0 },
+	{ &hsd_sha256,	1 },
+	{ &hsd_murmur3,	0 },
+	{ NULL,		0 }
+};
+
+static const struct hash_slinger *hb_slinger;
+static unsigned char		(*hb_digest)[DIGEST_LEN];
+static volatile unsigned	hb_stop;
+
+/*--------------------------------------------------------------------
+ * The bits of the cache process the slingers need
+ */
+
+struct VSC_C_main		*VSC_C_main;
+volatile struct params		*params;
+
+#define LOCK(nam) struct VSC_C_lck *lck_##nam;
+#include "locks.h"
+#undef LOCK
+
+struct hb_lck {
+	pthread_mutex_t		mtx;
+	pthread_t		owner;
+	int			held;
+};
+
+void
+Lck__Lock(struct lock *lck, const char *p, const char *f, int l)
+{
+	struct hb_lck *hl = lck->priv;
+
+	(void)p; (void)f; (void)l;
+	AZ(pthread_mutex_lock(&hl->mtx));
+	hl->owner = pthread_self();
+	hl->held = 1;
+}
+
+void
+Lck__Unlock(struct lock *lck, const char *p, const char *f, int l)
+{
+	struct hb_lck *hl = lck->priv;
+
+	(void)p; (void)f; (void)l;
+	hl->held = 0;
+	AZ(pthread_mutex_unlock(&hl->mtx));
+}
+
+void
+Lck__Assert(const struct lock *lck, int held)
+{
+	const struct hb_lck *hl = lck->priv;
+
+	if (held)
+		assert(hl->held && pthread_equal(hl->owner, pthread_self()));
+}
+
+void
+Lck__New(struct lock *lck, struct VSC_C_lck *st, const char *w)
+{
+	struct hb_lck *hl;
+
+	(void)st;
+	(void)w;
+	hl = calloc(sizeof *hl, 1);
+	XXXAN(hl);
+	AZ(pthread_mutex_init(&hl->mtx, NULL));
+	lck->priv = hl;
+}
+
+void
+Lck_Delete(struct lock *lck)
+{
+	struct hb_lck *hl = lck->priv;
+
+	AZ(pthread_mutex_destroy(&hl->mtx));
+	free(hl);
+	lck->priv = NULL;
+}
+
+void
+CLI_AddFuncs(struct cli_proto *p)
+{
+	(void)p;
+}
+
+void
+THR_SetName(const char *name)
+{
+	(void)name;
+}
+
+void
+WRK_SumStat(struct worker *w)
+{
+	(void)w;
+}
+
+void
+HSH_DeleteObjHead(struct worker *w, struct objhead *oh)
+{
+
+	(void)w;
+	AZ(oh->refcnt);
+	Lck_Delete(&oh->mtx);
+	FREE_OBJ(oh);
+}
+
+/*--------------------------------------------------------------------
+ * Time the digest step of a request, the way HSH_AddString() feeds it.
+ */
+
+#define HB_NURL		1024
+
+static void
+hb_hashfunc(const struct hb_hashfunc *hf)
+{
+	static char url[HB_NURL][64];
+	static const char host[] = "www.example.com";
+	struct hsh_ctx ctx;
+	unsigned char digest[DIGEST_LEN];
+	const char *impl = "";
+	unsigned u, n = 0;
+	double t0, t1;
+
+	for (u = 0; u < HB_NURL; u++)
+		(void)snprintf(url[u], sizeof url[u],
+		    "/static/img/product/%u/thumb_120x90.jpg?v=%u", u * 7919, u);
+
+	if (hf->hd == &hsd_sha256)
+		impl = SHA256_Select(hf->accel);
+	t0 = TIM_mono();
+	do {
+		for (u = 0; u < HB_NURL; u++) {
+			hf->hd->init(&ctx);
+			hf->hd->update(&ctx, url[u], strlen(url[u]));
+			hf->hd->update(&ctx, "#", 1);
+			hf->hd->update(&ctx, host, sizeof host - 1);
+			hf->hd->update(&ctx, "#", 1);
+			hf->hd->final(&ctx, digest);
+		}
+		n += HB_NURL;
+		t1 = TIM_mono();
+	} while (t1 - t0 < hb_time);
+	printf("%-8s %-8s %8.1f ns/req\n", hf->hd->name, impl,
+	    (t1 - t0) / n * 1e9);
+	(void)SHA256_Select(1);
+}
+
+/*--------------------------------------------------------------------*/
+
+static struct objhead *
+hb_newobjhead(void)
+{
+	struct objhead *oh;
+
+	ALLOC_OBJ(oh, OBJHEAD_MAGIC);
+	XXXAN(oh);
+	oh->refcnt = 1;
+	VTAILQ_INIT(&oh->objcs);
+	Lck_New(&oh->mtx, lck_objhdr);
+	return (oh);
+}
+
+static struct objhead *
+hb_lookup(struct sess *sp, unsigned k, struct objhead **noh)
+{
+	struct objhead *oh;
+
+	if (hb_slinger->prep != NULL)
+		hb_slinger->prep(sp);
+	if (*noh == NULL)
+		*noh = hb_newobjhead();
+	memcpy((*noh)->digest, hb_digest[k], DIGEST_LEN);
+	oh = hb_slinger->lookup(sp, *noh);
+	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
+	AZ(memcmp(oh->digest, hb_digest[k], DIGEST_LEN));
+	if (oh == *noh)
+		*noh = NULL;
+	return (oh);
+}
+
+static void
+hb_deref(struct objhead *oh)
+{
+
+	if (!hb_slinger->deref(oh))
+		HSH_DeleteObjHead(NULL, oh);
+}
+
+struct hb_thread {
+	pthread_t		tp;
+	struct worker		wrk;
+	struct sess		sess;
+	uint64_t		nops;
+};
+
+static void *
+hb_thread(void *priv)
+{
+	struct hb_thread *ht;
+	struct objhead *oh, *noh = NULL;
+	uint32_t x;
+	unsigned k, npin;
+
+	ht = priv;
+	x = (uint32_t)(uintptr_t)ht | 1;
+	npin = hb_nkey - hb_nkey * hb_miss / 100;
+	while (!hb_stop) {
+		/* xorshift32 */
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		k = x % hb_nkey;
+		oh = hb_lookup(&ht->sess, k, &noh);
+		if (k < npin)
+			assert(oh->refcnt > 1);
+		hb_deref(oh);
+		ht->nops++;
+	}
+	if (noh != NULL) {
+		noh->refcnt = 0;
+		HSH_DeleteObjHead(NULL, noh);
+	}
+	return (NULL);
+}
+
+static void
+hb_run(const char *mode)
+{
+	char **av;
+	int ac;
+	unsigned u, n, npin;
+	struct hb_thread *ht;
+	struct objhead **pin, *noh = NULL;
+	uint64_t nops, nb;
+	double t0, t1;
+
+	av = VAV_Parse(mode, NULL, ARGV_COMMA);
+	AN(av);
+	AZ(av[0]);
+	for (ac = 0; av[ac + 2] != NULL; ac++)
+		continue;
+	if (!strcmp(av[1], "classic"))
+		hb_slinger = &hcl_slinger;
+	else
+		hb_slinger = &hcb_slinger;
+	if (hb_slinger->init != NULL)
+		hb_slinger->init(ac, av + 2);
+	hb_slinger->start();
+
+	ht = calloc(sizeof *ht, hb_nthr);
+	XXXAN(ht);
+	for (u = 0; u < hb_nthr; u++) {
+		ht[u].wrk.magic = WORKER_MAGIC;
+		ht[u].sess.magic = SESS_MAGIC;
+		ht[u].sess.wrk = &ht[u].wrk;
+	}
+
+	npin = hb_nkey - hb_nkey * hb_miss / 100;
+	pin = calloc(sizeof *pin, npin);
+	XXXAN(pin);
+	for (u = 0; u < npin; u++)
+		pin[u] = hb_lookup(&ht[0].sess, u, &noh);
+
+	n = 1;
+	while (1) {
+		hb_stop = 0;
+		nb = VSC_C_main->hcl_nbucket;
+		memset(VSC_C_main, 0, sizeof *VSC_C_main);
+		VSC_C_main->hcl_nbucket = nb;
+		t0 = TIM_mono();
+		for (u = 0; u < n; u++) {
+			ht[u].nops = 0;
+			AZ(pthread_create(&ht[u].tp, NULL, hb_thread, &ht[u]));
+		}
+		TIM_sleep(hb_time);
+		hb_stop = 1;
+		nops = 0;
+		for (u = 0; u < n; u++) {
+			AZ(pthread_join(ht[u].tp, NULL));
+			nops += ht[u].nops;
+		}
+		t1 = TIM_mono();
+		printf("%-18s %3u thr %8.3f Mops/s", mode, n,
+		    nops / (t1 - t0) * 1e-6);
+		if (hb_slinger == &hcl_slinger)
+			printf("  grow %ju buckets %ju\n",
+			    (uintmax_t)VSC_C_main->hcl_grow,
+			    (uintmax_t)VSC_C_main->hcl_nbucket);
+		else
+			printf("  insert %ju retry %ju conflict %ju\n",
+			    (uintmax_t)VSC_C_main->hcb_insert,
+			    (uintmax_t)VSC_C_main->hcb_retry,
+			    (uintmax_t)VSC_C_main->hcb_conflict);
+		if (n == hb_nthr)
+			break;
+		n = n * 2 < hb_nthr ? n * 2 : hb_nthr;
+	}
+
+	for (u = 0; u < npin; u++)
+		hb_deref(pin[u]);
+}
+
+int
+main(int argc, char * const *argv)
+{
+	SHA256_CTX ctx;
+	char buf[32];
+	unsigned u;
+	int i, status, ec = 0;
+	pid_t pid;
+
+	while ((i = getopt(argc, argv, "k:m:n:t:")) != -1) {
+		switch (i) {
+		case 'k':
+			hb_nkey = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			hb_miss = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			hb_nthr = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			hb_time = strtod(optarg, NULL);
+			break;
+		default:
+			fprintf(stderr, "Usage: hash_bench [-k keys] "
+			    "[-m miss-percent] [-n threads] [-t seconds]\n");
+			exit(2);
+		}
+	}
+	if (hb_nkey == 0 || hb_miss > 100 || hb_nthr == 0 || hb_time <= 0) {
+		fprintf(stderr, "Bad arguments\n");
+		exit(2);
+	}
+
+	VSC_C_main = calloc(sizeof *VSC_C_main, 1);
+	XXXAN(VSC_C_main);
+	params = calloc(sizeof *params, 1);
+	XXXAN(params);
+	/* Keep the locked critbit from sitting on too much memory */
+	params->critbit_cooloff = 0.5;
+	params->classic_load_factor = 4;
+#define LOCK(nam)						\
+	lck_##nam = calloc(sizeof *lck_##nam, 1);		\
+	XXXAN(lck_##nam);
+#include "locks.h"
+#undef LOCK
+
+	/* The URLs are "/<n>", hashed like vcl_hash would with no host */
+	hb_digest = calloc(sizeof *hb_digest, hb_nkey);
+	XXXAN(hb_digest);
+	for (u = 0; u < hb_nkey; u++) {
+		SHA256_Init(&ctx);
+		(void)snprintf(buf, sizeof buf, "/%u", u);
+		SHA256_Update(&ctx, buf, strlen(buf));
+		SHA256_Update(&ctx, "#", 1);
+		SHA256_Final(hb_digest[u], &ctx);
+	}
+
+	setbuf(stdout, NULL);
+	for (u = 0; hb_hashfuncs[u].hd != NULL; u++)
+		hb_hashfunc(&hb_hashfuncs[u]);
+	for (u = 0; hb_modes[u] != NULL; u++) {
+		pid = fork();
+		assert(pid >= 0);
+		if (pid == 0) {
+			hb_run(hb_modes[u]);
+			exit(0);
+		}
+		assert(waitpid(pid, &status, 0) == pid);
+		if (status != 0) {
+			printf("%s: failed (status 0x%x)\n",
+			    hb_modes[u], status);
+			ec = 1;
+		}
+	}
+	return (ec);
+}
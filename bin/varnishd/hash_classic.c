@@ -39,17 +39,50 @@
 #include "cache.h"
 #include "hash_slinger.h"
 
-/*--------------------------------------------------------------------*/
+/*--------------------------------------------------------------------
+ * The table grows by doubling when the number of objheads exceeds
+ * classic_load_factor per bucket.  While it grows there are two tables,
+ * and the buckets of the old one are moved to the new one a few at a
+ * time, by the lookups that come along.
+ *
+ * Growing by doubling means that a key in bucket i of the old table
+ * ends up in bucket i or i + n of the new one, so if the number of
+ * locks divides the size of both tables, the same lock covers the key
+ * in either table.  We keep the locks from the initial table around
+ * for this, and stripe the buckets of later tables over them.
+ *
+ * Swapping tables takes all the locks, so holding the lock for a key
+ * is enough to look at hcl_cur and hcl_old.
+ */
 
 struct hcl_hd {
 	unsigned		magic;
 #define HCL_HEAD_MAGIC		0x0f327016
 	VTAILQ_HEAD(, objhead)	head;
-	struct lock		mtx;
 };
 
+struct hcl_tbl {
+	unsigned		magic;
+#define HCL_TBL_MAGIC		0x57d1c3a8
+	unsigned		nhash;
+	struct hcl_hd		*head;
+};
+
+/* Buckets moved from the old table per lookup while growing */
+#define HCL_MIGRATE		4
+
 static unsigned			hcl_nhash = 16383;
-static struct hcl_hd		*hcl_head;
+static struct lock		*hcl_lck;
+
+static struct hcl_tbl		*hcl_cur;
+static struct hcl_tbl		*hcl_old;
+
+/* Protects the fields below, nests inside the hcl_lck's */
+static struct lock		hcl_mtx;
+static unsigned			hcl_nobj;
+static unsigned			hcl_growing;
+static unsigned			hcl_mig;
+static unsigned			hcl_ndone;
 
 /*--------------------------------------------------------------------
  * The ->init method allows the management process to pass arguments
@@ -82,6 +115,178 @@ hcl_init(int ac, char * const *av)
 	return;
 }
 
+/*--------------------------------------------------------------------*/
+
+static struct hcl_tbl *
+hcl_newtbl(unsigned nhash)
+{
+	struct hcl_tbl *tp;
+	unsigned u;
+
+	ALLOC_OBJ(tp, HCL_TBL_MAGIC);
+	XXXAN(tp);
+	tp->nhash = nhash;
+	tp->head = calloc(sizeof *tp->head, nhash);
+	XXXAN(tp->head);
+	for (u = 0; u < nhash; u++) {
+		VTAILQ_INIT(&tp->head[u].head);
+		tp->head[u].magic = HCL_HEAD_MAGIC;
+	}
+	return (tp);
+}
+
+static unsigned
+hcl_digest(const struct objhead *oh)
+{
+	unsigned digest;
+
+	assert(sizeof oh->digest > sizeof digest);
+	memcpy(&digest, oh->digest, sizeof digest);
+	return (digest);
+}
+
+static void
+hcl_lockall(void)
+{
+	unsigned u;
+
+	for (u = 0; u < hcl_nhash; u++)
+		Lck_Lock(&hcl_lck[u]);
+	Lck_Lock(&hcl_mtx);
+}
+
+static void
+hcl_unlockall(void)
+{
+	unsigned u;
+
+	Lck_Unlock(&hcl_mtx);
+	for (u = 0; u < hcl_nhash; u++)
+		Lck_Unlock(&hcl_lck[u]);
+}
+
+/*--------------------------------------------------------------------
+ * Move bucket u of the old table to the new table.  The two buckets it
+ * splits into cannot have been used yet, since a lookup always moves
+ * its old bucket before touching the new table.  The caller holds the
+ * lock for the bucket.
+ */
+
+static void
+hcl_migrate(unsigned u)
+{
+	struct hcl_hd *op, *np[2];
+	struct objhead *oh;
+
+	CHECK_OBJ_NOTNULL(hcl_old, HCL_TBL_MAGIC);
+	assert(u < hcl_old->nhash);
+	op = &hcl_old->head[u];
+	if (VTAILQ_EMPTY(&op->head))
+		return;
+	np[0] = &hcl_cur->head[u];
+	np[1] = &hcl_cur->head[u + hcl_old->nhash];
+	assert(VTAILQ_EMPTY(&np[0]->head));
+	assert(VTAILQ_EMPTY(&np[1]->head));
+	while (!VTAILQ_EMPTY(&op->head)) {
+		oh = VTAILQ_FIRST(&op->head);
+		VTAILQ_REMOVE(&op->head, oh, hoh_list);
+		/* Keeps the digest order, as we append in that order */
+		if (hcl_digest(oh) % hcl_cur->nhash == u) {
+			oh->hoh_head = np[0];
+		} else {
+			assert(hcl_digest(oh) % hcl_cur->nhash ==
+			    u + hcl_old->nhash);
+			oh->hoh_head = np[1];
+		}
+		VTAILQ_INSERT_TAIL(&((struct hcl_hd *)oh->hoh_head)->head,
+		    oh, hoh_list);
+	}
+}
+
+/*--------------------------------------------------------------------
+ * Move the next few buckets of the old table, and retire it once they
+ * have all been moved.
+ */
+
+static void
+hcl_rehash(void)
+{
+	struct hcl_tbl *tp;
+	unsigned u, n, e;
+
+	Lck_Lock(&hcl_mtx);
+	tp = hcl_old;
+	if (tp == NULL || hcl_mig >= tp->nhash) {
+		Lck_Unlock(&hcl_mtx);
+		return;
+	}
+	u = hcl_mig;
+	e = u + HCL_MIGRATE;
+	if (e > tp->nhash)
+		e = tp->nhash;
+	hcl_mig = e;
+	Lck_Unlock(&hcl_mtx);
+
+	/* Nobody retires tp until we have done our part */
+	for (n = u; n < e; n++) {
+		Lck_Lock(&hcl_lck[n % hcl_nhash]);
+		hcl_migrate(n);
+		Lck_Unlock(&hcl_lck[n % hcl_nhash]);
+	}
+
+	Lck_Lock(&hcl_mtx);
+	hcl_ndone += e - u;
+	n = (hcl_ndone == tp->nhash);
+	Lck_Unlock(&hcl_mtx);
+	if (!n)
+		return;
+
+	hcl_lockall();
+	assert(hcl_old == tp);
+	hcl_old = NULL;
+	hcl_unlockall();
+	for (u = 0; u < tp->nhash; u++)
+		assert(VTAILQ_EMPTY(&tp->head[u].head));
+	free(tp->head);
+	FREE_OBJ(tp);
+}
+
+/*--------------------------------------------------------------------
+ * Count objheads in and out, and start growing the table if we are
+ * above the load factor.
+ */
+
+static void
+hcl_count(int i)
+{
+	struct hcl_tbl *tp;
+	unsigned lf, grow = 0;
+
+	lf = params->classic_load_factor;
+	Lck_Lock(&hcl_mtx);
+	hcl_nobj += i;
+	if (i > 0 && lf > 0 && hcl_old == NULL && !hcl_growing &&
+	    hcl_nobj / lf > hcl_cur->nhash && hcl_cur->nhash <= UINT_MAX / 2) {
+		hcl_growing = 1;
+		grow = hcl_cur->nhash * 2;
+	}
+	Lck_Unlock(&hcl_mtx);
+	if (!grow)
+		return;
+
+	tp = hcl_newtbl(grow);
+	hcl_lockall();
+	AZ(hcl_old);
+	hcl_old = hcl_cur;
+	hcl_cur = tp;
+	hcl_mig = 0;
+	hcl_ndone = 0;
+	hcl_growing = 0;
+	VSC_C_main->hcl_grow++;
+	VSC_C_main->hcl_nbucket = tp->nhash;
+	hcl_unlockall();
+}
+
 /*--------------------------------------------------------------------
  * The ->start method is called during cache process start and allows
  * initialization to happen before the first lookup.
@@ -92,14 +297,13 @@ hcl_start(void)
 {
 	unsigned u;
 
-	hcl_head = calloc(sizeof *hcl_head, hcl_nhash);
-	XXXAN(hcl_head);
-
-	for (u = 0; u < hcl_nhash; u++) {
-		VTAILQ_INIT(&hcl_head[u].head);
-		Lck_New(&hcl_head[u].mtx, lck_hcl);
-		hcl_head[u].magic = HCL_HEAD_MAGIC;
-	}
+	hcl_lck = calloc(sizeof *hcl_lck, hcl_nhash);
+	XXXAN(hcl_lck);
+	for (u = 0; u < hcl_nhash; u++)
+		Lck_New(&hcl_lck[u], lck_hcl);
+	Lck_New(&hcl_mtx, lck_hcl);
+	hcl_cur = hcl_newtbl(hcl_nhash);
+	VSC_C_main->hcl_nbucket = hcl_nhash;
 }
 
 /*--------------------------------------------------------------------
@@ -116,18 +320,20 @@ hcl_lookup(const struct sess *sp, struct objhead *noh)
 {
 	struct objhead *oh;
 	struct hcl_hd *hp;
-	unsigned u1, digest;
+	struct lock *lp;
+	unsigned digest;
 	int i;
 
 	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
 	CHECK_OBJ_NOTNULL(noh, OBJHEAD_MAGIC);
 
-	assert(sizeof noh->digest > sizeof digest);
-	memcpy(&digest, noh->digest, sizeof digest);
-	u1 = digest % hcl_nhash;
-	hp = &hcl_head[u1];
+	digest = hcl_digest(noh);
+	lp = &hcl_lck[digest % hcl_nhash];
 
-	Lck_Lock(&hp->mtx);
+	Lck_Lock(lp);
+	if (hcl_old != NULL)
+		hcl_migrate(digest % hcl_old->nhash);
+	hp = &hcl_cur->head[digest % hcl_cur->nhash];
 	VTAILQ_FOREACH(oh, &hp->head, hoh_list) {
 		i = memcmp(oh->digest, noh->digest, sizeof oh->digest);
 		if (i < 0)
@@ -135,7 +341,10 @@ hcl_lookup(const struct sess *sp, struct objhead *noh)
 		if (i > 0)
 			break;
 		oh->refcnt++;
-		Lck_Unlock(&hp->mtx);
+		i = (hcl_old != NULL);
+		Lck_Unlock(lp);
+		if (i)
+			hcl_rehash();
 		return (oh);
 	}
 
@@ -146,7 +355,11 @@ hcl_lookup(const struct sess *sp, struct objhead *noh)
 
 	noh->hoh_head = hp;
 
-	Lck_Unlock(&hp->mtx);
+	i = (hcl_old != NULL);
+	Lck_Unlock(lp);
+	if (i)
+		hcl_rehash();
+	hcl_count(1);
 	return (noh);
 }
 
@@ -158,18 +371,23 @@ static int
 hcl_deref(struct objhead *oh)
 {
 	struct hcl_hd *hp;
+	struct lock *lp;
 	int ret;
 
 	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
-	CAST_OBJ_NOTNULL(hp, oh->hoh_head, HCL_HEAD_MAGIC);
 	assert(oh->refcnt > 0);
-	Lck_Lock(&hp->mtx);
+	lp = &hcl_lck[hcl_digest(oh) % hcl_nhash];
+	Lck_Lock(lp);
+	/* Look at hoh_head under the lock, it changes when migrated */
+	CAST_OBJ_NOTNULL(hp, oh->hoh_head, HCL_HEAD_MAGIC);
 	if (--oh->refcnt == 0) {
 		VTAILQ_REMOVE(&hp->head, oh, hoh_list);
 		ret = 0;
 	} else
 		ret = 1;
-	Lck_Unlock(&hp->mtx);
+	Lck_Unlock(lp);
+	if (ret == 0)
+		hcl_count(-1);
 	return (ret);
 }
 
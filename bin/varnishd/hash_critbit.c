@@ -34,6 +34,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cache.h"
 #include "hash_slinger.h"
@@ -83,6 +84,9 @@ hcb_build_bittbl(void)
  * low two bits to tell them apart, assuming that Varnish will never
  * run on machines with less than 32bit alignment.
  *
+ * In lockfree mode, the third bit marks a pointer in a y which is about
+ * to be deleted, which assumes malloc(3) hands out 64bit aligned memory.
+ *
  * Asserts will explode if these assumptions are not met.
  */
 
@@ -98,6 +102,7 @@ struct hcb_y {
 
 #define HCB_BIT_NODE		(1<<0)
 #define HCB_BIT_Y		(1<<1)
+#define HCB_BIT_FROZEN		(1<<2)
 
 struct hcb_root {
 	volatile uintptr_t	origo;
@@ -110,6 +115,16 @@ static VSTAILQ_HEAD(, hcb_y)	dead_y = VSTAILQ_HEAD_INITIALIZER(dead_y);
 static VTAILQ_HEAD(, objhead)	cool_h = VTAILQ_HEAD_INITIALIZER(cool_h);
 static VTAILQ_HEAD(, objhead)	dead_h = VTAILQ_HEAD_INITIALIZER(dead_h);
 
+static unsigned			hcb_lockfree;
+
+#ifdef HAVE_SYNC_BUILTINS
+#define HCB_CAS(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define HCB_ADD(p, n)		((void)__sync_fetch_and_add(p, n))
+#else
+#define HCB_CAS(p, o, n)	(abort(), 0)
+#define HCB_ADD(p, n)		abort()
+#endif
+
 /*---------------------------------------------------------------------
  * Pointer accessor functions
  */
@@ -162,6 +177,13 @@ hcb_l_y(uintptr_t u)
 	return ((struct hcb_y *)(u & ~HCB_BIT_Y));
 }
 
+static uintptr_t
+hcb_load(const volatile uintptr_t *p)
+{
+
+	return (*p & ~HCB_BIT_FROZEN);
+}
+
 /*---------------------------------------------------------------------
  * Find the "critical" bit that separates these two digests
  */
@@ -296,6 +318,244 @@ hcb_delete(struct hcb_root *r, struct objhead *oh)
 	}
 }
 
+/*---------------------------------------------------------------------
+ * Epoch based reclamation for the lockfree mode.
+ *
+ * Readers announce themselves in one of HCB_NSLOT counters, picked by
+ * their address, against the parity of the current epoch.  Before it
+ * frees anything the cleaner flips the epoch and waits for the counters
+ * of the old parity to drain, after which no reader can hold a pointer
+ * to what was unlinked before the flip.
+ */
+
+#define HCB_NSLOT		64
+
+struct hcb_slot {
+	volatile unsigned	n[2];
+	char			pad[64 - 2 * sizeof(unsigned)];
+};
+
+static struct hcb_slot		hcb_slot[HCB_NSLOT];
+static volatile unsigned	hcb_epoch;
+
+static volatile unsigned *
+hcb_enter(const void *who)
+{
+	volatile unsigned *n;
+	unsigned e, u;
+
+	/* Workers sit at the same offset on their stacks, mix it up */
+	u = ((uint32_t)((uintptr_t)who >> 4) * 2654435761U) >> 26;
+	while (1) {
+		e = hcb_epoch;
+		n = &hcb_slot[u % HCB_NSLOT].n[e & 1];
+		HCB_ADD(n, 1);
+		if (hcb_epoch == e)
+			break;
+		/* The cleaner flipped the epoch under us */
+		HCB_ADD(n, -1);
+	}
+	VRMB();
+	return (n);
+}
+
+static void
+hcb_leave(volatile unsigned *n)
+{
+
+	HCB_ADD(n, -1);
+}
+
+static void
+hcb_synchronize(void)
+{
+	unsigned e, u;
+
+	e = hcb_epoch;
+	HCB_ADD(&hcb_epoch, 1);
+	for (u = 0; u < HCB_NSLOT; u++)
+		while (hcb_slot[u].n[e & 1] != 0)
+			TIM_sleep(0.001);
+}
+
+/*---------------------------------------------------------------------
+ * Lockfree insert: find the spot the same way hcb_insert() does, and
+ * swing the parent pointer over to the new y with a CAS.  If the tree
+ * changed under us, the CAS fails and we start over from the top.
+ *
+ * The node we took the critbit from may have been deleted in the
+ * meantime, so before the CAS we check that the keys under the spot
+ * still differ from ours exactly at that bit.
+ *
+ * Must be called between hcb_enter() and hcb_leave().
+ */
+
+static int
+hcb_fits(uintptr_t pp, const struct objhead *oh, const struct hcb_y *y2)
+{
+	const struct hcb_y *y;
+	const struct objhead *oh2;
+	unsigned u;
+
+	while (hcb_is_y(pp)) {
+		y = hcb_l_y(pp & ~HCB_BIT_FROZEN);
+		CHECK_OBJ_NOTNULL(y, HCB_Y_MAGIC);
+		assert(y->ptr < DIGEST_LEN);
+		u = (oh->digest[y->ptr] & y->bitmask) != 0;
+		pp = hcb_load(&y->leaf[u]);
+	}
+	oh2 = hcb_l_node(pp & ~HCB_BIT_FROZEN);
+	CHECK_OBJ_NOTNULL(oh2, OBJHEAD_MAGIC);
+	for (u = 0; u < y2->ptr; u++)
+		if (oh->digest[u] != oh2->digest[u])
+			return (0);
+	return (hcb_bits(oh->digest[u], oh2->digest[u]) ==
+	    y2->critbit - u * 8);
+}
+
+static struct objhead *
+hcb_insert_lf(struct worker *wrk, struct hcb_root *root, struct objhead *oh)
+{
+	volatile uintptr_t *p;
+	uintptr_t pp;
+	struct hcb_y *y, *y2;
+	struct objhead *oh2;
+	unsigned s, s2;
+
+	while (1) {
+		p = &root->origo;
+		pp = *p;
+		if (pp == 0) {
+			if (HCB_CAS(p, 0, hcb_r_node(oh)))
+				return (oh);
+			VSC_C_main->hcb_conflict++;
+			continue;
+		}
+
+		while(hcb_is_y(pp)) {
+			y = hcb_l_y(pp);
+			CHECK_OBJ_NOTNULL(y, HCB_Y_MAGIC);
+			assert(y->ptr < DIGEST_LEN);
+			s = (oh->digest[y->ptr] & y->bitmask) != 0;
+			assert(s < 2);
+			pp = hcb_load(&y->leaf[s]);
+		}
+		assert(hcb_is_node(pp));
+
+		/* We found a node, does it match ? */
+		oh2 = hcb_l_node(pp);
+		CHECK_OBJ_NOTNULL(oh2, OBJHEAD_MAGIC);
+		if (!memcmp(oh2->digest, oh->digest, DIGEST_LEN))
+			return (oh2);
+
+		/* Insert */
+
+		CAST_OBJ_NOTNULL(y2, wrk->nhashpriv, HCB_Y_MAGIC);
+		(void)hcb_crit_bit(oh, oh2, y2);
+		s2 = (oh->digest[y2->ptr] & y2->bitmask) != 0;
+		assert(s2 < 2);
+		y2->leaf[s2] = hcb_r_node(oh);
+		s2 = 1-s2;
+
+		p = &root->origo;
+		pp = *p;
+		y = NULL;
+		while(hcb_is_y(pp) && !(pp & HCB_BIT_FROZEN)) {
+			y = hcb_l_y(pp);
+			CHECK_OBJ_NOTNULL(y, HCB_Y_MAGIC);
+			if (y->critbit >= y2->critbit)
+				break;
+			assert(y->ptr < DIGEST_LEN);
+			s = (oh->digest[y->ptr] & y->bitmask) != 0;
+			assert(s < 2);
+			p = &y->leaf[s];
+			pp = *p;
+			y = NULL;
+		}
+
+		/*
+		 * If somebody got a key with our critbit in first, the spot
+		 * is in a y being deleted or the keys under it are not what
+		 * we thought, we go around again.
+		 */
+		if (pp != 0 && !(pp & HCB_BIT_FROZEN) &&
+		    (y == NULL || y->critbit != y2->critbit) &&
+		    hcb_fits(pp, oh, y2)) {
+			y2->leaf[s2] = pp;
+			if (HCB_CAS(p, pp, hcb_r_y(y2))) {
+				wrk->nhashpriv = NULL;
+				return (oh);
+			}
+		}
+		VSC_C_main->hcb_conflict++;
+		if (hcb_load(p) != *p) {
+			/* Rather than spin, wait for the delete to finish */
+			Lck_Lock(&hcb_mtx);
+			Lck_Unlock(&hcb_mtx);
+		}
+	}
+}
+
+/*---------------------------------------------------------------------
+ * Lockfree delete.  Deletes are still serialized on hcb_mtx, but run
+ * concurrently with lockfree inserts.  Both pointers of the y holding
+ * our node are frozen before it is unlinked, so that no insert can
+ * hide under it while its other pointer is copied up into the parent.
+ */
+
+static void
+hcb_thaw(struct hcb_y *y)
+{
+
+	y->leaf[0] = hcb_load(&y->leaf[0]);
+	y->leaf[1] = hcb_load(&y->leaf[1]);
+}
+
+static void
+hcb_delete_lf(struct hcb_root *r, struct objhead *oh)
+{
+	struct hcb_y *y;
+	volatile uintptr_t *p;
+	uintptr_t pp, n;
+	unsigned s, u;
+
+	Lck_AssertHeld(&hcb_mtx);
+	n = hcb_r_node(oh);
+	while (1) {
+		p = &r->origo;
+		pp = *p;
+		if (pp == n) {
+			if (HCB_CAS(p, n, 0))
+				return;
+			continue;
+		}
+		while (1) {
+			y = hcb_l_y(pp);
+			CHECK_OBJ_NOTNULL(y, HCB_Y_MAGIC);
+			assert(y->ptr < DIGEST_LEN);
+			s = (oh->digest[y->ptr] & y->bitmask) != 0;
+			assert(s < 2);
+			if (y->leaf[s] == n)
+				break;
+			p = &y->leaf[s];
+			pp = *p;
+		}
+
+		for (u = 0; u < 2; u++) {
+			do
+				pp = y->leaf[u];
+			while (!HCB_CAS(&y->leaf[u], pp, pp | HCB_BIT_FROZEN));
+		}
+		/* An insert may have put a new y in over our node or y */
+		if (hcb_load(&y->leaf[s]) == n &&
+		    HCB_CAS(p, hcb_r_y(y), hcb_load(&y->leaf[1 - s]))) {
+			VSTAILQ_INSERT_TAIL(&cool_y, y, list);
+			return;
+		}
+		hcb_thaw(y);
+	}
+}
+
 /*--------------------------------------------------------------------*/
 
 static void
@@ -321,7 +581,7 @@ dumptree(struct cli *cli, uintptr_t p, int indent)
 	    y->critbit, y->ptr, y->bitmask, indent / 2);
 	indent += 2;
 	for (i = 0; i < 2; i++)
-		dumptree(cli, y->leaf[i], indent);
+		dumptree(cli, hcb_load(&y->leaf[i]), indent);
 }
 
 static void
@@ -368,11 +628,36 @@ hcb_cleaner(void *priv)
 		VTAILQ_CONCAT(&dead_h, &cool_h, hoh_list);
 		Lck_Unlock(&hcb_mtx);
 		WRK_SumStat(&ww);
-		TIM_sleep(params->critbit_cooloff);
+		if (!hcb_lockfree)
+			TIM_sleep(params->critbit_cooloff);
+		else if (!VSTAILQ_EMPTY(&dead_y) || !VTAILQ_EMPTY(&dead_h))
+			hcb_synchronize();
+		else
+			TIM_sleep(0.1);
 	}
 	NEEDLESS_RETURN(NULL);
 }
 
+/*--------------------------------------------------------------------
+ * The ->init method allows the management process to pass arguments
+ */
+
+static void
+hcb_init(int ac, char * const *av)
+{
+
+	if (ac == 0)
+		return;
+	if (ac > 1)
+		ARGV_ERR("(-hcritbit) too many arguments\n");
+	if (strcmp(av[0], "lockfree"))
+		ARGV_ERR("(-hcritbit) unknown argument \"%s\"\n", av[0]);
+#ifndef HAVE_SYNC_BUILTINS
+	ARGV_ERR("(-hcritbit) lockfree mode not supported on this platform\n");
+#endif
+	hcb_lockfree = 1;
+}
+
 /*--------------------------------------------------------------------*/
 
 static void
@@ -392,28 +677,69 @@ hcb_start(void)
 static int
 hcb_deref(struct objhead *oh)
 {
+	volatile unsigned *ep = NULL;
 	int r;
 
 	r = 1;
 	CHECK_OBJ_NOTNULL(oh, OBJHEAD_MAGIC);
+	/* Keep the cleaner off oh until we have let go of its lock */
+	if (hcb_lockfree)
+		ep = hcb_enter(oh);
 	Lck_Lock(&oh->mtx);
 	assert(oh->refcnt > 0);
 	oh->refcnt--;
 	if (oh->refcnt == 0) {
 		Lck_Lock(&hcb_mtx);
-		hcb_delete(&hcb_root, oh);
+		if (hcb_lockfree)
+			hcb_delete_lf(&hcb_root, oh);
+		else
+			hcb_delete(&hcb_root, oh);
 		VTAILQ_INSERT_TAIL(&cool_h, oh, hoh_list);
 		Lck_Unlock(&hcb_mtx);
 		assert(VTAILQ_EMPTY(&oh->objcs));
 		AZ(oh->waitinglist);
 	}
 	Lck_Unlock(&oh->mtx);
+	if (ep != NULL)
+		hcb_leave(ep);
 #ifdef PHK
 	fprintf(stderr, "hcb_defef %d %d <%s>\n", __LINE__, r, oh->hash);
 #endif
 	return (r);
 }
 
+static struct objhead *
+hcb_lookup_lf(const struct sess *sp, struct objhead *noh)
+{
+	struct objhead *oh;
+	volatile unsigned *ep;
+	unsigned u;
+
+	VSC_C_main->hcb_nolock++;
+	while (1) {
+		ep = hcb_enter(sp->wrk);
+		oh = hcb_insert_lf(sp->wrk, &hcb_root, noh);
+		if (oh == noh) {
+			hcb_leave(ep);
+			VSC_C_main->hcb_insert++;
+			assert(oh->refcnt > 0);
+			return (oh);
+		}
+
+		/* The epoch keeps oh from being freed until we leave */
+		Lck_Lock(&oh->mtx);
+		u = oh->refcnt;
+		if (u > 0)
+			oh->refcnt++;
+		Lck_Unlock(&oh->mtx);
+		hcb_leave(ep);
+		if (u > 0)
+			return (oh);
+		/* It was on its way out, by now it is out of the tree */
+		VSC_C_main->hcb_retry++;
+	}
+}
+
 static struct objhead *
 hcb_lookup(const struct sess *sp, struct objhead *noh)
 {
@@ -422,7 +748,8 @@ hcb_lookup(const struct sess *sp, struct objhead *noh)
 	unsigned u;
 	unsigned with_lock;
 
-	(void)sp;
+	if (hcb_lockfree)
+		return (hcb_lookup_lf(sp, noh));
 
 	with_lock = 0;
 	while (1) {
@@ -467,6 +794,7 @@ hcb_lookup(const struct sess *sp, struct objhead *noh)
 		Lck_Unlock(&oh->mtx);
 		if (u > 0)
 			return (oh);
+		VSC_C_main->hcb_retry++;
 	}
 }
 
@@ -484,6 +812,7 @@ hcb_prep(const struct sess *sp)
 const struct hash_slinger hcb_slinger = {
 	.magic  =	SLINGER_MAGIC,
 	.name   =	"critbit",
+	.init   =	hcb_init,
 	.start  =	hcb_start,
 	.lookup =	hcb_lookup,
 	.prep =		hcb_prep,
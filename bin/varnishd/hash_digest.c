@@ -0,0 +1,283 @@
+/*-
+ * Copyright (c) 2011 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Digest functions for the lookup key.
+ *
+ * sha256 is the default, and runs on the SHA extensions of the CPU if
+ * it has them (see SHA256_Select()).
+ *
+ * murmur3 is MurmurHash3 x64_128, which costs a fraction of sha256 but
+ * makes no attempt to be collision resistant:  Anybody who can choose
+ * the URL or Host: header can craft two requests which get the same
+ * object.  Only use it where the clients are trusted.  The 128 bit
+ * result goes into the first half of the digest, the rest is zero.
+ *
+ * The digest is also the key of objects in persistent silos, so these
+ * must be cleared when changing this.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "libvarnish.h"
+#include "vcli.h"
+#include "cli_priv.h"
+#include "common.h"
+#include "vend.h"
+#include "vsha256.h"
+#include "hash_digest.h"
+
+const struct hsh_digest *hsh_digest = &hsd_sha256;
+
+/*--------------------------------------------------------------------*/
+
+static void
+hsd_sha256_init(struct hsh_ctx *ctx)
+{
+
+	SHA256_Init(&ctx->u.sha256);
+}
+
+static void
+hsd_sha256_update(struct hsh_ctx *ctx, const void *p, size_t l)
+{
+
+	SHA256_Update(&ctx->u.sha256, p, l);
+}
+
+static void
+hsd_sha256_final(struct hsh_ctx *ctx, unsigned char *digest)
+{
+
+	SHA256_Final(digest, &ctx->u.sha256);
+}
+
+const struct hsh_digest hsd_sha256 = {
+	.magic =	HSH_DIGEST_MAGIC,
+	.name =		"sha256",
+	.init =		hsd_sha256_init,
+	.update =	hsd_sha256_update,
+	.final =	hsd_sha256_final,
+};
+
+/*--------------------------------------------------------------------*/
+
+#define MH3_C1	0x87c37b91114253d5ULL
+#define MH3_C2	0x4cf5ad432745937fULL
+#define ROTL64(x, n)	(((x) << (n)) | ((x) >> (64 - (n))))
+
+static inline uint64_t
+mh3_fmix(uint64_t k)
+{
+
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return (k);
+}
+
+static inline uint64_t
+mh3_k1(uint64_t k1)
+{
+
+	k1 *= MH3_C1;
+	k1 = ROTL64(k1, 31);
+	return (k1 * MH3_C2);
+}
+
+static inline uint64_t
+mh3_k2(uint64_t k2)
+{
+
+	k2 *= MH3_C2;
+	k2 = ROTL64(k2, 33);
+	return (k2 * MH3_C1);
+}
+
+static void
+mh3_block(struct hsh_mh3ctx *c, const unsigned char *p)
+{
+
+	c->h1 ^= mh3_k1(vle64dec(p));
+	c->h1 = ROTL64(c->h1, 27);
+	c->h1 += c->h2;
+	c->h1 = c->h1 * 5 + 0x52dce729;
+
+	c->h2 ^= mh3_k2(vle64dec(p + 8));
+	c->h2 = ROTL64(c->h2, 31);
+	c->h2 += c->h1;
+	c->h2 = c->h2 * 5 + 0x38495ab5;
+}
+
+static void
+hsd_murmur3_init(struct hsh_ctx *ctx)
+{
+
+	memset(&ctx->u.mh3, 0, sizeof ctx->u.mh3);
+}
+
+static void
+hsd_murmur3_update(struct hsh_ctx *ctx, const void *ptr, size_t len)
+{
+	struct hsh_mh3ctx *c = &ctx->u.mh3;
+	const unsigned char *p = ptr;
+	unsigned r, l;
+
+	r = c->len & 15;
+	c->len += len;
+	if (r > 0) {
+		l = 16 - r;
+		if (l > len) {
+			memcpy(c->buf + r, p, len);
+			return;
+		}
+		memcpy(c->buf + r, p, l);
+		mh3_block(c, c->buf);
+		p += l;
+		len -= l;
+	}
+	for (; len >= 16; p += 16, len -= 16)
+		mh3_block(c, p);
+	memcpy(c->buf, p, len);
+}
+
+static void
+hsd_murmur3_final(struct hsh_ctx *ctx, unsigned char *digest)
+{
+	struct hsh_mh3ctx *c = &ctx->u.mh3;
+	uint64_t k1 = 0, k2 = 0;
+	unsigned r, u;
+
+	r = c->len & 15;
+	for (u = r; u > 8; u--)
+		k2 = (k2 << 8) | c->buf[u - 1];
+	for (; u > 0; u--)
+		k1 = (k1 << 8) | c->buf[u - 1];
+	if (r > 8)
+		c->h2 ^= mh3_k2(k2);
+	if (r > 0)
+		c->h1 ^= mh3_k1(k1);
+
+	c->h1 ^= c->len;
+	c->h2 ^= c->len;
+	c->h1 += c->h2;
+	c->h2 += c->h1;
+	c->h1 = mh3_fmix(c->h1);
+	c->h2 = mh3_fmix(c->h2);
+	c->h1 += c->h2;
+	c->h2 += c->h1;
+
+	memset(digest, 0, SHA256_LEN);
+	vle64enc(digest, c->h1);
+	vle64enc(digest + 8, c->h2);
+	memset(c, 0, sizeof *c);
+}
+
+const struct hsh_digest hsd_murmur3 = {
+	.magic =	HSH_DIGEST_MAGIC,
+	.name =		"murmur3",
+	.init =		hsd_murmur3_init,
+	.update =	hsd_murmur3_update,
+	.final =	hsd_murmur3_final,
+};
+
+/*--------------------------------------------------------------------
+ * A few test-vectors, fed in odd sized pieces to exercise the buffer.
+ */
+
+static const struct hsd_test {
+	const char		*input;
+	const unsigned char	output[16];
+} hsd_murmur3_test[] = {
+    { "",
+	{0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00} },
+    { "hello",
+	{0x02, 0x9b, 0xbd, 0x41, 0xb3, 0xa7, 0xd8, 0xcb,
+	 0x19, 0x1d, 0xae, 0x48, 0x6a, 0x90, 0x1e, 0x5b} },
+    { "/index.html#www.example.com#",
+	{0x73, 0xdc, 0x4b, 0xeb, 0xbd, 0x89, 0x0a, 0x35,
+	 0x94, 0x39, 0x59, 0x54, 0x6b, 0xf7, 0x0f, 0x5c} },
+    { "The quick brown fox jumps over the lazy dog",
+	{0x6c, 0x1b, 0x07, 0xbc, 0x7b, 0xbc, 0x4b, 0xe3,
+	 0x47, 0x93, 0x9a, 0xc4, 0xa9, 0x3c, 0x43, 0x7a} },
+    { NULL }
+};
+
+static void
+hsd_test(const struct hsh_digest *hd)
+{
+	const struct hsd_test *p;
+	struct hsh_ctx ctx;
+	unsigned char o[SHA256_LEN];
+	size_t l, u;
+
+	if (hd != &hsd_murmur3)
+		return;
+	for (p = hsd_murmur3_test; p->input != NULL; p++) {
+		hd->init(&ctx);
+		l = strlen(p->input);
+		for (u = 0; u < l; u += 7)
+			hd->update(&ctx, p->input + u, l - u < 7 ? l - u : 7);
+		hd->final(&ctx, o);
+		assert(!memcmp(o, p->output, sizeof p->output));
+	}
+}
+
+/*--------------------------------------------------------------------*/
+
+static const struct hsh_digest * const hsd_digests[] = {
+	&hsd_sha256,
+	&hsd_murmur3,
+	NULL,
+};
+
+void
+HSH_tweak_digest(struct cli *cli, const char *arg)
+{
+	int i;
+
+	if (arg == NULL) {
+		VCLI_Out(cli, "%s (", hsh_digest->name);
+		for (i = 0; hsd_digests[i] != NULL; i++)
+			VCLI_Out(cli, "%s%s", i == 0 ? "" : ", ",
+			    hsd_digests[i]->name);
+		VCLI_Out(cli, ")");
+		return;
+	}
+	for (i = 0; hsd_digests[i] != NULL; i++) {
+		if (!strcmp(arg, hsd_digests[i]->name)) {
+			hsd_test(hsd_digests[i]);
+			hsh_digest = hsd_digests[i];
+			return;
+		}
+	}
+	VCLI_Out(cli, "Unknown digest");
+	VCLI_SetResult(cli, CLIS_PARAM);
+}
@@ -0,0 +1,60 @@
+/*-
+ * Copyright (c) 2011 Varnish Software AS
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * The digest functions which turn the hash_data() strings into the
+ * lookup key.  You must #include "vsha256.h" before this file.
+ */
+
+struct hsh_mh3ctx {
+	uint64_t		h1, h2;
+	uint64_t		len;
+	unsigned char		buf[16];
+};
+
+struct hsh_ctx {
+	union {
+		struct SHA256Context	sha256;
+		struct hsh_mh3ctx	mh3;
+	} u;
+};
+
+typedef void hsh_dinit_f(struct hsh_ctx *);
+typedef void hsh_dupdate_f(struct hsh_ctx *, const void *, size_t);
+typedef void hsh_dfinal_f(struct hsh_ctx *, unsigned char *digest);
+
+struct hsh_digest {
+	unsigned		magic;
+#define HSH_DIGEST_MAGIC	0x4c3b8f21
+	const char		*name;
+	hsh_dinit_f		*init;
+	hsh_dupdate_f		*update;
+	hsh_dfinal_f		*final;
+};
+
+extern const struct hsh_digest hsd_sha256;
+extern const struct hsh_digest hsd_murmur3;
+
+/* The one selected with the hash_digest parameter */
+extern const struct hsh_digest *hsh_digest;
@@ -55,9 +55,16 @@ void HSH_Prealloc(const struct sess *sp);
 void HSH_Cleanup(struct worker *w);
 struct objcore *HSH_Lookup(struct sess *sp, struct objhead **poh);
 void HSH_Unbusy(const struct sess *sp);
+void HSH_StreamStart(const struct sess *sp, ssize_t clen);
+void HSH_StreamPoll(const struct object *o);
+unsigned HSH_StreamFreeze(const struct object *o);
+void HSH_StreamFail(const struct object *o);
+void HSH_StreamRelease(struct worker *w);
 void HSH_Ref(struct objcore *o);
 void HSH_Drop(struct sess *sp);
 void HSH_Init(void);
+void HSH_DigestInit(const struct sess *sp);
+void HSH_DigestFinal(struct sess *sp);
 void HSH_AddString(const struct sess *sp, const char *str);
 struct objcore *HSH_Insert(const struct sess *sp);
 void HSH_Purge(const struct sess *, struct objhead *, double ttl, double grace);
@@ -69,6 +76,34 @@ struct waitinglist {
 	unsigned		magic;
 #define WAITINGLIST_MAGIC	0x063a477a
 	VTAILQ_HEAD(, sess)	list;
+	unsigned		nwait;
+};
+
+VTAILQ_HEAD(objcorehead, objcore);
+
+/*
+ * Index of the objects on an objhead by their Vary: header values, so
+ * lookups need not look at every variant.  Objects are hashed with
+ * VRY_Key() into buckets, and there is a copy of the header names for
+ * each distinct Vary: seen, for hashing the request with VRY_ReqKey().
+ * Objects we cannot index go on the plain list and are always checked.
+ */
+
+#define VRYIDX_NSPEC		4
+
+struct vryspec {
+	uint8_t			*names;
+	unsigned		refcnt;
+};
+
+struct vryidx {
+	unsigned		magic;
+#define VRYIDX_MAGIC		0x4b2fd16e
+	unsigned		nobj;
+	unsigned		nbucket;
+	struct objcorehead	*bucket;
+	struct objcorehead	plain;
+	struct vryspec		spec[VRYIDX_NSPEC];
 };
 
 struct objhead {
@@ -77,9 +112,10 @@ struct objhead {
 
 	int			refcnt;
 	struct lock		mtx;
-	VTAILQ_HEAD(,objcore)	objcs;
+	struct objcorehead	objcs;
 	unsigned char		digest[DIGEST_LEN];
 	struct waitinglist	*waitinglist;
+	struct vryidx		*vryidx;
 
 	/*----------------------------------------------------
 	 * The fields below are for the sole private use of
@@ -92,6 +92,7 @@ struct params {
 	unsigned		wthread_stats_rate;
 	unsigned		wthread_stacksize;
 	unsigned		wthread_workspace;
+	unsigned		wthread_bgfetch;
 
 	unsigned		queue_max;
 
@@ -109,8 +110,10 @@ struct params {
 	/* Acceptor hints */
 	unsigned		sess_timeout;
 	unsigned		pipe_timeout;
+	unsigned		pipe_relay;
 	unsigned		send_timeout;
 	unsigned		idle_send_timeout;
+	unsigned		send_coalesce;
 
 	/* Management hints */
 	unsigned		auto_restart;
@@ -119,12 +122,24 @@ struct params {
 	unsigned		fetch_chunksize;
 	unsigned		fetch_maxchunksize;
 	unsigned		nuke_limit;
+	unsigned		stream_follow;
+	unsigned		fetch_conditional;
+
+	/* Waiting list */
+	unsigned		waitinglist_bulk;
+	unsigned		waitinglist_max;
+	unsigned		waitinglist_grace;
 
 #ifdef SENDFILE_WORKS
 	/* Sendfile object minimum size */
 	unsigned		sendfile_threshold;
 #endif
 
+#ifdef ZEROCOPY_WORKS
+	/* MSG_ZEROCOPY storage segment minimum size */
+	unsigned		zerocopy_threshold;
+#endif
+
 	/* VCL traces */
 	unsigned		vcl_trace;
 
@@ -155,11 +170,25 @@ struct params {
 
 	/* Default connection_timeout */
 	double			connect_timeout;
+	double			connect_fallback;
+
+	/* DNS director resolver */
+	char			*dns_hosts_file;
+
+	/* Backend connection pool */
+	unsigned		backend_idle_min;
+	double			backend_idle_timeout;
+	unsigned		backend_max_requests;
+	double			backend_pool_sleep;
 
 	/* Read timeouts for backend */
 	double			first_byte_timeout;
 	double			between_bytes_timeout;
 
+	/* Hedged backend requests */
+	unsigned		hedge_percentile;
+	unsigned		hedge_budget;
+
 	/* How long to linger on sessions */
 	unsigned		session_linger;
 
@@ -217,8 +246,14 @@ struct params {
 	unsigned		gzip_level;
 	unsigned		gzip_window;
 	unsigned		gzip_memlevel;
+	unsigned		gzip_threads;
+	unsigned		gzip_block;
+	unsigned		gunzip_cache;
+	unsigned		zstd_level;
+	unsigned		zstd_window;
 
 	double			critbit_cooloff;
+	unsigned		classic_load_factor;
 
 	double			shortlived;
 
@@ -42,6 +42,7 @@ LOCK(wstat)
 LOCK(herder)
 LOCK(wq)
 LOCK(objhdr)
+LOCK(busyobj)
 LOCK(exp)
 LOCK(lru)
 LOCK(cli)
@@ -50,4 +51,7 @@ LOCK(ban_trash)
 LOCK(vbp)
 LOCK(vbe)
 LOCK(backend)
+LOCK(dirdns)
+LOCK(hedge)
+LOCK(pgzip)
 /*lint -restore */
@@ -432,6 +432,16 @@ tweak_string(struct cli *cli, const struct parspec *par, const char *arg)
 
 /*--------------------------------------------------------------------*/
 
+static void
+tweak_hash_digest(struct cli *cli, const struct parspec *par, const char *arg)
+{
+
+	(void)par;
+	HSH_tweak_digest(cli, arg);
+}
+
+/*--------------------------------------------------------------------*/
+
 static void
 tweak_waiter(struct cli *cli, const struct parspec *par, const char *arg)
 {
@@ -606,6 +616,15 @@ static const struct parspec input_parspec[] = {
 		"this many seconds, the session is closed.\n",
 		0,
 		"60", "seconds" },
+	{ "pipe_relay", tweak_bool, &master.pipe_relay, 0, 0,
+		"Hand established PIPE sessions to a relay thread which "
+		"moves the data with splice(2), instead of occupying a "
+		"worker thread for the lifetime of the connection.\n"
+		"Each relayed session uses two kernel pipes, that is four "
+		"additional file descriptors.\n"
+		"Only available on systems with epoll(2) and splice(2).",
+		EXPERIMENTAL,
+		"off", "bool" },
 	{ "send_timeout", tweak_timeout, &master.send_timeout, 0, 0,
 		"Send timeout for client connections. "
 		"If the HTTP response hasn't been transmitted in this many\n"
@@ -620,6 +639,14 @@ static const struct parspec input_parspec[] = {
 		"See setsockopt(2) under SO_SNDTIMEO for more information.",
 		DELAYED_EFFECT,
 		"60", "seconds" },
+	{ "send_coalesce", tweak_uint, &master.send_coalesce, 0, 1048576,
+		"Size of the per worker thread buffer small writes to "
+		"clients and backends are copied into, so that they can "
+		"go out with fewer iovecs and fewer writev(2) calls.\n"
+		"Writes up to 1/8th of this size are copied.\n"
+		"Zero disables coalescing.",
+		DELAYED_EFFECT,
+		"8192", "bytes" },
 	{ "auto_restart", tweak_bool, &master.auto_restart, 0, 0,
 		"Restart child process automatically if it dies.\n",
 		0,
@@ -635,6 +662,9 @@ static const struct parspec input_parspec[] = {
 		"The default chunksize used by fetcher. "
 		"This should be bigger than the majority of objects with "
 		"short TTLs.\n"
+		"For bodies without a Content-Length this is the size of "
+		"the first chunk, each following chunk is as large as the "
+		"body received so far, up to 32 times this.\n"
 		"Internal limits in the storage_file module makes increases "
 		"above 128kb a dubious idea.",
 		EXPERIMENTAL,
@@ -646,6 +676,45 @@ static const struct parspec input_parspec[] = {
 		"fragmentation.\n",
 		EXPERIMENTAL,
 		"262144", "kilobytes" },
+	{ "fetch_conditional", tweak_bool, &master.fetch_conditional, 0, 0,
+		"On a miss, if we still have an expired copy of the object "
+		"in its grace or keep period, and it has an ETag or "
+		"Last-Modified header, ask the backend if it has changed.  "
+		"If the backend answers 304, the body of the expired copy "
+		"is copied into the new object instead of being fetched "
+		"again.",
+		0,
+		"on", "bool" },
+	{ "stream_follow", tweak_bool, &master.stream_follow, 0, 0,
+		"Let requests for an object which is being fetched with "
+		"beresp.do_stream deliver the body as it arrives, instead "
+		"of waiting for the fetch to complete.\n"
+		"Conditional and Range requests still wait, so they can "
+		"get a 304 or 206.",
+		0,
+		"on", "bool" },
+	{ "waitinglist_bulk", tweak_bool, &master.waitinglist_bulk, 0, 0,
+		"When a fetch completes, hand the new object directly to "
+		"the requests waiting for it which can use it, instead of "
+		"restarting them rush_exponent at a time to look it up "
+		"again.",
+		EXPERIMENTAL,
+		"on", "bool" },
+	{ "waitinglist_max", tweak_uint, &master.waitinglist_max,
+		0, UINT_MAX,
+		"Maximum number of requests waiting for a busy object.  "
+		"Further requests get a stale copy of the object if "
+		"waitinglist_grace allows and there is one, or a 503 "
+		"error.\n"
+		"Zero means no limit.",
+		EXPERIMENTAL,
+		"0", "requests" },
+	{ "waitinglist_grace", tweak_bool, &master.waitinglist_grace, 0, 0,
+		"Serve requests over waitinglist_max any expired copy of "
+		"the object we still have, regardless of req.grace.  If "
+		"off, or if there is none, they get a 503 error.",
+		EXPERIMENTAL,
+		"on", "bool" },
 #ifdef SENDFILE_WORKS
 	{ "sendfile_threshold",
 		tweak_uint, &master.sendfile_threshold, 0, UINT_MAX,
@@ -653,6 +722,21 @@ static const struct parspec input_parspec[] = {
 		EXPERIMENTAL,
 		"-1", "bytes" },
 #endif /* SENDFILE_WORKS */
+#ifdef ZEROCOPY_WORKS
+	{ "zerocopy_threshold",
+		tweak_uint, &master.zerocopy_threshold, 0, UINT_MAX,
+		"The minimum size of object storage segments transmitted "
+		"with MSG_ZEROCOPY.\n"
+		"The kernel sends these straight from the object storage, "
+		"and the worker thread waits for the completions before "
+		"it lets go of the object.  Pinning the pages is only "
+		"cheaper than copying them for large segments.\n"
+		"The wait lasts until the client has ACK'ed all of it, so "
+		"slow clients hold on to a worker thread for up to "
+		"send_timeout, after which the connection is reset.",
+		EXPERIMENTAL,
+		"-1", "bytes" },
+#endif /* ZEROCOPY_WORKS */
 	{ "vcl_trace", tweak_bool,  &master.vcl_trace, 0, 0,
 		"Trace VCL execution in the shmlog.\n"
 		"Enabling this will allow you to see the path each "
@@ -727,6 +811,54 @@ static const struct parspec input_parspec[] = {
 		"backend request.",
 		0,
 		"0.7", "s" },
+	{ "connect_fallback", tweak_timeout_double,
+		&master.connect_fallback, 0, UINT_MAX,
+		"How long a connect to the preferred address of a backend "
+		"which has both an IPv4 and an IPv6 address may take before "
+		"we also try the other one.  The first connection to be "
+		"established is used.\n"
+		"Once both have been tried, the one which connects faster "
+		"is preferred, otherwise prefer_ipv6 decides.",
+		0,
+		"0.25", "s" },
+	{ "dns_hosts_file", tweak_string, &master.dns_hosts_file, 0, 0,
+		"If set, the DNS director resolver looks names up in this "
+		"file, in /etc/hosts format, instead of asking the system "
+		"resolver.  Mostly useful for testing.",
+		EXPERIMENTAL | MUST_RESTART,
+		"", NULL },
+	{ "backend_idle_min", tweak_uint, &master.backend_idle_min,
+		0, UINT_MAX,
+		"How many idle connections to keep open to each healthy "
+		"backend, so that fetches do not have to wait for a "
+		"connect.  The connection pool thread opens them ahead of "
+		"demand.\n"
+		"They count against the max_connections of the backend.",
+		0,
+		"0", "connections" },
+	{ "backend_idle_timeout", tweak_timeout_double,
+		&master.backend_idle_timeout, 0, UINT_MAX,
+		"Close backend connections which have been idle for this "
+		"long.  Set it below the keep-alive timeout of the "
+		"backends, so that they do not close the connection just "
+		"as we send a request on it.\n"
+		"Zero keeps idle connections until the backend closes them.",
+		0,
+		"60", "s" },
+	{ "backend_max_requests", tweak_uint,
+		&master.backend_max_requests, 0, UINT_MAX,
+		"Close a backend connection after this many requests "
+		"rather than putting it back in the pool.\n"
+		"Zero means no limit.",
+		0,
+		"0", "requests" },
+	{ "backend_pool_sleep", tweak_timeout_double,
+		&master.backend_pool_sleep, 0.001, 60,
+		"How often the connection pool thread closes dead and idle "
+		"backend connections, and opens new ones to fill up to "
+		"backend_idle_min.",
+		EXPERIMENTAL,
+		"0.1", "s" },
 	{ "first_byte_timeout", tweak_timeout_double,
 		&master.first_byte_timeout,0, UINT_MAX,
 		"Default timeout for receiving first byte from backend. "
@@ -737,6 +869,20 @@ static const struct parspec input_parspec[] = {
 		"backend request. This parameter does not apply to pipe.",
 		0,
 		"60", "s" },
+	{ "hedge_percentile", tweak_uint, &master.hedge_percentile, 0, 99,
+		"If the backend has not started to answer a GET or HEAD "
+		"request without a body by this percentile of its first "
+		"byte times, send the request again on a connection from "
+		"the director, and use whichever answers first.\n"
+		"Zero disables hedged requests.",
+		EXPERIMENTAL,
+		"0", "%" },
+	{ "hedge_budget", tweak_uint, &master.hedge_budget, 0, 100,
+		"How many hedged requests we may send, as a percentage of "
+		"all backend requests.  This keeps hedging from piling on "
+		"when a backend is slow for everybody.",
+		EXPERIMENTAL,
+		"5", "%" },
 	{ "between_bytes_timeout", tweak_timeout_double,
 		&master.between_bytes_timeout,0, UINT_MAX,
 		"Default timeout between bytes when receiving data from "
@@ -778,7 +924,8 @@ static const struct parspec input_parspec[] = {
 		"10", "s" },
 	{ "prefer_ipv6", tweak_bool, &master.prefer_ipv6, 0, 0,
 		"Prefer IPv6 address when connecting to backends which "
-		"have both IPv4 and IPv6 addresses.",
+		"have both IPv4 and IPv6 addresses, until we know which "
+		"of them connects faster.",
 		0,
 		"off", "bool" },
 	{ "session_max", tweak_uint,
@@ -898,9 +1045,10 @@ static const struct parspec input_parspec[] = {
 		"support for gzip to:\n"
 		"Accept-Encoding: gzip\n\n"
 		"Clients that do not support gzip will have their "
-		"Accept-Encoding header removed. For more information on how "
-		"gzip is implemented please see the chapter on gzip in the "
-		"Varnish reference.",
+		"Accept-Encoding header removed. zstd is listed first, when "
+		"the client accepts it, for the benefit of beresp.do_zstd. "
+		"For more information on how gzip is implemented please see "
+		"the chapter on gzip in the Varnish reference.",
 		EXPERIMENTAL,
 		"on", "bool" },
 	{ "gzip_tmp_space", tweak_uint, &master.gzip_tmp_space, 0, 2,
@@ -928,6 +1076,40 @@ static const struct parspec input_parspec[] = {
 		"Memory impact is 1=1k, 2=2k, ... 9=256k.",
 		0,
 		"8", ""},
+	{ "gzip_threads", tweak_uint, &master.gzip_threads, 0, 64,
+		"Number of helper threads which compress the bodies of "
+		"objects we gzip, in gzip_block sized pieces, in parallel "
+		"with the fetch.\n"
+		"Zero compresses on the fetching thread, in one go.  "
+		"Bodies which are run through ESI, and bodies without a "
+		"Content-Length of at least gzip_block, are always "
+		"compressed on the fetching thread.",
+		EXPERIMENTAL | MUST_RESTART,
+		"0", "threads" },
+	{ "gzip_block", tweak_uint, &master.gzip_block, 32, 65536,
+		"Size of the pieces bodies are cut into for the gzip_threads "
+		"to compress.  Each piece costs a little compression ratio "
+		"and around three times its size in memory while in "
+		"progress.",
+		EXPERIMENTAL,
+		"128", "kilobytes" },
+	{ "gunzip_cache", tweak_uint, &master.gunzip_cache, 0, UINT_MAX,
+		"After this many deliveries of a gzip'ed object to clients "
+		"which do not support gzip, keep an uncompressed copy of it "
+		"in storage and deliver that instead of gunzip'ing again.  "
+		"The copy shares the TTL and bans of the object.\n"
+		"Zero disables.",
+		EXPERIMENTAL,
+		"0", "deliveries" },
+	{ "zstd_level", tweak_uint, &master.zstd_level, 1, 19,
+		"Zstd compression level for beresp.do_zstd: 1=fast, 19=best.",
+		0,
+		"3", ""},
+	{ "zstd_window", tweak_uint, &master.zstd_window, 10, 27,
+		"Zstd window size for beresp.do_zstd, as a power of two.\n"
+		"The decoder on delivery needs this much memory.",
+		0,
+		"21", ""},
 	{ "gzip_stack_buffer", tweak_uint, &master.gzip_stack_buffer,
 	        2048, UINT_MAX,
 		"Size of stack buffer used for gzip processing.\n"
@@ -947,9 +1129,27 @@ static const struct parspec input_parspec[] = {
 	{ "critbit_cooloff", tweak_timeout_double,
 		&master.critbit_cooloff, 60, 254,
 		"How long time the critbit hasher keeps deleted objheads "
-		"on the cooloff list.\n",
+		"on the cooloff list.  Not used with -hcritbit,lockfree.\n",
 		WIZARD,
 		"180.0", "s" },
+	{ "classic_load_factor", tweak_uint,
+		&master.classic_load_factor, 0, UINT_MAX,
+		"Objheads per bucket above which the classic hasher "
+		"doubles its table.  The buckets are moved to the new "
+		"table a few at a time by subsequent lookups.\n"
+		"Zero keeps the table at the size given with -hclassic.",
+		EXPERIMENTAL,
+		"4", "objheads" },
+	{ "hash_digest", tweak_hash_digest, NULL, 0, 0,
+		"Digest function for the strings given to hash_data().\n"
+		"  sha256 - SHA256, using the CPU SHA extensions if present.\n"
+		"  murmur3 - 128 bit MurmurHash3.  Much cheaper, but clients "
+		"who control the hashed strings can make two URLs collide "
+		"on purpose.  Only use it if the clients are trusted.\n"
+		"Objects in persistent storage cannot be found again after "
+		"changing this.",
+		EXPERIMENTAL | MUST_RESTART,
+		"sha256", NULL },
 	{ "vcl_dir", tweak_string, &mgt_vcl_dir, 0, 0,
 		"Directory from which relative VCL filenames (vcl.load and "
 		"include) are opened.",
@@ -137,6 +137,21 @@ const struct parspec WRK_parspec[] = {
 		"Minimum is 2 threads.",
 		EXPERIMENTAL | DELAYED_EFFECT,
 		"5", "threads" },
+	{ "thread_pool_bgfetch", tweak_uint, &master.wthread_bgfetch,
+		0, UINT_MAX,
+		"Number of worker threads dedicated to background fetches.\n"
+		"\n"
+		"When an object in grace is hit and nobody is fetching it "
+		"already, the client gets the graced object right away and "
+		"one of these threads refreshes it from the backend, with "
+		"a conditional request if the object has a Last-Modified "
+		"or ETag header.\n"
+		"\n"
+		"Zero disables background fetches, clients will then wait "
+		"for the fetch as on a miss, unless somebody else is "
+		"already fetching the object.",
+		EXPERIMENTAL | MUST_RESTART,
+		"0", "threads" },
 	{ "thread_pool_timeout", tweak_timeout, &master.wthread_timeout, 1, 0,
 		"Thread idle threshold.\n"
 		"\n"
@@ -296,7 +296,8 @@ RFC2616_Req_Gzip(const struct sess *sp)
 	/*
 	 * "gzip" is the real thing, but the 'q' value must be nonzero.
 	 * We do not care a hoot if the client prefers some other
-	 * compression more than gzip: Varnish only does gzip.
+	 * compression more than gzip: Objects are stored in one
+	 * encoding, and VCD_ReqAccepts() handles zstd.
 	 */
 	if (http_GetHdrQ(sp->http, H_Accept_Encoding, "gzip") > 0.)
 		return (1);
@@ -507,6 +507,10 @@ cmd_feature(CMD_ARGS)
 #ifdef SO_RCVTIMEO_WORKS
 		if (!strcmp(av[i], "SO_RCVTIMEO_WORKS"))
 			continue;
+#endif
+#ifdef ZEROCOPY_WORKS
+		if (!strcmp(av[i], "ZEROCOPY_WORKS"))
+			continue;
 #endif
 		if (sizeof(void*) == 8 && !strcmp(av[i], "64bit"))
 			continue;
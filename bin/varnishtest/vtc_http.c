@@ -569,7 +569,17 @@ cmd_http_gunzip_body(CMD_ARGS)
 
 	assert(Z_OK == inflateInit2(&vz, 31));
 	i = inflate(&vz, Z_FINISH);
+	/* Some bodies compress better than 10:1 */
+	while (i == Z_BUF_ERROR && vz.avail_out == 0) {
+		p = realloc(p, l * 2L);
+		AN(p);
+		vz.next_out = TRUST_ME(p + l);
+		vz.avail_out = l;
+		l *= 2;
+		i = inflate(&vz, Z_FINISH);
+	}
 	hp->bodyl = vz.total_out;
+	assert(hp->body + hp->bodyl <= hp->rxbuf + hp->nrxbuf);
 	memcpy(hp->body, p, hp->bodyl);
 	free(p);
 	vtc_log(hp->vl, 3, "new bodylen %u", hp->bodyl);
@@ -45,6 +45,8 @@
 
 extern const uint16_t vct_typtab[256];
 
+const char *VCT_FindCRLF(const char *b, const char *e);
+
 static inline int
 vct_is(unsigned char x, uint16_t y)
 {
@@ -93,6 +93,38 @@ struct vrt_dir_random {
 	const struct vrt_dir_random_entry	*members;
 };
 
+/*
+ * A director with consistent hashing
+ */
+
+struct vrt_dir_consistent_entry {
+	int					host;
+	unsigned				weight;
+};
+
+struct vrt_dir_consistent {
+	const char				*name;
+	unsigned				retries;
+	double					balance;
+	unsigned				nmember;
+	const struct vrt_dir_consistent_entry	*members;
+};
+
+/*
+ * A director which picks the least loaded of two random backends
+ */
+
+struct vrt_dir_least_conn_entry {
+	int					host;
+};
+
+struct vrt_dir_least_conn {
+	const char				*name;
+	unsigned				retries;
+	unsigned				nmember;
+	const struct vrt_dir_least_conn_entry	*members;
+};
+
 /*
  * A director with round robin selection
  */
@@ -119,6 +151,7 @@ struct vrt_dir_dns {
 	const char				*name;
 	const char				*suffix;
 	const double				ttl;
+	const double				negative_ttl;
 	unsigned				nmember;
 	const struct vrt_dir_dns_entry		*members;
 };
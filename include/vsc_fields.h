@@ -48,6 +48,9 @@ VSC_F(client_req,		uint64_t, 1, 'a', "Client requests received", "")
 
 VSC_F(cache_hit,		uint64_t, 1, 'a', "Cache hits", "")
 VSC_F(cache_hitpass,	uint64_t, 1, 'a', "Cache hits for pass", "")
+VSC_F(cache_hitstream,	uint64_t, 1, 'a', "Cache hits on objects being streamed", "")
+VSC_F(cache_hitbulk,	uint64_t, 1, 'a', "Cache hits handed over from the waiting list", "")
+VSC_F(cache_busyfull,	uint64_t, 1, 'a', "Requests over waitinglist_max", "")
 VSC_F(cache_miss,		uint64_t, 1, 'a', "Cache misses", "")
 
 VSC_F(backend_conn,	uint64_t, 0, 'a', "Backend conn. success", "")
@@ -58,6 +61,9 @@ VSC_F(backend_reuse,	uint64_t, 0, 'a', "Backend conn. reuses", "")
 VSC_F(backend_toolate,	uint64_t, 0, 'a', "Backend conn. was closed", "")
 VSC_F(backend_recycle,	uint64_t, 0, 'a', "Backend conn. recycles", "")
 VSC_F(backend_retry,	uint64_t, 0, 'a', "Backend conn. retry", "")
+VSC_F(backend_prewarm,	uint64_t, 0, 'a', "Backend conn. opened ahead", "")
+VSC_F(backend_idle_close,	uint64_t, 0, 'a', "Backend conn. idle too long", "")
+VSC_F(backend_maxreq,	uint64_t, 0, 'a', "Backend conn. max requests", "")
 
 VSC_F(fetch_head,		uint64_t, 1, 'a', "Fetch head", "")
 VSC_F(fetch_length,		uint64_t, 1, 'a', "Fetch with Length", "")
@@ -71,6 +77,12 @@ VSC_F(fetch_failed,		uint64_t, 1, 'a', "Fetch failed", "")
 VSC_F(fetch_1xx,		uint64_t, 1, 'a', "Fetch no body (1xx)", "")
 VSC_F(fetch_204,		uint64_t, 1, 'a', "Fetch no body (204)", "")
 VSC_F(fetch_304,		uint64_t, 1, 'a', "Fetch no body (304)", "")
+VSC_F(fetch_revalidated,	uint64_t, 1, 'a', "Fetch body copied after a 304", "")
+VSC_F(fetch_bg,		uint64_t, 1, 'a', "Background fetches", "")
+VSC_F(fetch_bg_304,	uint64_t, 1, 'a', "Background fetches not modified", "")
+VSC_F(fetch_bg_drop,	uint64_t, 1, 'a', "Background fetches not queued", "")
+VSC_F(fetch_reads,		uint64_t, 1, 'a', "Fetch body read(2) calls", "")
+VSC_F(fetch_segments,	uint64_t, 1, 'a', "Fetch body storage segments", "")
 
 /*---------------------------------------------------------------------
  * Session Memory
@@ -86,6 +98,8 @@ VSC_F(n_objecthead,		uint64_t, 1, 'i', "N struct objecthead", "")
 VSC_F(n_waitinglist,		uint64_t, 1, 'i', "N struct waitinglist", "")
 
 VSC_F(n_vbc,		uint64_t, 0, 'i', "N struct vbc", "")
+VSC_F(n_pipe_relay,		uint64_t, 0, 'i', "N relayed pipe sessions", "")
+VSC_F(pipe_relay,		uint64_t, 0, 'a', "Pipe sessions relayed", "")
 VSC_F(n_wrk,		uint64_t, 0, 'i', "N worker threads", "")
 VSC_F(n_wrk_create,	uint64_t, 0, 'a', "N worker threads created", "")
 VSC_F(n_wrk_failed,	uint64_t, 0, 'a',
@@ -104,16 +118,25 @@ VSC_F(losthdr,		uint64_t, 0, 'a', "HTTP header overflows", "")
 
 VSC_F(n_objsendfile,	uint64_t, 0, 'a', "Objects sent with sendfile", "")
 VSC_F(n_objwrite,		uint64_t, 0, 'a', "Objects sent with write", "")
+VSC_F(n_objhdrblock,	uint64_t, 0, 'a',
+					"Objects sent with prebuilt headers", "")
+VSC_F(n_objzerocopy,	uint64_t, 0, 'a',
+					"Storage segments sent with MSG_ZEROCOPY", "")
 VSC_F(n_objoverflow,	uint64_t, 1, 'a',
 					"Objects overflowing workspace", "")
 
 VSC_F(s_sess,		uint64_t, 1, 'a', "Total Sessions", "")
 VSC_F(s_req,		uint64_t, 1, 'a', "Total Requests", "")
 VSC_F(s_pipe,		uint64_t, 1, 'a', "Total pipe", "")
+VSC_F(s_pipe_relay_bytes,	uint64_t, 0, 'a', "Total relayed pipe bytes", "")
 VSC_F(s_pass,		uint64_t, 1, 'a', "Total pass", "")
 VSC_F(s_fetch,		uint64_t, 1, 'a', "Total fetch", "")
 VSC_F(s_hdrbytes,		uint64_t, 1, 'a', "Total header bytes", "")
 VSC_F(s_bodybytes,		uint64_t, 1, 'a', "Total body bytes", "")
+VSC_F(s_wrw_syscalls,	uint64_t, 1, 'a', "Total write syscalls", "")
+VSC_F(s_wrw_bytes,		uint64_t, 1, 'a', "Total bytes in write syscalls", "")
+VSC_F(s_wrw_zccopied,	uint64_t, 1, 'a',
+					"Zerocopy sends copied by kernel", "")
 
 VSC_F(sess_closed,		uint64_t, 1, 'a', "Session Closed", "")
 VSC_F(sess_pipeline,	uint64_t, 1, 'a', "Session Pipeline", "")
@@ -134,6 +157,13 @@ VSC_F(sms_balloc,		uint64_t, 0, 'i', "SMS bytes allocated", "")
 VSC_F(sms_bfree,		uint64_t, 0, 'i', "SMS bytes freed", "")
 
 VSC_F(backend_req,		uint64_t, 0, 'a', "Backend requests made", "")
+VSC_F(backend_hedge,	uint64_t, 0, 'a', "Backend requests hedged", "")
+VSC_F(backend_hedge_win,	uint64_t, 0, 'a',
+    "Hedged requests answered first", "")
+VSC_F(backend_hedge_loss,	uint64_t, 0, 'a',
+    "Hedged requests answered last", "")
+VSC_F(backend_hedge_budget,	uint64_t, 0, 'a',
+    "Hedges not sent, over budget", "")
 
 VSC_F(n_vcl,		uint64_t, 0, 'a', "N vcl total", "")
 VSC_F(n_vcl_avail,		uint64_t, 0, 'a', "N vcl available", "")
@@ -168,6 +198,10 @@ VSC_F(n_expired4,                uint64_t, 0, 'i', "N expired objects alg. conti
 VSC_F(hcb_nolock,		uint64_t, 0, 'a', "HCB Lookups without lock", "")
 VSC_F(hcb_lock,		uint64_t, 0, 'a', "HCB Lookups with lock", "")
 VSC_F(hcb_insert,		uint64_t, 0, 'a', "HCB Inserts", "")
+VSC_F(hcb_retry,		uint64_t, 0, 'a', "HCB Lookup retries", "")
+VSC_F(hcb_conflict,		uint64_t, 0, 'a', "HCB Insert conflicts", "")
+VSC_F(hcl_grow,		uint64_t, 0, 'a', "HCL Table grows", "")
+VSC_F(hcl_nbucket,		uint64_t, 0, 'i', "HCL Buckets in table", "")
 
 VSC_F(esi_errors,		uint64_t, 0, 'a', "ESI parse errors (unlock)", "")
 VSC_F(esi_warnings,		uint64_t, 0, 'a', "ESI parse warnings (unlock)", "")
@@ -179,11 +213,18 @@ VSC_F(dir_dns_lookups,	uint64_t, 0, 'a', "DNS director lookups", "")
 VSC_F(dir_dns_failed,	uint64_t, 0, 'a', "DNS director failed lookups", "")
 VSC_F(dir_dns_hit,		uint64_t, 0, 'a', "DNS director cached lookups hit", "")
 VSC_F(dir_dns_cache_full,	uint64_t, 0, 'a', "DNS director full dnscache", "")
+VSC_F(dir_dns_refresh,	uint64_t, 0, 'a',
+    "DNS director background refreshes", "")
 
 VSC_F(vmods,		uint64_t, 0, 'i', "Loaded VMODs", "")
 
 VSC_F(n_gzip,			uint64_t, 0, 'a', "Gzip operations", "")
 VSC_F(n_gunzip,			uint64_t, 0, 'a', "Gunzip operations", "")
+VSC_F(n_gzip_block,		uint64_t, 1, 'a', "Gzip blocks compressed by helpers", "")
+VSC_F(n_gunzip_copy,		uint64_t, 1, 'a', "Uncompressed copies made", "")
+VSC_F(n_gunzip_copy_hit,	uint64_t, 1, 'a', "Deliveries of uncompressed copies", "")
+VSC_F(n_codec_encode,		uint64_t, 1, 'a', "Bodies encoded with zstd", "")
+VSC_F(n_codec_decode,		uint64_t, 1, 'a', "Deliveries decoded from zstd", "")
 
 #endif
 
@@ -233,6 +274,19 @@ VSC_F(g_smf_large,		uint64_t, 0, 'i', "N large free smf", "")
 
 VSC_F(vcls,			uint64_t, 0, 'i', "VCL references", "")
 VSC_F(happy,		uint64_t, 0, 'b', "Happy health probes", "")
+VSC_F(fb_latency,		uint64_t, 0, 'i', "Avg. first byte time (us)", "")
+VSC_F(connect_1ms,		uint64_t, 0, 'a', "Connects under 1ms", "")
+VSC_F(connect_10ms,		uint64_t, 0, 'a', "Connects under 10ms", "")
+VSC_F(connect_100ms,		uint64_t, 0, 'a', "Connects under 100ms", "")
+VSC_F(connect_1s,		uint64_t, 0, 'a', "Connects under 1s", "")
+VSC_F(connect_10s,		uint64_t, 0, 'a', "Connects under 10s", "")
+VSC_F(connect_more,		uint64_t, 0, 'a', "Connects 10s or more", "")
+VSC_F(reuse_1ms,		uint64_t, 0, 'a', "Reuses idle under 1ms", "")
+VSC_F(reuse_10ms,		uint64_t, 0, 'a', "Reuses idle under 10ms", "")
+VSC_F(reuse_100ms,		uint64_t, 0, 'a', "Reuses idle under 100ms", "")
+VSC_F(reuse_1s,		uint64_t, 0, 'a', "Reuses idle under 1s", "")
+VSC_F(reuse_10s,		uint64_t, 0, 'a', "Reuses idle under 10s", "")
+VSC_F(reuse_more,		uint64_t, 0, 'a', "Reuses idle 10s or more", "")
 
 #endif
 
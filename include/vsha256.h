@@ -43,5 +43,6 @@ void	SHA256_Init(SHA256_CTX *);
 void	SHA256_Update(SHA256_CTX *, const void *, size_t);
 void	SHA256_Final(unsigned char [SHA256_LEN], SHA256_CTX *);
 void	SHA256_Test(void);
+const char *SHA256_Select(int accel);
 
 #endif /* !_SHA256_H_ */
@@ -98,3 +98,5 @@ SLTM(Backend_health)
 SLTM(VCL_Log)
 
 SLTM(Gzip)
+
+SLTM(PipeAcct)
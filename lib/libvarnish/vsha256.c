@@ -42,6 +42,11 @@
 #define VBIG_ENDIAN	_BIG_ENDIAN
 #endif
 
+#ifdef HAVE_SHA_NI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #include "libvarnish.h"
 #include "vsha256.h"
 #include "vend.h"
@@ -202,6 +207,106 @@ SHA256_Transform(uint32_t * state, const unsigned char block[64])
 		state[i] += S[i];
 }
 
+#ifdef HAVE_SHA_NI
+/*
+ * The same compression function using the x86 SHA extensions.  The
+ * state is kept as ABEF/CDGH pairs in two xmm registers while the
+ * rounds run, and the message schedule is done four words at a time.
+ */
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void __attribute__((target("sha,sse4.1")))
+SHA256_Transform_NI(uint32_t * state, const unsigned char block[64])
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	    0x0405060700010203ULL);
+	__m128i S0, S1, ABEF, CDGH, M[4], m, t;
+	int i;
+
+	/* 1. Shuffle state into ABEF and CDGH order. */
+	t = _mm_shuffle_epi32(_mm_loadu_si128((const void *)&state[0]), 0xb1);
+	S1 = _mm_shuffle_epi32(_mm_loadu_si128((const void *)&state[4]), 0x1b);
+	S0 = _mm_alignr_epi8(t, S1, 8);
+	S1 = _mm_blend_epi16(S1, t, 0xf0);
+	ABEF = S0;
+	CDGH = S1;
+
+	/* 2. Mix, four rounds per step. */
+	for (i = 0; i < 16; i++) {
+		if (i < 4)
+			M[i] = _mm_shuffle_epi8(
+			    _mm_loadu_si128((const void *)(block + 16 * i)),
+			    bswap);
+		m = _mm_add_epi32(M[i & 3],
+		    _mm_loadu_si128((const void *)&K[4 * i]));
+		S1 = _mm_sha256rnds2_epu32(S1, S0, m);
+		if (i >= 3 && i <= 14) {
+			t = _mm_alignr_epi8(M[i & 3], M[(i - 1) & 3], 4);
+			M[(i + 1) & 3] = _mm_add_epi32(M[(i + 1) & 3], t);
+			M[(i + 1) & 3] =
+			    _mm_sha256msg2_epu32(M[(i + 1) & 3], M[i & 3]);
+		}
+		m = _mm_shuffle_epi32(m, 0x0e);
+		S0 = _mm_sha256rnds2_epu32(S0, S1, m);
+		if (i >= 1 && i <= 12)
+			M[(i - 1) & 3] =
+			    _mm_sha256msg1_epu32(M[(i - 1) & 3], M[i & 3]);
+	}
+
+	/* 3. Mix into global state, back in ABCD and EFGH order */
+	S0 = _mm_add_epi32(S0, ABEF);
+	S1 = _mm_add_epi32(S1, CDGH);
+	t = _mm_shuffle_epi32(S0, 0x1b);
+	S1 = _mm_shuffle_epi32(S1, 0xb1);
+	_mm_storeu_si128((void *)&state[0], _mm_blend_epi16(t, S1, 0xf0));
+	_mm_storeu_si128((void *)&state[4], _mm_alignr_epi8(S1, t, 8));
+}
+#endif
+
+/*
+ * Pick the fastest compression function this CPU can run.  Unless
+ * told otherwise with SHA256_Select(), this happens on first use.
+ */
+
+static void (*sha256_transform)(uint32_t *, const unsigned char *);
+
+const char *
+SHA256_Select(int accel)
+{
+#ifdef HAVE_SHA_NI
+	unsigned a, b, c, d;
+
+	if (accel && __get_cpuid_count(7, 0, &a, &b, &c, &d) &&
+	    (b & (1U << 29)) && __get_cpuid(1, &a, &b, &c, &d) &&
+	    (c & (1U << 19))) {
+		sha256_transform = SHA256_Transform_NI;
+		return ("sha-ni");
+	}
+#else
+	(void)accel;
+#endif
+	sha256_transform = SHA256_Transform;
+	return ("c");
+}
+
 static const unsigned char PAD[64] = {
 	0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -237,6 +342,9 @@ void
 SHA256_Init(SHA256_CTX * ctx)
 {
 
+	if (sha256_transform == NULL)
+		(void)SHA256_Select(1);
+
 	/* Zero bits processed so far */
 	ctx->count = 0;
 
@@ -270,7 +378,7 @@ SHA256_Update(SHA256_CTX * ctx, const void *in, size_t len)
 		ctx->count += l;
 		r = ctx->count & 0x3f;
 		if (r == 0)
-			SHA256_Transform(ctx->state, ctx->buf);
+			sha256_transform(ctx->state, ctx->buf);
 	}
 }
 
@@ -322,12 +430,17 @@ SHA256_Test(void)
 	struct SHA256Context c;
 	const struct sha256test *p;
 	unsigned char o[32];
-
-	for (p = sha256test; p->input != NULL; p++) {
-		SHA256_Init(&c);
-		SHA256_Update(&c, p->input, strlen(p->input));
-		SHA256_Final(o, &c);
-		assert(!memcmp(o, p->output, 32));
+	int accel;
+
+	/* Check the portable code, then whatever we will be running */
+	for (accel = 0; accel < 2; accel++) {
+		(void)SHA256_Select(accel);
+		for (p = sha256test; p->input != NULL; p++) {
+			SHA256_Init(&c);
+			SHA256_Update(&c, p->input, strlen(p->input));
+			SHA256_Final(o, &c);
+			assert(!memcmp(o, p->output, 32));
+		}
 	}
 }
 
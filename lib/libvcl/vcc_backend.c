@@ -695,7 +695,9 @@ static const struct dirlist {
 	{ "hash",		vcc_ParseRandomDirector },
 	{ "random",		vcc_ParseRandomDirector },
 	{ "client",		vcc_ParseRandomDirector },
+	{ "consistent",		vcc_ParseConsistentDirector },
 	{ "round-robin",	vcc_ParseRoundRobinDirector },
+	{ "least-conn",		vcc_ParseLeastConnDirector },
 	{ "fallback",		vcc_ParseRoundRobinDirector },
 	{ "dns",		vcc_ParseDnsDirector },
 	{ NULL,		NULL }
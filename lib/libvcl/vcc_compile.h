@@ -232,6 +232,12 @@ char *TlDupTok(struct vcc *tl, const struct token *tok);
 
 void EncString(struct vsb *sb, const char *b, const char *e, int mode);
 
+/* vcc_dir_consistent.c */
+parsedirector_f vcc_ParseConsistentDirector;
+
+/* vcc_dir_least_conn.c */
+parsedirector_f vcc_ParseLeastConnDirector;
+
 /* vcc_dir_random.c */
 parsedirector_f vcc_ParseRandomDirector;
 
@@ -239,6 +245,7 @@ parsedirector_f vcc_ParseRandomDirector;
 parsedirector_f vcc_ParseRoundRobinDirector;
 
 /* vcc_expr.c */
+double vcc_DoubleVal(struct vcc *tl);
 void vcc_RTimeVal(struct vcc *tl, double *);
 void vcc_TimeVal(struct vcc *tl, double *);
 unsigned vcc_UintVal(struct vcc *tl);
@@ -287,14 +287,15 @@ void
 vcc_ParseDnsDirector(struct vcc *tl)
 {
 	struct token *t_field, *t_be, *t_suffix = NULL;
-	double ttl = 60.0;
+	double ttl = 60.0, negative_ttl = 10.0;
 	int nelem = 0;
 	struct fld_spec *fs;
 	const char *first;
 	char *p;
 	dns_first = tl->t;
 	tl->fb = tl->fc;
-	fs = vcc_FldSpec(tl, "!backend", "?ttl", "?suffix","?list", NULL);
+	fs = vcc_FldSpec(tl, "!backend", "?ttl", "?negative_ttl", "?suffix",
+	    "?list", NULL);
 
 	Fc(tl, 0, "\nstatic const struct vrt_dir_dns_entry "
 	    "vddnse_%.*s[] = {\n", PF(tl->t_dir));
@@ -343,6 +344,9 @@ vcc_ParseDnsDirector(struct vcc *tl)
 			} else if (vcc_IdIs(t_field, "ttl")) {
 				vcc_RTimeVal(tl, &ttl);
 				ExpectErr(tl, ';');
+			} else if (vcc_IdIs(t_field, "negative_ttl")) {
+				vcc_RTimeVal(tl, &negative_ttl);
+				ExpectErr(tl, ';');
 			} else if (vcc_IdIs(t_field, "list")) {
 				vcc_dir_dns_parse_list(tl,&nelem);
 			}
@@ -363,5 +367,7 @@ vcc_ParseDnsDirector(struct vcc *tl)
 	Fc(tl, 0, ",\n");
 	Fc(tl, 0, "\t.ttl = %f", ttl);
 	Fc(tl, 0, ",\n");
+	Fc(tl, 0, "\t.negative_ttl = %f", negative_ttl);
+	Fc(tl, 0, ",\n");
 	Fc(tl, 0, "};\n");
 }
@@ -145,7 +145,7 @@ vcc_NumVal(struct vcc *tl, double *d, int *frac)
 	vcc_NextToken(tl);
 }
 
-static double
+double
 vcc_DoubleVal(struct vcc *tl)
 {
 	double d;